@@ -0,0 +1,179 @@
+/*
+ * buffer_pool.cpp
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "buffer_pool.hpp"
+
+using namespace std;
+
+pthread_mutex_t buffer_pool::lock = PTHREAD_MUTEX_INITIALIZER;
+char *buffer_pool::free_blocks[BUFFER_POOL_MAX_SIZE_SHIFT + 1];
+unsigned int buffer_pool::cached_bytes = 0;
+unsigned int buffer_pool::cache_limit = BUFFER_POOL_DEFAULT_CACHE_LIMIT;
+
+char *buffer_pool::allocate(unsigned int & size)
+{
+
+	int shift;
+	char *buffer;
+
+	if ((shift = size_class(size)) == -1)
+	{
+		return NULL;
+	}
+	size = 1U << shift;
+
+	// Reuse a released block if there is one
+	pthread_mutex_lock(&lock);
+	buffer = free_blocks[shift];
+	if (buffer != NULL)
+	{
+		free_blocks[shift] = *(char **) buffer;
+		cached_bytes -= size;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (buffer != NULL)
+	{
+		return buffer;
+	}
+
+	if (size >= BUFFER_POOL_HUGE_SIZE)
+	{
+		return map_block(size);
+	}
+
+	return (char *) malloc(size);
+
+}
+
+void buffer_pool::release(char *buffer, unsigned int size)
+{
+
+	int shift;
+
+	if (buffer == NULL)
+	{
+		return;
+	}
+
+	shift = size_class(size);
+
+	// Keep block for reuse if cache limit allows
+	pthread_mutex_lock(&lock);
+	if (cached_bytes + size <= cache_limit)
+	{
+		*(char **) buffer = free_blocks[shift];
+		free_blocks[shift] = buffer;
+		cached_bytes += size;
+		buffer = NULL;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (buffer == NULL)
+	{
+		return;
+	}
+
+	if (size >= BUFFER_POOL_HUGE_SIZE)
+	{
+		munmap(buffer, size);
+	}
+	else
+	{
+		free(buffer);
+	}
+
+	return;
+
+}
+
+void buffer_pool::set_cache_limit(unsigned int bytes)
+{
+
+	int shift;
+	char *buffer;
+
+	pthread_mutex_lock(&lock);
+	cache_limit = bytes;
+
+	// Return blocks beyond the new limit to the system (largest first)
+	for (shift = BUFFER_POOL_MAX_SIZE_SHIFT; (shift >= BUFFER_POOL_MIN_SIZE_SHIFT) &&
+		(cached_bytes > cache_limit); shift--)
+	{
+		while ((free_blocks[shift] != NULL) && (cached_bytes > cache_limit))
+		{
+			buffer = free_blocks[shift];
+			free_blocks[shift] = *(char **) buffer;
+			cached_bytes -= 1U << shift;
+			if ((1U << shift) >= BUFFER_POOL_HUGE_SIZE)
+				munmap(buffer, 1U << shift);
+			else
+				free(buffer);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	return;
+
+}
+
+int buffer_pool::size_class(unsigned int size)
+{
+
+	int shift;
+
+	for (shift = BUFFER_POOL_MIN_SIZE_SHIFT; shift <= BUFFER_POOL_MAX_SIZE_SHIFT; shift++)
+	{
+		if ((1U << shift) >= size)
+		{
+			return shift;
+		}
+	}
+
+	return -1; // Too large
+
+}
+
+char *buffer_pool::map_block(unsigned int size)
+{
+
+	void *buffer;
+
+	// Explicit huge pages are only available if the administrator reserved some (vm.nr_hugepages)
+	buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (buffer != MAP_FAILED)
+	{
+		return (char *) buffer;
+	}
+
+	// Fall back to normal pages, with a hint for transparent huge pages
+	buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffer == MAP_FAILED)
+	{
+		return NULL;
+	}
+	madvise(buffer, size, MADV_HUGEPAGE);
+
+	return (char *) buffer;
+
+}
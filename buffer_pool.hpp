@@ -0,0 +1,55 @@
+/*
+ * buffer_pool.hpp
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <pthread.h>
+
+#define BUFFER_POOL_MIN_SIZE_SHIFT					12 // Smallest block 4 kB
+#define BUFFER_POOL_MAX_SIZE_SHIFT					30 // Largest block 1 GB
+#define BUFFER_POOL_HUGE_SIZE						(2 * 1024 * 1024) // Blocks this large use huge pages
+#define BUFFER_POOL_DEFAULT_CACHE_LIMIT				(16 * 1024 * 1024) // Bytes kept for reuse
+
+using namespace std;
+
+// Process-wide pool of session buffers. Block sizes are powers of two. Released blocks are kept for reuse
+// (up to the cache limit) so sessions that are opened and closed frequently don't go back to the system
+// each time. Blocks of BUFFER_POOL_HUGE_SIZE and up are mapped with huge pages where the system allows.
+class buffer_pool
+{
+
+public:
+	static char *allocate(unsigned int & size); // Rounds size up to block size, NULL = out of memory
+	static void release(char *buffer, unsigned int size); // Size as returned by allocate
+	static void set_cache_limit(unsigned int bytes); // 0 = don't keep released blocks
+
+private:
+	static int size_class(unsigned int size);
+	static char *map_block(unsigned int size);
+	static pthread_mutex_t lock;
+	static char *free_blocks[BUFFER_POOL_MAX_SIZE_SHIFT + 1]; // Released blocks per size class (linked)
+	static unsigned int cached_bytes; // Bytes held in free_blocks
+	static unsigned int cache_limit;
+
+};
+
+#endif
@@ -0,0 +1,952 @@
+/*
+ * hislip_session.cpp
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#include <string>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <endian.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "hislip_session.hpp"
+
+using namespace std;
+
+// Decodes a message header, returns false if the prologue ("HS") is missing
+static bool decode_header(const char *raw, unsigned char & type, unsigned char & control, uint32_t & parameter,
+	uint64_t & length)
+{
+
+	uint32_t parameter_be;
+	uint64_t length_be;
+
+	if ((raw[0] != 'H') || (raw[1] != 'S'))
+	{
+		return false;
+	}
+
+	type = raw[2];
+	control = raw[3];
+	memcpy(&parameter_be, raw + 4, 4);
+	memcpy(&length_be, raw + 8, 8);
+	parameter = be32toh(parameter_be);
+	length = be64toh(length_be);
+
+	return true;
+
+}
+
+hislip_session::hislip_session(string address, string sub_address, unsigned short int port, bool lock,
+	unsigned int lock_timeout, io_monitor *monitor)
+{
+
+	message_header response;
+	uint64_t size;
+	int flag = 1;
+
+	// Initialize member variables
+	timeout_ms = 5000; // 5 s
+	term_char_enable = 1; // Termination character enabled
+	term_character = '\n';
+	eol_char = '\n';
+	string_size = 200;
+	throw_on_scpi_error = 1;
+	tracing = 0;
+	wait_lock = 1;
+	set_end_indicator = 1;
+	this->monitor = monitor;
+	async_socket = -1;
+	reply_margin = 0;
+	message_id = HISLIP_SESSION_FIRST_MESSAGE_ID;
+	most_recent_message_id = HISLIP_SESSION_FIRST_MESSAGE_ID - 2;
+	rmt_delivered = false;
+	sync_header_count = 0;
+	in_message = false;
+	message_end = false;
+	read_message_id = 0;
+	payload_remaining = 0;
+	srq_pending = false;
+	srq_status = 0;
+
+	// Event used by abort (possibly from another thread) to wake up blocked reads/writes
+	if ((abort_event = eventfd(0, EFD_NONBLOCK)) == -1)
+	{
+		throw_opentmlib_error(-errno);
+	}
+
+	// Synchronous channel
+	if ((sync_socket = tcp_connector::connect_host(address, port, HISLIP_SESSION_CONNECT_TIMEOUT)) == -1)
+	{
+		close(abort_event);
+		throw_opentmlib_error(-OPENTMLIB_ERROR_HISLIP_CONNECTION);
+	}
+	setsockopt(sync_socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+
+	try
+	{
+
+		// Initialize (opens the session, instrument chooses the mode and assigns the session ID)
+		operation_deadline deadline_scope(this);
+		send_message(sync_socket, HISLIP_INITIALIZE, 0,
+			(HISLIP_SESSION_PROTOCOL_VERSION << 16) | HISLIP_SESSION_VENDOR_ID, sub_address.c_str(),
+			sub_address.length());
+		receive_header(sync_socket, response);
+		check_error_message(sync_socket, response);
+		discard_payload(sync_socket, response.length);
+		if (response.type != HISLIP_INITIALIZE_RESPONSE)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_HISLIP_PROTOCOL);
+		}
+		overlapped = ((response.control & 1) == 1);
+		session_id = response.parameter & 0xffff;
+
+		// Asynchronous channel
+		int remaining = remaining_time();
+		if ((async_socket = tcp_connector::connect_host(address, port, (remaining == -1) ? 0 :
+			((remaining > 0) ? remaining : 1))) == -1)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_HISLIP_CONNECTION);
+		}
+		setsockopt(async_socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+		async_transaction(HISLIP_ASYNC_INITIALIZE, 0, session_id, NULL, 0, HISLIP_ASYNC_INITIALIZE_RESPONSE,
+			response);
+
+		// Exchange maximum message sizes
+		size = htobe64(HISLIP_SESSION_MAX_MESSAGE_SIZE);
+		async_transaction(HISLIP_ASYNC_MAXIMUM_MESSAGE_SIZE, 0, 0, (char *) &size, 8,
+			HISLIP_ASYNC_MAXIMUM_MESSAGE_SIZE_RESPONSE, response, (char *) &size, 8);
+		if (response.length != 8)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_HISLIP_PROTOCOL);
+		}
+		max_message_size = be64toh(size);
+
+		if (lock == true)
+		{
+			lock_device(lock_timeout * 1000);
+		}
+
+	}
+
+	catch (opentmlib_exception & e)
+	{
+		close_sockets();
+		throw e;
+	}
+
+	return;
+
+}
+
+hislip_session::~hislip_session()
+{
+
+	// Send writes still held back by coalescing (errors can't be reported any more)
+	try
+	{
+		flush();
+	}
+
+	catch (opentmlib_exception & e)
+	{
+	}
+
+	// Instrument releases locks and ends the session when the connections are closed
+	close_sockets();
+
+	return;
+
+}
+
+void hislip_session::close_sockets()
+{
+
+	if (async_socket != -1)
+		close(async_socket);
+	if (sync_socket != -1)
+		close(sync_socket);
+	close(abort_event);
+
+	return;
+
+}
+
+void hislip_session::begin_operation()
+{
+
+	uint64_t count;
+
+	// An abort applies to the operation it interrupts. One left over from before (e.g. issued just after
+	// the previous operation ended) is dropped, the event is non-blocking.
+	if ((read(abort_event, &count, sizeof(uint64_t)) == -1) && (errno != EAGAIN))
+	{
+		throw_opentmlib_error(-errno);
+	}
+
+	return;
+
+}
+
+void hislip_session::wait_ready(int fd, bool for_write, bool abortable)
+{
+
+	struct pollfd fds[2];
+	int ret, remaining, nfds;
+
+	fds[0].fd = fd;
+	fds[0].events = (for_write == true) ? POLLOUT : POLLIN;
+	fds[1].fd = abort_event;
+	fds[1].events = POLLIN;
+	nfds = (abortable == true) ? 2 : 1;
+
+	// Timeout is what is left of the operation's deadline
+	remaining = remaining_time();
+	if (remaining != -1)
+		remaining += reply_margin;
+
+	do
+	{
+		ret = poll(fds, nfds, remaining);
+	}
+	while ((ret == -1) && (errno == EINTR));
+	if (ret == -1)
+	{
+		throw_opentmlib_error(-errno);
+	}
+	if (ret == 0)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_TIMEOUT);
+	}
+
+	if ((abortable == true) && (fds[1].revents & POLLIN))
+	{
+		// Abort requested, reset event. Receive state is kept, so the rest of an interrupted message is
+		// still handled correctly by the next read.
+		uint64_t count;
+		if (read(abort_event, &count, sizeof(uint64_t)) == -1)
+		{
+			throw_opentmlib_error(-errno);
+		}
+		throw_opentmlib_error(-OPENTMLIB_ERROR_TRANSACTION_ABORTED);
+	}
+
+	return;
+
+}
+
+int hislip_session::receive_some(int fd, char *buffer, int length, bool abortable)
+{
+
+	int ret;
+
+	// Try to receive first, wait only if nothing is there
+	while ((ret = recv(fd, buffer, length, MSG_DONTWAIT)) == -1)
+	{
+		if (errno == EAGAIN)
+			wait_ready(fd, false, abortable);
+		else if (errno != EINTR)
+			throw_opentmlib_error(-errno);
+	}
+
+	if (ret == 0)
+	{
+		// Connection closed by instrument
+		throw_opentmlib_error(-OPENTMLIB_ERROR_IO_ISSUE);
+	}
+
+	return ret;
+
+}
+
+void hislip_session::receive_exact(int fd, char *buffer, int length)
+{
+
+	int done = 0;
+
+	while (done < length)
+	{
+		done += receive_some(fd, buffer + done, length - done, false);
+	}
+
+	return;
+
+}
+
+void hislip_session::send_message(int fd, unsigned char type, unsigned char control, uint32_t parameter,
+	const char *payload, uint64_t length)
+{
+
+	char header[HISLIP_SESSION_HEADER_SIZE];
+	struct iovec parts[2];
+	struct msghdr message;
+	uint32_t parameter_be;
+	uint64_t length_be;
+	int segments, first, ret;
+	bool started = false;
+
+	header[0] = 'H';
+	header[1] = 'S';
+	header[2] = type;
+	header[3] = control;
+	parameter_be = htobe32(parameter);
+	length_be = htobe64(length);
+	memcpy(header + 4, &parameter_be, 4);
+	memcpy(header + 8, &length_be, 8);
+
+	// Header and payload go out together
+	parts[0].iov_base = header;
+	parts[0].iov_len = HISLIP_SESSION_HEADER_SIZE;
+	parts[1].iov_base = (void *) payload;
+	parts[1].iov_len = length;
+	segments = (length > 0) ? 2 : 1;
+	first = 0;
+
+	while (first < segments)
+	{
+
+		memset(&message, 0, sizeof(struct msghdr));
+		message.msg_iov = &parts[first];
+		message.msg_iovlen = segments - first;
+		if ((ret = sendmsg(fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL)) == -1)
+		{
+			// Abort is only possible before the first byte went out (a partial message can't be taken back)
+			if (errno == EAGAIN)
+				wait_ready(fd, true, (fd == sync_socket) && (started == false));
+			else if (errno != EINTR)
+				throw_opentmlib_error(-errno);
+			continue;
+		}
+		started = true;
+
+		// Skip what was sent
+		while ((first < segments) && ((unsigned int) ret >= parts[first].iov_len))
+		{
+			ret -= parts[first].iov_len;
+			first++;
+		}
+		if (first < segments)
+		{
+			parts[first].iov_base = (char *) parts[first].iov_base + ret;
+			parts[first].iov_len -= ret;
+		}
+
+	}
+
+	return;
+
+}
+
+void hislip_session::receive_header(int fd, message_header & header)
+{
+
+	char raw[HISLIP_SESSION_HEADER_SIZE];
+
+	receive_exact(fd, raw, HISLIP_SESSION_HEADER_SIZE);
+	if (decode_header(raw, header.type, header.control, header.parameter, header.length) == false)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_HISLIP_PROTOCOL);
+	}
+
+	return;
+
+}
+
+void hislip_session::discard_payload(int fd, uint64_t length)
+{
+
+	char scratch[4096];
+
+	while (length > 0)
+	{
+		length -= receive_some(fd, scratch, (length < sizeof(scratch)) ? length : sizeof(scratch), false);
+	}
+
+	return;
+
+}
+
+void hislip_session::check_error_message(int fd, message_header & header)
+{
+
+	if ((header.type != HISLIP_ERROR) && (header.type != HISLIP_FATAL_ERROR))
+	{
+		return;
+	}
+
+	// Payload is a message for humans
+	discard_payload(fd, header.length);
+
+	if (header.type == HISLIP_FATAL_ERROR)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_HISLIP_FATAL_ERROR);
+	}
+	throw_opentmlib_error(-OPENTMLIB_ERROR_HISLIP_ERROR);
+
+}
+
+// Sends a message on the asynchronous channel and waits for the response of the given type. Service
+// requests arriving in the meantime are recorded for wait_srq.
+void hislip_session::async_transaction(unsigned char type, unsigned char control, uint32_t parameter,
+	const char *payload, uint64_t length, unsigned char response_type, message_header & response,
+	char *response_payload, unsigned int response_max)
+{
+
+	unsigned int part;
+	operation_deadline deadline_scope(this);
+
+	send_message(async_socket, type, control, parameter, payload, length);
+
+	while (true)
+	{
+
+		receive_header(async_socket, response);
+		check_error_message(async_socket, response);
+
+		if (response.type == HISLIP_ASYNC_SERVICE_REQUEST)
+		{
+			srq_pending = true;
+			srq_status = response.control;
+			discard_payload(async_socket, response.length);
+			continue;
+		}
+
+		if (response.type == HISLIP_ASYNC_INTERRUPTED)
+		{
+			// Response to an earlier query was dropped by the instrument (synchronized mode)
+			discard_payload(async_socket, response.length);
+			continue;
+		}
+
+		if (response.type != response_type)
+		{
+			discard_payload(async_socket, response.length);
+			throw_opentmlib_error(-OPENTMLIB_ERROR_HISLIP_PROTOCOL);
+		}
+
+		part = (response.length < response_max) ? response.length : response_max;
+		receive_exact(async_socket, response_payload, part);
+		discard_payload(async_socket, response.length - part);
+		break;
+
+	}
+
+	return;
+
+}
+
+int hislip_session::write_buffer(char *buffer, int count)
+{
+
+	uint64_t max_payload;
+	unsigned char type;
+	int this_chunk, done;
+	operation_deadline deadline_scope(this); // All messages share one deadline
+
+	flush(); // Writes held back by coalescing go first
+
+	// Break buffer into messages the instrument accepts
+	max_payload = (max_message_size > HISLIP_SESSION_HEADER_SIZE) ? max_message_size - HISLIP_SESSION_HEADER_SIZE : 1;
+	if (max_payload > INT_MAX)
+		max_payload = INT_MAX;
+	done = 0;
+
+	do
+	{
+
+		this_chunk = ((uint64_t) (count - done) > max_payload) ? max_payload : count - done;
+		if ((set_end_indicator == 1) && (done + this_chunk == count))
+			type = HISLIP_DATA_END;
+		else
+			type = HISLIP_DATA;
+
+		send_message(sync_socket, type, rmt_delivered ? 1 : 0, message_id, buffer + done, this_chunk);
+		rmt_delivered = false;
+		most_recent_message_id = message_id;
+		message_id += 2;
+
+		done += this_chunk;
+
+	}
+	while (done < count);
+
+	return done;
+
+}
+
+// Reads until the end of a message (END, i.e. DataEnd) or until max bytes were read. Messages can be
+// read in pieces. In synchronized mode, data belonging to anything but the last message sent is dropped.
+int hislip_session::read_buffer(char *buffer, int max)
+{
+
+	message_header header;
+	char scratch[4096];
+	int done, ret;
+	bool stale;
+	operation_deadline deadline_scope(this);
+
+	flush(); // Held back writes (the command this read is for) go first
+
+	done = 0;
+
+	while (true)
+	{
+
+		if (in_message == false)
+		{
+
+			if (done == max)
+				break;
+
+			// Receive next header (kept across calls, so an abort can't leave a header half read)
+			while (sync_header_count < HISLIP_SESSION_HEADER_SIZE)
+			{
+				sync_header_count += receive_some(sync_socket, sync_header + sync_header_count,
+					HISLIP_SESSION_HEADER_SIZE - sync_header_count, true);
+			}
+			sync_header_count = 0;
+			if (decode_header(sync_header, header.type, header.control, header.parameter, header.length) == false)
+			{
+				throw_opentmlib_error(-OPENTMLIB_ERROR_HISLIP_PROTOCOL);
+			}
+			check_error_message(sync_socket, header);
+
+			if ((header.type != HISLIP_DATA) && (header.type != HISLIP_DATA_END))
+			{
+				discard_payload(sync_socket, header.length);
+				if (header.type == HISLIP_INTERRUPTED)
+					continue; // Data of interrupted message is dropped below
+				throw_opentmlib_error(-OPENTMLIB_ERROR_HISLIP_PROTOCOL);
+			}
+
+			in_message = true;
+			message_end = (header.type == HISLIP_DATA_END);
+			read_message_id = header.parameter;
+			payload_remaining = header.length;
+
+		}
+
+		stale = (overlapped == false) && (read_message_id != most_recent_message_id);
+
+		if (payload_remaining > 0)
+		{
+			if (stale == true)
+			{
+				ret = receive_some(sync_socket, scratch,
+					(payload_remaining < sizeof(scratch)) ? payload_remaining : sizeof(scratch), true);
+			}
+			else
+			{
+				if (done == max)
+					break;
+				ret = receive_some(sync_socket, buffer + done,
+					(payload_remaining < (uint64_t) (max - done)) ? payload_remaining : max - done, true);
+				done += ret;
+			}
+			payload_remaining -= ret;
+		}
+
+		if (payload_remaining == 0)
+		{
+			in_message = false;
+			if ((message_end == true) && (stale == false))
+			{
+				rmt_delivered = true;
+				break;
+			}
+		}
+
+	}
+
+	return done;
+
+}
+
+void hislip_session::set_attribute(unsigned int attribute, unsigned int value)
+{
+
+	// Check if attribute is known to parent class
+	try
+	{
+		base_set_attribute(attribute, value);
+		return;
+	}
+
+	catch (opentmlib_exception & e)
+	{
+		if (e.code != -OPENTMLIB_ERROR_BAD_ATTRIBUTE)
+		{
+			// Attribute was processed by parent class but an error was thrown. Pass up...
+			throw e;
+		}
+	}
+
+	switch (attribute)
+	{
+
+	case OPENTMLIB_ATTRIBUTE_TRACING:
+		if (value > 1)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE_VALUE);
+		}
+		tracing = value;
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_EOL_CHAR:
+		if (value > 255)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE_VALUE);
+		}
+		eol_char = value;
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT:
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT_MS:
+		set_timeout(attribute, value);
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE:
+		// Reads end with END, which HiSLIP always provides. Setting is kept for compatibility only.
+		if (value > 1)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE_VALUE);
+		}
+		term_char_enable = value;
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_TERM_CHARACTER:
+		if (value > 0xff)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE_VALUE);
+		}
+		term_character = value;
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_WAIT_LOCK:
+		if (value > 1)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE_VALUE);
+		}
+		wait_lock = value;
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_SET_END_INDICATOR:
+		if (value > 1)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE_VALUE);
+		}
+		set_end_indicator = value;
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_HISLIP_OVERLAPPED:
+		if (value > 1)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE_VALUE);
+		}
+		if ((value == 1) != overlapped)
+		{
+			// Mode can only be changed with a device clear, the instrument has the last word
+			clear_device(value == 1);
+			if ((value == 1) != overlapped)
+			{
+				throw_opentmlib_error(-OPENTMLIB_ERROR_OPERATION_UNSUPPORTED);
+			}
+		}
+		break;
+
+	default:
+		throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE);
+
+	}
+
+	return;
+
+}
+
+unsigned int hislip_session::get_attribute(unsigned int attribute)
+{
+
+	// Check if attribute is known to parent class
+	try
+	{
+		unsigned int value;
+		value = base_get_attribute(attribute);
+		return value;
+	}
+
+	catch (opentmlib_exception & e)
+	{
+		if (e.code != -OPENTMLIB_ERROR_BAD_ATTRIBUTE)
+		{
+			// Attribute was processed by parent class but an error was thrown. Pass up...
+			throw e;
+		}
+	}
+
+	switch (attribute)
+	{
+
+	case OPENTMLIB_ATTRIBUTE_TRACING:
+		return tracing;
+
+	case OPENTMLIB_ATTRIBUTE_EOL_CHAR:
+		return eol_char;
+
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT:
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT_MS:
+		return get_timeout(attribute);
+
+	case OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE:
+		return term_char_enable;
+
+	case OPENTMLIB_ATTRIBUTE_TERM_CHARACTER:
+		return term_character;
+
+	case OPENTMLIB_ATTRIBUTE_STATUS_BYTE:
+
+		{
+			message_header response;
+
+			async_transaction(HISLIP_ASYNC_STATUS_QUERY, rmt_delivered ? 1 : 0, most_recent_message_id, NULL, 0,
+				HISLIP_ASYNC_STATUS_RESPONSE, response);
+			rmt_delivered = false;
+
+			return response.control;
+		}
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_WAIT_LOCK:
+		return wait_lock;
+
+	case OPENTMLIB_ATTRIBUTE_SET_END_INDICATOR:
+		return set_end_indicator;
+
+	case OPENTMLIB_ATTRIBUTE_HISLIP_OVERLAPPED:
+		return overlapped ? 1 : 0;
+
+	case OPENTMLIB_ATTRIBUTE_HISLIP_MAX_MESSAGE_SIZE:
+		return (max_message_size > UINT_MAX) ? UINT_MAX : max_message_size;
+
+	default:
+		throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE);
+
+	}
+
+}
+
+void hislip_session::io_operation(unsigned int operation, unsigned int value)
+{
+
+	message_header response;
+
+	flush_for_operation(operation);
+
+	switch (operation)
+	{
+
+	case OPENTMLIB_OPERATION_ABORT:
+		{
+			// Wake up read/write blocked in another thread
+			uint64_t increment = 1;
+			if (write(abort_event, &increment, sizeof(uint64_t)) == -1)
+			{
+				throw_opentmlib_error(-errno);
+			}
+		}
+		break;
+
+	case OPENTMLIB_OPERATION_TRIGGER:
+		{
+			operation_deadline deadline_scope(this);
+			send_message(sync_socket, HISLIP_TRIGGER, rmt_delivered ? 1 : 0, message_id);
+			rmt_delivered = false;
+			most_recent_message_id = message_id;
+			message_id += 2;
+		}
+		break;
+
+	case OPENTMLIB_OPERATION_CLEAR:
+		clear_device(overlapped);
+		break;
+
+	case OPENTMLIB_OPERATION_REMOTE:
+		// Enable remote and go to remote
+		async_transaction(HISLIP_ASYNC_REMOTE_LOCAL_CONTROL, 3, most_recent_message_id, NULL, 0,
+			HISLIP_ASYNC_REMOTE_LOCAL_RESPONSE, response);
+		break;
+
+	case OPENTMLIB_OPERATION_LOCAL:
+		// Go to local (REN and local lockout unchanged)
+		async_transaction(HISLIP_ASYNC_REMOTE_LOCAL_CONTROL, 6, most_recent_message_id, NULL, 0,
+			HISLIP_ASYNC_REMOTE_LOCAL_RESPONSE, response);
+		break;
+
+	case OPENTMLIB_OPERATION_LOCK:
+		{
+			operation_deadline deadline_scope(this);
+			int remaining = remaining_time();
+			if (wait_lock == 0)
+				lock_device(0); // Don't wait, return error if lock not possible
+			else
+				lock_device((remaining == -1) ? 0xffffffff : remaining);
+		}
+		break;
+
+	case OPENTMLIB_OPERATION_UNLOCK:
+		async_transaction(HISLIP_ASYNC_LOCK, 0, most_recent_message_id, NULL, 0, HISLIP_ASYNC_LOCK_RESPONSE,
+			response);
+		if ((response.control != 1) && (response.control != 2))
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_NO_LOCK_HELD);
+		}
+		break;
+
+	case OPENTMLIB_OPERATION_ENABLE_SRQ:
+		// Service requests are always delivered over the asynchronous channel
+		break;
+
+	default:
+		throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_OPERATION);
+
+	}
+
+	return;
+
+}
+
+unsigned int hislip_session::wait_srq()
+{
+
+	message_header header;
+	operation_deadline deadline_scope(this);
+
+	while (srq_pending == false)
+	{
+
+		// Messages on the asynchronous channel are short, only waiting for the first byte can be aborted
+		wait_ready(async_socket, false, true);
+		receive_header(async_socket, header);
+		check_error_message(async_socket, header);
+		if (header.type == HISLIP_ASYNC_SERVICE_REQUEST)
+		{
+			srq_pending = true;
+			srq_status = header.control;
+		}
+		discard_payload(async_socket, header.length);
+
+	}
+
+	srq_pending = false;
+
+	return srq_status;
+
+}
+
+int hislip_session::get_fd()
+{
+
+	return async_socket;
+
+}
+
+void hislip_session::lock_device(unsigned int lock_timeout)
+{
+
+	message_header response;
+
+	// Instrument may use all of the lock timeout before it replies
+	reply_margin = HISLIP_SESSION_REPLY_MARGIN;
+	try
+	{
+		async_transaction(HISLIP_ASYNC_LOCK, 1, lock_timeout, NULL, 0, HISLIP_ASYNC_LOCK_RESPONSE, response);
+	}
+
+	catch (opentmlib_exception & e)
+	{
+		reply_margin = 0;
+		throw e;
+	}
+	reply_margin = 0;
+
+	if (response.control == 0)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_DEVICE_LOCKED);
+	}
+	if (response.control != 1)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_HISLIP_ERROR);
+	}
+
+	return;
+
+}
+
+// Device clear (IVI-6.1 section 6.12). The mode for the rest of the session is negotiated as part of it.
+void hislip_session::clear_device(bool overlap_request)
+{
+
+	message_header header;
+	operation_deadline deadline_scope(this);
+
+	async_transaction(HISLIP_ASYNC_DEVICE_CLEAR, 0, 0, NULL, 0, HISLIP_ASYNC_DEVICE_CLEAR_ACKNOWLEDGE, header);
+
+	// Finish a message partially received before (e.g. by an aborted read), then tell the instrument
+	// the clear is complete and drop everything up to its acknowledge
+	if (sync_header_count > 0)
+	{
+		receive_exact(sync_socket, sync_header + sync_header_count, HISLIP_SESSION_HEADER_SIZE - sync_header_count);
+		sync_header_count = 0;
+		if (decode_header(sync_header, header.type, header.control, header.parameter, header.length) == false)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_HISLIP_PROTOCOL);
+		}
+		payload_remaining = header.length;
+		in_message = true;
+	}
+	if (in_message == true)
+	{
+		discard_payload(sync_socket, payload_remaining);
+		payload_remaining = 0;
+		in_message = false;
+	}
+
+	send_message(sync_socket, HISLIP_DEVICE_CLEAR_COMPLETE, overlap_request ? 1 : 0, 0);
+	do
+	{
+		receive_header(sync_socket, header);
+		check_error_message(sync_socket, header);
+		discard_payload(sync_socket, header.length);
+	}
+	while (header.type != HISLIP_DEVICE_CLEAR_ACKNOWLEDGE);
+
+	overlapped = ((header.control & 1) == 1);
+	message_id = HISLIP_SESSION_FIRST_MESSAGE_ID;
+	most_recent_message_id = HISLIP_SESSION_FIRST_MESSAGE_ID - 2;
+	rmt_delivered = false;
+
+	return;
+
+}
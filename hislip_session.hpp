@@ -0,0 +1,132 @@
+/*
+ * hislip_session.hpp
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#ifndef HISLIP_SESSION_HPP
+#define HISLIP_SESSION_HPP
+
+#include <string>
+#include <stdint.h>
+#include "io_session.hpp"
+#include "io_monitor.hpp"
+#include "tcp_connector.hpp"
+
+#define HISLIP_SESSION_PORT							4880
+#define HISLIP_SESSION_HEADER_SIZE					16
+#define HISLIP_SESSION_PROTOCOL_VERSION				0x0100 // 1.0
+#define HISLIP_SESSION_VENDOR_ID					0x4f54 // "OT"
+#define HISLIP_SESSION_FIRST_MESSAGE_ID				0xffffff00
+#define HISLIP_SESSION_MAX_MESSAGE_SIZE				(1024 * 1024 * 1024) // Accepted from instrument
+#define HISLIP_SESSION_CONNECT_TIMEOUT				5000 // ms
+#define HISLIP_SESSION_REPLY_MARGIN					2000 // ms, see reply_margin
+
+// Message types (IVI-6.1)
+#define HISLIP_INITIALIZE							0
+#define HISLIP_INITIALIZE_RESPONSE					1
+#define HISLIP_FATAL_ERROR							2
+#define HISLIP_ERROR								3
+#define HISLIP_ASYNC_LOCK							4
+#define HISLIP_ASYNC_LOCK_RESPONSE					5
+#define HISLIP_DATA									6
+#define HISLIP_DATA_END								7
+#define HISLIP_DEVICE_CLEAR_COMPLETE				8
+#define HISLIP_DEVICE_CLEAR_ACKNOWLEDGE				9
+#define HISLIP_ASYNC_REMOTE_LOCAL_CONTROL			10
+#define HISLIP_ASYNC_REMOTE_LOCAL_RESPONSE			11
+#define HISLIP_TRIGGER								12
+#define HISLIP_INTERRUPTED							13
+#define HISLIP_ASYNC_INTERRUPTED					14
+#define HISLIP_ASYNC_MAXIMUM_MESSAGE_SIZE			15
+#define HISLIP_ASYNC_MAXIMUM_MESSAGE_SIZE_RESPONSE	16
+#define HISLIP_ASYNC_INITIALIZE						17
+#define HISLIP_ASYNC_INITIALIZE_RESPONSE			18
+#define HISLIP_ASYNC_DEVICE_CLEAR					19
+#define HISLIP_ASYNC_SERVICE_REQUEST				20
+#define HISLIP_ASYNC_STATUS_QUERY					21
+#define HISLIP_ASYNC_STATUS_RESPONSE				22
+#define HISLIP_ASYNC_DEVICE_CLEAR_ACKNOWLEDGE		23
+
+using namespace std;
+
+// HiSLIP (IVI-6.1) instrument session. Commands and responses travel as Data/DataEnd messages on the
+// synchronous channel, device clear, status byte, locking, remote/local and service requests use the
+// asynchronous channel. Payload is sent and received without copying, straight from/to the caller's buffer.
+class hislip_session : public io_session
+{
+
+public:
+	hislip_session(string address, string sub_address = "hislip0", unsigned short int port = HISLIP_SESSION_PORT,
+		bool lock = false, unsigned int lock_timeout = 5, io_monitor *monitor = NULL);
+	~hislip_session();
+	int write_buffer(char *buffer, int count);
+	int read_buffer(char *buffer, int max);
+	void set_attribute(unsigned int attribute, unsigned int value);
+	unsigned int get_attribute(unsigned int attribute);
+	void io_operation(unsigned int operation, unsigned int value);
+	unsigned int wait_srq(); // Wait for service request (until timeout), returns status byte
+	int get_fd(); // Socket descriptor of asynchronous channel (readable when a service request arrives)
+
+protected:
+	void begin_operation(); // Forgets an abort issued while no operation was in progress
+
+private:
+	struct message_header
+	{
+		unsigned char type;
+		unsigned char control;
+		uint32_t parameter;
+		uint64_t length;
+	};
+	void wait_ready(int fd, bool for_write, bool abortable); // Wait for I/O readiness, timeout or abort
+	int receive_some(int fd, char *buffer, int length, bool abortable);
+	void receive_exact(int fd, char *buffer, int length);
+	void send_message(int fd, unsigned char type, unsigned char control, uint32_t parameter,
+		const char *payload = NULL, uint64_t length = 0);
+	void receive_header(int fd, message_header & header);
+	void discard_payload(int fd, uint64_t length);
+	void check_error_message(int fd, message_header & header);
+	void async_transaction(unsigned char type, unsigned char control, uint32_t parameter, const char *payload,
+		uint64_t length, unsigned char response_type, message_header & response, char *response_payload = NULL,
+		unsigned int response_max = 0);
+	void clear_device(bool overlap_request);
+	void lock_device(unsigned int lock_timeout); // Lock timeout in ms
+	void close_sockets();
+	int sync_socket; // Synchronous channel
+	int async_socket; // Asynchronous channel
+	int abort_event; // eventfd signalled by abort
+	unsigned int reply_margin; // Time (ms) added to timeout for replies the instrument may take the timeout for
+	unsigned short session_id;
+	bool overlapped; // Overlapped (1) or synchronized (0) mode
+	uint32_t message_id; // Message ID of next Data, DataEnd or Trigger message
+	uint32_t most_recent_message_id; // Message ID of last message sent
+	bool rmt_delivered; // Complete response delivered since last message sent
+	uint64_t max_message_size; // Largest message the instrument accepts
+	char sync_header[HISLIP_SESSION_HEADER_SIZE]; // Header being received on synchronous channel
+	int sync_header_count; // Bytes of sync_header received
+	bool in_message; // Payload of a Data/DataEnd message is being received
+	bool message_end; // Message being received is DataEnd
+	uint32_t read_message_id; // Message ID of message being received
+	uint64_t payload_remaining; // Payload bytes of message being received not read yet
+	bool srq_pending; // Service request received (but not waited for yet)
+	unsigned char srq_status; // Status byte sent with service request
+
+};
+
+#endif
@@ -20,6 +20,7 @@
  */
 
 #include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
 #include <iostream>
 #include <time.h>
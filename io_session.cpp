@@ -23,15 +23,158 @@
 #include <stdio.h>
 #include <string.h>
 #include <iostream>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <boost/tokenizer.hpp>
 #include <boost/lexical_cast.hpp>
 #include "io_session.hpp"
+#include "buffer_pool.hpp"
 
 using namespace std;
 
+io_session::io_session()
+{
+
+	timeout_ms = 5000; // 5 s
+	operation_depth = 0;
+	deadline_active = false;
+	coalescing = OPENTMLIB_COALESCING_OFF;
+	coalescing_limit = IO_SESSION_COALESCING_LIMIT;
+
+	return;
+
+}
+
+io_session::operation_deadline::operation_deadline(io_session *session)
+{
+
+	this->session = session;
+	armed = false;
+
+	if (session->operation_depth == 0)
+	{
+		session->begin_operation();
+	}
+	session->operation_depth++;
+
+	if (session->deadline_active == true)
+	{
+		// Deadline of enclosing operation applies
+		return;
+	}
+
+	if (session->timeout_ms != 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &session->deadline);
+		session->deadline.tv_sec += session->timeout_ms / 1000;
+		session->deadline.tv_nsec += (session->timeout_ms % 1000) * 1000000;
+		if (session->deadline.tv_nsec >= 1000000000)
+		{
+			session->deadline.tv_sec++;
+			session->deadline.tv_nsec -= 1000000000;
+		}
+		session->deadline_active = true;
+		armed = true;
+	}
+
+	return;
+
+}
+
+io_session::operation_deadline::~operation_deadline()
+{
+
+	session->operation_depth--;
+	if (armed == true)
+	{
+		session->deadline_active = false;
+	}
+
+	return;
+
+}
+
+void io_session::begin_operation()
+{
+
+	return;
+
+}
+
+int io_session::remaining_time()
+{
+
+	struct timespec now;
+	long long remaining_ns;
+
+	if (timeout_ms == 0)
+	{
+		return -1; // Wait forever
+	}
+
+	if (deadline_active == false)
+	{
+		// Not within an operation, full timeout applies
+		return (timeout_ms > INT_MAX) ? INT_MAX : timeout_ms;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	remaining_ns = (long long) (deadline.tv_sec - now.tv_sec) * 1000000000 + (deadline.tv_nsec - now.tv_nsec);
+	if (remaining_ns <= 0)
+	{
+		return 0; // Deadline passed (callers still pick up data that is already there)
+	}
+
+	// Round up, so a wait does not end just before the deadline
+	return (remaining_ns + 999999) / 1000000;
+
+}
+
+void io_session::set_timeout(unsigned int attribute, unsigned int value)
+{
+
+	if (attribute == OPENTMLIB_ATTRIBUTE_TIMEOUT)
+	{
+		if (value > UINT_MAX / 1000)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE_VALUE);
+		}
+		timeout_ms = value * 1000;
+	}
+	else
+	{
+		timeout_ms = value;
+	}
+
+	return;
+
+}
+
+unsigned int io_session::get_timeout(unsigned int attribute)
+{
+
+	if (attribute == OPENTMLIB_ATTRIBUTE_TIMEOUT)
+	{
+		// Round up, so a sub-second timeout does not read back as 0 (wait forever)
+		return timeout_ms / 1000 + ((timeout_ms % 1000) ? 1 : 0);
+	}
+
+	return timeout_ms;
+
+}
+
 int io_session::write_string(string message, bool eol)
 {
 
+	if ((coalescing != OPENTMLIB_COALESCING_OFF) && (eol == true))
+	{
+		return coalesce_write(message);
+	}
+
 	if (eol == true)
 	{
 		// Append EOL character
@@ -54,6 +197,84 @@ int io_session::write_string(string message, bool eol)
 
 }
 
+// Holds a complete message back and joins it with the ones before it, so a sequence of short commands
+// goes to the instrument in one transport write. Returns the length of the message (it is accepted, but
+// errors only show up when the joined writes are sent). Held writes go out when the limit is reached,
+// before anything that waits for the instrument (a read, a device operation) and on flush() or close.
+int io_session::coalesce_write(string & message)
+{
+
+	string separator;
+
+	if ((tracing == 1) && (monitor != NULL))
+	{
+		monitor->log(name, DIRECTION_OUT, message + eol_char, true);
+	}
+
+	if (pending_writes.empty() == false)
+	{
+		if (coalescing == OPENTMLIB_COALESCING_EOL)
+		{
+			separator = eol_char;
+		}
+		else
+		{
+			// A command after ";" continues the header path of the one before it, ":" restarts at the root
+			// as if it was sent on its own (common commands like *RST can't take the ":")
+			separator = ((message.empty() == false) && ((message[0] == '*') || (message[0] == ':'))) ? ";" : ";:";
+		}
+		if (pending_writes.length() + separator.length() + message.length() + 1 > coalescing_limit)
+		{
+			flush();
+			separator.clear();
+		}
+	}
+
+	pending_writes += separator + message;
+
+	// Message too long to be joined with anything else
+	if (pending_writes.length() + 1 > coalescing_limit)
+	{
+		flush();
+	}
+
+	return message.length() + 1;
+
+}
+
+void io_session::flush()
+{
+
+	string data;
+
+	if (pending_writes.empty() == true)
+	{
+		return;
+	}
+
+	// Taken out first, so write_buffer (which flushes before writing) doesn't see it again
+	data.swap(pending_writes);
+	data += eol_char;
+	write_buffer((char *) data.c_str(), data.length());
+
+	return;
+
+}
+
+void io_session::flush_for_operation(unsigned int operation)
+{
+
+	// Abort may come from another thread (pending writes belong to the thread that owns them), session
+	// specific operations are low-level recovery steps. Everything else acts on commands sent before.
+	if ((operation != OPENTMLIB_OPERATION_ABORT) && (operation < OPENTMLIB_OPERATION_USBTMC_ABORT_WRITE))
+	{
+		flush();
+	}
+
+	return;
+
+}
+
 int io_session::write_int(int value, bool eol)
 {
 
@@ -72,6 +293,9 @@ int io_session::write_binblock(char *buffer, int count)
 	char header[100];
 	int ret;
 
+	// Header and data share one deadline
+	operation_deadline deadline_scope(this);
+
 	// Assemble and write header
 	sprintf(length, "%d", count);
 	sprintf(header, "#%d%d", strlen(length), count);
@@ -140,6 +364,268 @@ int io_session::read_int(int & value)
 
 }
 
+off_t io_session::write_binblock_from_file(string path, off_t offset, off_t length)
+{
+
+	int fd;
+	off_t ret;
+
+	if ((fd = open(path.c_str(), O_RDONLY)) == -1)
+	{
+		throw_opentmlib_error(-errno);
+	}
+
+	try
+	{
+		ret = write_binblock_from_file(fd, offset, length);
+	}
+
+	catch (opentmlib_exception & e)
+	{
+		close(fd);
+		throw e;
+	}
+
+	close(fd);
+
+	return ret;
+
+}
+
+// Writes length bytes of the file starting at offset as a binblock. Data goes from the file to the
+// instrument without being read into a user buffer first (how depends on the session type, see
+// write_from_file).
+off_t io_session::write_binblock_from_file(int fd, off_t offset, off_t length)
+{
+
+	struct stat file_info;
+	char header[100];
+	unsigned int end_state = 0;
+	bool end_control = true;
+
+	// Header and data share one deadline
+	operation_deadline deadline_scope(this);
+
+	if (length == -1)
+	{
+		if (fstat(fd, &file_info) == -1)
+		{
+			throw_opentmlib_error(-errno);
+		}
+		if (!S_ISREG(file_info.st_mode))
+		{
+			// Size of a pipe or device isn't known in advance, the caller has to give it
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BINBLOCK_SIZE);
+		}
+		length = file_info.st_size - offset;
+	}
+	if ((offset < 0) || (length < 0) || (length > 999999999))
+	{
+		// Length field of a definite length binblock has at most 9 digits
+		throw_opentmlib_error(-OPENTMLIB_ERROR_BINBLOCK_SIZE);
+	}
+
+	// END may only come with the last byte of the data block
+	try
+	{
+		end_state = get_attribute(OPENTMLIB_ATTRIBUTE_SET_END_INDICATOR);
+	}
+
+	catch (opentmlib_exception & e)
+	{
+		if (e.code != -OPENTMLIB_ERROR_BAD_ATTRIBUTE)
+		{
+			throw e;
+		}
+		end_control = false; // Session has no END indicator
+	}
+	if ((end_control == true) && (end_state == 1) && (length > 0))
+	{
+		set_attribute(OPENTMLIB_ATTRIBUTE_SET_END_INDICATOR, 0);
+	}
+
+	try
+	{
+		sprintf(header, "#%d%lld", snprintf(NULL, 0, "%lld", (long long) length), (long long) length);
+		if (write_buffer(header, strlen(header)) != (int) strlen(header))
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_IO_ISSUE);
+		}
+		if (length > 0)
+		{
+			write_from_file(fd, offset, length, (end_control == true) && (end_state == 1));
+		}
+	}
+
+	catch (opentmlib_exception & e)
+	{
+		if ((end_control == true) && (end_state == 1))
+		{
+			set_attribute(OPENTMLIB_ATTRIBUTE_SET_END_INDICATOR, 1);
+		}
+		throw e;
+	}
+
+	if ((end_control == true) && (end_state == 1))
+	{
+		set_attribute(OPENTMLIB_ATTRIBUTE_SET_END_INDICATOR, 1);
+	}
+
+	if ((tracing == 1) && (monitor != NULL))
+	{
+		stringstream stream;
+		stream << length;
+		monitor->log(name, DIRECTION_OUT, "BINBLOCK (" + stream.str() + " bytes from file)");
+	}
+
+	return length;
+
+}
+
+// Writes part of a file through write_buffer. The file is mapped a window at a time, so memory use
+// stays bounded and nothing is copied before write_buffer. Files that can't be mapped (pipes, FIFOs,
+// character devices) are copied through a buffer instead. If end_on_last is set, the END indicator
+// (disabled by the caller) is enabled again for the last window.
+void io_session::write_from_file(int fd, off_t offset, off_t length, bool end_on_last)
+{
+
+	struct stat file_info;
+	char *window;
+	off_t window_start, end;
+	size_t window_length, chunk;
+	long page_size;
+
+	if (fstat(fd, &file_info) == -1)
+	{
+		throw_opentmlib_error(-errno);
+	}
+	if (!S_ISREG(file_info.st_mode))
+	{
+		copy_from_file(fd, offset, length, end_on_last);
+		return;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	end = offset + length;
+
+	while (offset < end)
+	{
+
+		// Mappings must start at a page boundary
+		window_start = offset - (offset % page_size);
+		window_length = (end - window_start > IO_SESSION_FILE_WINDOW) ? IO_SESSION_FILE_WINDOW : end - window_start;
+		window = (char *) mmap(NULL, window_length, PROT_READ, MAP_SHARED, fd, window_start);
+		if (window == MAP_FAILED)
+		{
+			// E.g. a file system without mmap support, the rest goes through a buffer
+			copy_from_file(fd, offset, end - offset, end_on_last);
+			return;
+		}
+		madvise(window, window_length, MADV_SEQUENTIAL);
+
+		chunk = window_start + window_length - offset;
+		try
+		{
+			if ((end_on_last == true) && (offset + (off_t) chunk == end))
+			{
+				set_attribute(OPENTMLIB_ATTRIBUTE_SET_END_INDICATOR, 1);
+			}
+			if (write_buffer(window + (offset - window_start), chunk) != (int) chunk)
+			{
+				throw_opentmlib_error(-OPENTMLIB_ERROR_IO_ISSUE);
+			}
+		}
+
+		catch (opentmlib_exception & e)
+		{
+			munmap(window, window_length);
+			throw e;
+		}
+
+		munmap(window, window_length);
+		offset += chunk;
+
+	}
+
+	return;
+
+}
+
+// Writes part of a file through write_buffer, read a pooled buffer at a time. Files that can't be
+// seeked (pipes, FIFOs) are read from where they are, offset doesn't apply to them.
+void io_session::copy_from_file(int fd, off_t offset, off_t length, bool end_on_last)
+{
+
+	char *buffer;
+	unsigned int size;
+	int ret, filled, chunk;
+	bool seekable = true;
+
+	size = IO_SESSION_FILE_CHUNK;
+	if ((buffer = buffer_pool::allocate(size)) == NULL)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_MEMORY_ALLOCATION);
+	}
+
+	try
+	{
+		while (length > 0)
+		{
+			// Fill the buffer (or what is left), pipes return what has arrived so far
+			chunk = (length > size) ? size : length;
+			for (filled = 0; filled < chunk; )
+			{
+				if (seekable == true)
+				{
+					ret = pread(fd, buffer + filled, chunk - filled, offset + filled);
+					if ((ret == -1) && (errno == ESPIPE))
+					{
+						seekable = false;
+						continue;
+					}
+				}
+				else
+				{
+					ret = read(fd, buffer + filled, chunk - filled);
+				}
+				if (ret == -1)
+				{
+					if (errno == EINTR)
+						continue;
+					throw_opentmlib_error(-errno);
+				}
+				if (ret == 0)
+				{
+					// File ended early, the binblock header promised more
+					throw_opentmlib_error(-OPENTMLIB_ERROR_IO_ISSUE);
+				}
+				filled += ret;
+			}
+			if ((end_on_last == true) && (filled == length))
+			{
+				set_attribute(OPENTMLIB_ATTRIBUTE_SET_END_INDICATOR, 1);
+			}
+			if (write_buffer(buffer, filled) != filled)
+			{
+				throw_opentmlib_error(-OPENTMLIB_ERROR_IO_ISSUE);
+			}
+			offset += filled;
+			length -= filled;
+		}
+	}
+
+	catch (opentmlib_exception & e)
+	{
+		buffer_pool::release(buffer, size);
+		throw e;
+	}
+
+	buffer_pool::release(buffer, size);
+
+	return;
+
+}
+
 int io_session::read_binblock(char *buffer, int max)
 {
 
@@ -147,6 +633,9 @@ int io_session::read_binblock(char *buffer, int max)
 	int ret, ret_val, done, remaining, digits;
 	unsigned int length;
 
+	// Header and all data chunks share one deadline
+	operation_deadline deadline_scope(this);
+
 	// Disable termination character handling
 	unsigned int tce_state = get_attribute(OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE);
 	if (tce_state == 1)
@@ -253,6 +742,183 @@ read_binblock_exit:
 
 }
 
+off_t io_session::read_binblock_to_file(string path)
+{
+
+	int fd;
+	off_t ret;
+
+	// Read access too, so sessions can map the file (see usbtmc_session::read_to_file)
+	if ((fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+	{
+		throw_opentmlib_error(-errno);
+	}
+
+	try
+	{
+		ret = read_binblock_to_file(fd);
+	}
+
+	catch (opentmlib_exception & e)
+	{
+		close(fd);
+		throw e;
+	}
+
+	if (close(fd) == -1)
+	{
+		throw_opentmlib_error(-errno);
+	}
+
+	return ret;
+
+}
+
+// Reads a binblock and writes its data to a file, so the block doesn't have to fit into memory. How the
+// data gets there depends on the session type (see read_to_file).
+off_t io_session::read_binblock_to_file(int fd)
+{
+
+	off_t length;
+
+	// Header and all data share one deadline
+	operation_deadline deadline_scope(this);
+
+	// Disable termination character handling
+	unsigned int tce_state = get_attribute(OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE);
+	if (tce_state == 1)
+	{
+		set_attribute(OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE, 0);
+	}
+
+	try
+	{
+		length = read_binblock_header();
+		read_to_file(fd, length);
+	}
+
+	catch (opentmlib_exception & e)
+	{
+		if (tce_state == 1)
+		{
+			set_attribute(OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE, 1);
+		}
+		throw e;
+	}
+
+	// Reenable termination character handling
+	if (tce_state == 1)
+	{
+		set_attribute(OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE, 1);
+	}
+
+	if ((tracing == 1) && (monitor != NULL))
+	{
+		stringstream stream;
+		stream << length;
+		monitor->log(name, DIRECTION_IN, "BINBLOCK (" + stream.str() + " bytes to file)");
+	}
+
+	return length;
+
+}
+
+// Reads "#<digits><length>" (termination character handling must be off)
+off_t io_session::read_binblock_header()
+{
+
+	char header[10];
+	int digits, j, ret;
+	off_t length;
+
+	if ((read_buffer(&header[0], 1) != 1) || (header[0] != '#'))
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_BINBLOCK_HEADER);
+	}
+
+	if (read_buffer(&header[0], 1) != 1)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_BINBLOCK_HEADER);
+	}
+	digits = header[0] - 48;
+	if ((digits < 1) || (digits > 9))
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_BINBLOCK_HEADER);
+	}
+
+	// Length field may arrive in pieces
+	for (j = 0; j < digits; j += ret)
+	{
+		if ((ret = read_buffer(&header[j], digits - j)) <= 0)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BINBLOCK_HEADER);
+		}
+	}
+
+	length = 0;
+	for (j = 0; j < digits; j++)
+	{
+		if ((header[j] < '0') || (header[j] > '9'))
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BINBLOCK_HEADER);
+		}
+		length *= 10;
+		length += header[j] - 0x30;
+	}
+
+	return length;
+
+}
+
+// Copies length bytes from the instrument to the file through a pooled buffer.
+void io_session::read_to_file(int fd, off_t length)
+{
+
+	char *buffer;
+	unsigned int size;
+	int ret, written;
+
+	size = IO_SESSION_FILE_CHUNK;
+	if ((buffer = buffer_pool::allocate(size)) == NULL)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_MEMORY_ALLOCATION);
+	}
+
+	try
+	{
+		while (length > 0)
+		{
+			if ((ret = read_buffer(buffer, (length > size) ? size : length)) <= 0)
+			{
+				throw_opentmlib_error(-OPENTMLIB_ERROR_IO_ISSUE);
+			}
+			for (written = 0; written < ret; )
+			{
+				int n = write(fd, buffer + written, ret - written);
+				if (n == -1)
+				{
+					if (errno == EINTR)
+						continue;
+					throw_opentmlib_error(-errno);
+				}
+				written += n;
+			}
+			length -= ret;
+		}
+	}
+
+	catch (opentmlib_exception & e)
+	{
+		buffer_pool::release(buffer, size);
+		throw e;
+	}
+
+	buffer_pool::release(buffer, size);
+
+	return;
+
+}
+
 int io_session::query_string(string query, string & response)
 {
 
@@ -291,6 +957,26 @@ void io_session::base_set_attribute(unsigned int attribute, unsigned int value)
 		throw_on_scpi_error = value;
 		break;
 
+	case OPENTMLIB_ATTRIBUTE_WRITE_COALESCING:
+		if (value > OPENTMLIB_COALESCING_EOL)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE_VALUE);
+		}
+		if (value == OPENTMLIB_COALESCING_OFF)
+		{
+			flush();
+		}
+		coalescing = value;
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_COALESCING_LIMIT:
+		if (value < 2)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE_VALUE);
+		}
+		coalescing_limit = value;
+		break;
+
 	default:
 		throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE);
 
@@ -312,6 +998,12 @@ unsigned int io_session::base_get_attribute(unsigned int attribute)
 	case OPENTMLIB_ATTRIBUTE_ERROR_ON_SCPI_ERROR:
 		return throw_on_scpi_error;
 
+	case OPENTMLIB_ATTRIBUTE_WRITE_COALESCING:
+		return coalescing;
+
+	case OPENTMLIB_ATTRIBUTE_COALESCING_LIMIT:
+		return coalescing_limit;
+
 	default:
 		throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE);
 
@@ -378,6 +1070,7 @@ void io_session::abort()
 unsigned int io_session::read_stb()
 {
 
+	flush();
 	return get_attribute(OPENTMLIB_ATTRIBUTE_STATUS_BYTE);
 
 }
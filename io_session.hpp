@@ -23,15 +23,24 @@
 #define IO_SESSION_HPP
 
 #include <string>
+#include <time.h>
+#include <sys/types.h>
 #include <boost/tokenizer.hpp>
 #include "opentmlib.hpp"
 #include "io_monitor.hpp"
 
+#define IO_SESSION_FILE_WINDOW						(16 * 1024 * 1024) // Part of a file mapped at a time
+#define IO_SESSION_FILE_CHUNK						(1024 * 1024) // Bytes read per call when copying to a file
+#define IO_SESSION_COALESCING_LIMIT					4096 // Default size of joined writes (bytes)
+
 using namespace std;
 
 class io_session
 {
 
+public:
+	io_session();
+
 // Basic I/O methods to be implemented by various session types/classes
 public:
 	virtual int write_buffer(char *buffer, int count) = 0; // Write <count> bytes from buffer to device
@@ -47,6 +56,10 @@ public:
 	int read_string(string & message); // Read string
 	int write_binblock(char *buffer, int count); // Write arbitrary length binblock
 	int read_binblock(char *buffer, int max); // Read arbitrary length binblock
+	off_t write_binblock_from_file(string path, off_t offset = 0, off_t length = -1); // Length -1 = to end of file
+	off_t write_binblock_from_file(int fd, off_t offset = 0, off_t length = -1);
+	off_t read_binblock_to_file(string path); // Returns binblock length
+	off_t read_binblock_to_file(int fd); // Data is written at the current file position
 	int write_int(int value, bool eol = true); // Write int value (as string)
 	int read_int(int & value); // Read int value (as string)
 	int query_string(string query, string & response); // Combination of write_string and read_string
@@ -57,7 +70,8 @@ public:
 	void local();
 	void lock();
 	void unlock();
-	void abort();
+	void abort(); // May be called from another thread to cancel a blocked read or write
+	void flush(); // Send writes held back by write coalescing
 	unsigned int read_stb();
 	void scpi_rst();
 	void scpi_cls();
@@ -65,19 +79,50 @@ public:
 	string last_scpi_error;
 
 private:
+	int coalesce_write(string & message);
 
 protected:
+	// Arms the deadline of an I/O operation for the lifetime of the object. Nested operations (e.g. the
+	// read_buffer calls made by read_binblock) keep the deadline armed by the outermost one.
+	class operation_deadline
+	{
+
+	public:
+		operation_deadline(io_session *session);
+		~operation_deadline();
+
+	private:
+		io_session *session;
+		bool armed;
+
+	};
+
+	virtual void begin_operation(); // Called when an outermost I/O operation starts
+	virtual void write_from_file(int fd, off_t offset, off_t length, bool end_on_last); // Binblock payload
+	virtual void read_to_file(int fd, off_t length); // Binblock payload
+	void copy_from_file(int fd, off_t offset, off_t length, bool end_on_last); // write_from_file without mmap
+	off_t read_binblock_header(); // Returns length
+	void flush_for_operation(unsigned int operation); // Pending writes go before operation
 	void base_set_attribute(unsigned int attribute, unsigned int value);
 	unsigned int base_get_attribute(unsigned int attribute);
+	void set_timeout(unsigned int attribute, unsigned int value); // TIMEOUT (s) or TIMEOUT_MS (ms)
+	unsigned int get_timeout(unsigned int attribute);
+	int remaining_time(); // Time left until deadline (ms, -1 = no timeout)
 	int string_size;
 	int throw_on_scpi_error;
 	int tracing;
 	int term_char_enable; // Termination character enable status (0 = off, 1 = on)
 	unsigned char term_character; // Termination character
 	char eol_char; // End of line character (for write)
-	unsigned int timeout; // Timeout (s)
+	unsigned int timeout_ms; // Timeout (ms, 0 = wait forever)
+	unsigned int operation_depth; // Nesting of operation_deadline scopes (0 = no operation in progress)
+	bool deadline_active; // Operation deadline armed
+	struct timespec deadline; // Absolute deadline of current operation (CLOCK_MONOTONIC)
 	unsigned int wait_lock; // Wait for lock (1) or return immediately (0)
 	unsigned int set_end_indicator; // Set end indicator with last byte written
+	unsigned int coalescing; // Write coalescing mode (OPENTMLIB_COALESCING_...)
+	unsigned int coalescing_limit; // Size (bytes) at which joined writes are sent
+	string pending_writes; // Writes held back by coalescing
 	io_monitor *monitor;
 
 };
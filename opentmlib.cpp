@@ -51,6 +51,7 @@ struct error_list usbtmc_errors[] =
 	{ OPENTMLIB_ERROR_FORMAT, "Bad format" },
 	{ OPENTMLIB_ERROR_SCPI_ERROR, "Instrument returned a SCPI error" },
 	{ OPENTMLIB_ERROR_SCPI_UNABLE_TO_CLEAR, "Unable to clear SCPI error queue" },
+	{ OPENTMLIB_ERROR_STREAM_ACTIVE, "Not possible while a reading stream is active" },
 
 	/* Error codes specific to socket driver */
 	{ OPENTMLIB_ERROR_SOCKET_REQUEST_TOO_MUCH, "Requesting too much data" },
@@ -115,7 +116,13 @@ struct error_list usbtmc_errors[] =
 	{ OPENTMLIB_ERROR_SERIAL_OPEN, "Issue opening device driver" },
 	{ OPENTMLIB_ERROR_SERIAL_CLOSE, "Issue closing device driver" },
 	{ OPENTMLIB_ERROR_SERIAL_BAD_PORT, "Bad serial port" },
-	{ OPENTMLIB_ERROR_SERIAL_REQUEST_TOO_MUCH, "Requesting too much data" }
+	{ OPENTMLIB_ERROR_SERIAL_REQUEST_TOO_MUCH, "Requesting too much data" },
+
+	/* Error codes specific to HiSLIP driver */
+	{ OPENTMLIB_ERROR_HISLIP_CONNECTION, "HiSLIP: unable to establish connection" },
+	{ OPENTMLIB_ERROR_HISLIP_PROTOCOL, "HiSLIP: unexpected message received" },
+	{ OPENTMLIB_ERROR_HISLIP_ERROR, "HiSLIP: instrument reported an error" },
+	{ OPENTMLIB_ERROR_HISLIP_FATAL_ERROR, "HiSLIP: instrument reported a fatal error" }
 
 };
 
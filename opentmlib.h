@@ -111,7 +111,17 @@ enum OPENTMLIB_ERRORS
 	OPENTMLIB_ERROR_SERIAL_OPEN,
 	OPENTMLIB_ERROR_SERIAL_CLOSE,
 	OPENTMLIB_ERROR_SERIAL_BAD_PORT,
-	OPENTMLIB_ERROR_SERIAL_REQUEST_TOO_MUCH
+	OPENTMLIB_ERROR_SERIAL_REQUEST_TOO_MUCH,
+
+	/* Error codes specific to HiSLIP driver */
+	OPENTMLIB_ERROR_HISLIP_CONNECTION,
+	OPENTMLIB_ERROR_HISLIP_PROTOCOL,
+	OPENTMLIB_ERROR_HISLIP_ERROR,
+	OPENTMLIB_ERROR_HISLIP_FATAL_ERROR,
+
+	/* Error codes added since. New ones go at the end: the values are returned by the driver and compiled
+	 * into clients, so they must not change. */
+	OPENTMLIB_ERROR_STREAM_ACTIVE
 
 };
 
@@ -149,7 +159,21 @@ enum OPENTMLIB_ATTRIBUTES
 	OPENTMLIB_ATTRIBUTE_SERIAL_PARITY,
 	OPENTMLIB_ATTRIBUTE_SERIAL_STOPBITS,
 	OPENTMLIB_ATTRIBUTE_SERIAL_RTSCTS,
-	OPENTMLIB_ATTRIBUTE_SERIAL_XONXOFF
+	OPENTMLIB_ATTRIBUTE_SERIAL_XONXOFF,
+
+	/* Attributes specific to HiSLIP */
+	OPENTMLIB_ATTRIBUTE_HISLIP_OVERLAPPED,
+	OPENTMLIB_ATTRIBUTE_HISLIP_MAX_MESSAGE_SIZE,
+
+	/* Attributes added since. New ones go at the end: the values are passed to the driver and compiled into
+	 * clients, so they must not change. */
+	OPENTMLIB_ATTRIBUTE_TIMEOUT_MS,
+	OPENTMLIB_ATTRIBUTE_SOCKET_LATENCY_MODE,
+	OPENTMLIB_ATTRIBUTE_SOCKET_SPIN_TIME,
+	OPENTMLIB_ATTRIBUTE_WRITE_COALESCING,
+	OPENTMLIB_ATTRIBUTE_COALESCING_LIMIT,
+	OPENTMLIB_ATTRIBUTE_RESERVED, /* Not used, keeps the values of the attributes after it */
+	OPENTMLIB_ATTRIBUTE_USBTMC_MAX_TRANSFER_SIZE
 
 };
 
@@ -179,6 +203,10 @@ enum OPENTMLIB_OPERATION_CODES
 
 };
 
+#define OPENTMLIB_COALESCING_OFF				0
+#define OPENTMLIB_COALESCING_SEMICOLON			1 /* Join as one SCPI program message */
+#define OPENTMLIB_COALESCING_EOL				2 /* Join as separate lines */
+
 #define OPENTMLIB_SERIAL_PARITY_NONE			0
 #define OPENTMLIB_SERIAL_PARITY_EVEN			1
 #define OPENTMLIB_SERIAL_PARITY_ODD				2
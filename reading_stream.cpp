@@ -0,0 +1,384 @@
+/*
+ * reading_stream.cpp
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "reading_stream.hpp"
+#include "buffer_pool.hpp"
+#include "opentmlib.hpp"
+
+using namespace std;
+
+reading_stream::reading_stream(int fd, char term_character, unsigned int capacity)
+{
+
+	unsigned int readings;
+
+	if (capacity < 2)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE_VALUE);
+	}
+
+	// Ring size is a power of 2, so positions wrap with a mask
+	for (readings = 2; readings < capacity; readings <<= 1)
+	{
+		if (readings >= (1U << 26))
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE_VALUE);
+		}
+	}
+
+	this->fd = fd;
+	this->term_character = term_character;
+	running = false;
+	mask = readings - 1;
+	token_length = 0;
+	error = 0;
+	dropped = 0;
+	next = 0;
+	head = 0;
+	tail = 0;
+
+	ring_size = readings * sizeof(stream_reading);
+	if ((ring = (stream_reading *) buffer_pool::allocate(ring_size)) == NULL)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_MEMORY_ALLOCATION);
+	}
+
+	stop_event = eventfd(0, EFD_NONBLOCK);
+	data_event = eventfd(0, EFD_NONBLOCK);
+	if ((stop_event == -1) || (data_event == -1))
+	{
+		int save_errno = errno;
+		if (stop_event != -1)
+			close(stop_event);
+		if (data_event != -1)
+			close(data_event);
+		buffer_pool::release((char *) ring, ring_size);
+		throw_opentmlib_error(-save_errno);
+	}
+
+	return;
+
+}
+
+reading_stream::~reading_stream()
+{
+
+	uint64_t increment = 1;
+
+	if (running == true)
+	{
+		if (write(stop_event, &increment, sizeof(uint64_t)) == -1)
+		{
+			// Can't happen with an eventfd that is far from overflowing
+		}
+		pthread_join(thread, NULL);
+	}
+
+	close(stop_event);
+	close(data_event);
+	buffer_pool::release((char *) ring, ring_size);
+
+	return;
+
+}
+
+void reading_stream::start(const char *data, int count)
+{
+
+	struct timespec now;
+	int ret;
+
+	if (count > 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		parse(data, count, now);
+		__atomic_store_n(&head, next, __ATOMIC_RELEASE);
+	}
+
+	if ((ret = pthread_create(&thread, NULL, thread_main, this)) != 0)
+	{
+		throw_opentmlib_error(-ret);
+	}
+	running = true;
+
+	return;
+
+}
+
+// Copies up to max readings (oldest first). If none are buffered, waits up to timeout_ms (-1 = forever)
+// for some to arrive; abort_fd (an eventfd, -1 = none) ends the wait early. Returns the number of
+// readings copied, 0 on timeout.
+int reading_stream::read(stream_reading *readings, int max, int timeout_ms, int abort_fd)
+{
+
+	struct pollfd fds[2];
+	struct timespec now, deadline;
+	unsigned int available, position, i;
+	uint64_t count;
+	long long remaining;
+	int ret, wait;
+
+	if (timeout_ms > 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	while (true)
+	{
+
+		// Only the thread moves head, only the consumer moves tail
+		position = tail;
+		available = __atomic_load_n(&head, __ATOMIC_ACQUIRE) - position;
+		if (available > 0)
+		{
+			if (available > (unsigned int) max)
+				available = max;
+			for (i = 0; i < available; i++)
+			{
+				readings[i] = ring[(position + i) & mask];
+			}
+			__atomic_store_n(&tail, position + available, __ATOMIC_RELEASE);
+			return available;
+		}
+
+		// Thread ended (after it stored the readings it got)
+		if (__atomic_load_n(&error, __ATOMIC_ACQUIRE) != 0)
+		{
+			throw_opentmlib_error(-error);
+		}
+
+		wait = timeout_ms;
+		if (timeout_ms > 0)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			remaining = (long long) (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+			wait = (remaining > 0) ? (int) remaining : 0;
+		}
+		if (wait == 0)
+		{
+			return 0;
+		}
+
+		fds[0].fd = data_event;
+		fds[0].events = POLLIN;
+		fds[1].fd = abort_fd;
+		fds[1].events = POLLIN;
+		ret = poll(fds, (abort_fd != -1) ? 2 : 1, wait);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			throw_opentmlib_error(-errno);
+		}
+		if (ret == 0)
+		{
+			return 0;
+		}
+		if ((abort_fd != -1) && (fds[1].revents & POLLIN))
+		{
+			if (::read(abort_fd, &count, sizeof(uint64_t)) == -1)
+			{
+				throw_opentmlib_error(-errno);
+			}
+			throw_opentmlib_error(-OPENTMLIB_ERROR_TRANSACTION_ABORTED);
+		}
+
+		// Reset the event before looking at the ring again, so no signal gets lost (it may also be left
+		// over from readings taken without waiting, the ring is then still empty and the wait goes on)
+		if (::read(data_event, &count, sizeof(uint64_t)) == -1)
+		{
+			// Reset already
+		}
+
+	}
+
+}
+
+uint64_t reading_stream::get_dropped()
+{
+
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+
+}
+
+void *reading_stream::thread_main(void *stream)
+{
+
+	((reading_stream *) stream)->receive();
+
+	return NULL;
+
+}
+
+void reading_stream::receive()
+{
+
+	char buffer[READING_STREAM_CHUNK];
+	struct pollfd fds[2];
+	struct timespec now;
+	int ret;
+
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = stop_event;
+	fds[1].events = POLLIN;
+
+	while (true)
+	{
+
+		ret = ::read(fd, buffer, sizeof(buffer));
+		if (ret > 0)
+		{
+			// All readings of one chunk arrived at the same time, and are published together
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			parse(buffer, ret, now);
+			__atomic_store_n(&head, next, __ATOMIC_RELEASE);
+			notify();
+			continue;
+		}
+		if (ret == 0)
+		{
+			// Connection closed by instrument
+			__atomic_store_n(&error, OPENTMLIB_ERROR_IO_ISSUE, __ATOMIC_RELEASE);
+			break;
+		}
+		if ((errno != EAGAIN) && (errno != EINTR))
+		{
+			__atomic_store_n(&error, errno, __ATOMIC_RELEASE);
+			break;
+		}
+
+		if (poll(fds, 2, -1) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			__atomic_store_n(&error, errno, __ATOMIC_RELEASE);
+			break;
+		}
+		if (fds[1].revents & POLLIN)
+		{
+			return;
+		}
+
+	}
+
+	notify(); // Wake up consumer, so it sees the error
+
+	return;
+
+}
+
+// Cuts data into readings. A reading cut off at the end of data is kept in token and completed by the
+// next chunk. Readings are stored without moving head (the caller publishes them).
+void reading_stream::parse(const char *data, int count, struct timespec & time)
+{
+
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		if ((data[i] == term_character) || (data[i] == ','))
+		{
+			if (token_length > 0)
+			{
+				push(time);
+			}
+			continue;
+		}
+		if ((data[i] == ' ') || (data[i] == '\r') || (data[i] == '\t'))
+		{
+			continue;
+		}
+		if (token_length < READING_STREAM_TOKEN_MAX)
+		{
+			token[token_length++] = data[i];
+		}
+		else
+		{
+			// Far too long for a number, becomes a NaN reading
+			token_length = READING_STREAM_TOKEN_MAX + 1;
+		}
+	}
+
+	return;
+
+}
+
+void reading_stream::push(struct timespec & time)
+{
+
+	stream_reading *reading;
+	char *end;
+
+	if (next - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) > mask)
+	{
+		// Ring is full
+		__atomic_store_n(&dropped, dropped + 1, __ATOMIC_RELAXED);
+		token_length = 0;
+		return;
+	}
+
+	reading = &ring[next & mask];
+	reading->time = time;
+	reading->value = NAN;
+	if (token_length <= READING_STREAM_TOKEN_MAX)
+	{
+		token[token_length] = 0;
+		reading->value = strtod(token, &end);
+		if (*end != 0)
+		{
+			reading->value = NAN;
+		}
+	}
+	next++; // Made visible to the consumer by the caller
+	token_length = 0;
+
+	return;
+
+}
+
+void reading_stream::notify()
+{
+
+	uint64_t increment = 1;
+
+	if (write(data_event, &increment, sizeof(uint64_t)) == -1)
+	{
+		// Counter can't overflow in practice (the consumer resets it)
+	}
+
+	return;
+
+}
@@ -0,0 +1,80 @@
+/*
+ * reading_stream.hpp
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#ifndef READING_STREAM_HPP
+#define READING_STREAM_HPP
+
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#define READING_STREAM_CAPACITY						65536 // Default number of readings buffered (power of 2)
+#define READING_STREAM_CHUNK						65536 // Bytes received per call
+#define READING_STREAM_TOKEN_MAX					64 // Longest reading (characters)
+
+using namespace std;
+
+struct stream_reading
+{
+	struct timespec time; // Time the reading was received (CLOCK_MONOTONIC)
+	double value; // NaN if the instrument sent something that is not a number
+};
+
+// Receives readings an instrument pushes without being asked (e.g. a DMM in continuous trigger mode).
+// A thread reads from the descriptor, parses the readings (separated by the termination character or
+// ',') and puts them into a single producer/single consumer ring, which the consumer empties in batches
+// without taking a lock. Readings arriving while the ring is full are counted and dropped.
+class reading_stream
+{
+
+public:
+	reading_stream(int fd, char term_character, unsigned int capacity = READING_STREAM_CAPACITY);
+	~reading_stream(); // Stops the thread
+	void start(const char *data, int count); // Data read ahead by the session is parsed first
+	int read(stream_reading *readings, int max, int timeout_ms, int abort_fd); // See reading_stream.cpp
+	uint64_t get_dropped(); // Readings lost because the ring was full
+
+private:
+	static void *thread_main(void *stream);
+	void receive();
+	void parse(const char *data, int count, struct timespec & time);
+	void push(struct timespec & time);
+	void notify();
+	int fd; // Descriptor readings arrive on (non-blocking)
+	char term_character;
+	int stop_event; // eventfd telling the thread to end
+	int data_event; // eventfd signalled when readings were added or the thread ended
+	pthread_t thread;
+	bool running;
+	stream_reading *ring;
+	unsigned int ring_size; // Bytes allocated for ring
+	unsigned int mask; // Number of readings in ring - 1
+	char token[READING_STREAM_TOKEN_MAX + 1]; // Reading being received (thread only)
+	int token_length;
+	unsigned int next; // Slot the next reading goes to (thread only, published through head)
+	int error; // Error that ended the thread (0 = none), written before data_event is signalled
+	uint64_t dropped;
+	unsigned int head __attribute__ ((aligned (64))); // Next slot written (thread)
+	unsigned int tail __attribute__ ((aligned (64))); // Next slot read (consumer)
+
+};
+
+#endif
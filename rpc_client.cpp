@@ -0,0 +1,632 @@
+/*
+ * rpc_client.cpp
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#include <string>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "rpc_client.hpp"
+#include "tcp_connector.hpp"
+
+using namespace std;
+
+// ONC RPC constants (see RFC 1831)
+#define RPC_MSG_CALL				0
+#define RPC_MSG_REPLY				1
+#define RPC_VERSION					2
+#define RPC_MSG_ACCEPTED			0
+#define RPC_SUCCESS					0
+#define RPC_LAST_FRAGMENT			0x80000000UL
+
+// Portmapper (see RFC 1833)
+#define PMAP_PROGRAM				100000
+#define PMAP_VERSION				2
+#define PMAP_GETPORT				3
+
+rpc_client::rpc_client(unsigned long program, unsigned long version)
+{
+
+	this->program = program;
+	this->version = version;
+	rpc_socket = -1;
+	xid = (unsigned long) time(NULL) ^ ((unsigned long) getpid() << 16);
+	timeout_ms = RPC_CLIENT_DEFAULT_TIMEOUT;
+	max_result_size = RPC_CLIENT_DEFAULT_MAX_RESULT_SIZE;
+	send_buffer = NULL;
+	send_size = 0;
+	send_index = 0;
+	send_error = false;
+	tail_data = NULL;
+	tail_length = 0;
+	recv_buffer = NULL;
+	recv_size = 0;
+	recv_length = 0;
+	recv_index = 0;
+	recv_error = false;
+
+	return;
+
+}
+
+rpc_client::~rpc_client()
+{
+
+	if (rpc_socket != -1)
+	{
+		close(rpc_socket);
+	}
+
+	free(send_buffer);
+	free(recv_buffer);
+
+	return;
+
+}
+
+int rpc_client::open_channel(string address, unsigned short port)
+{
+
+	if (port == 0)
+	{
+		// Find out port number through portmapper
+		if (query_portmapper(address, port) == -1)
+		{
+			return -1;
+		}
+	}
+
+	return connect_address(address, port);
+
+}
+
+int rpc_client::get_fd()
+{
+
+	return rpc_socket;
+
+}
+
+void rpc_client::set_timeout(unsigned int milliseconds)
+{
+
+	timeout_ms = milliseconds;
+	return;
+
+}
+
+void rpc_client::set_max_result_size(unsigned int bytes)
+{
+
+	// Reply records are limited to 2^31 - 1 bytes by their mark anyway
+	if (bytes > 0x7fffffff - RPC_CLIENT_REPLY_OVERHEAD)
+	{
+		bytes = 0x7fffffff - RPC_CLIENT_REPLY_OVERHEAD;
+	}
+	max_result_size = bytes;
+	return;
+
+}
+
+int rpc_client::query_portmapper(string address, unsigned short & port)
+{
+
+	rpc_client portmapper(PMAP_PROGRAM, PMAP_VERSION);
+
+	portmapper.set_timeout(timeout_ms);
+	if (portmapper.connect_address(address, RPC_PORTMAPPER_PORT) == -1)
+	{
+		return -1;
+	}
+
+	portmapper.begin_call(PMAP_GETPORT);
+	portmapper.put_u_long(program);
+	portmapper.put_u_long(version);
+	portmapper.put_u_long(IPPROTO_TCP);
+	portmapper.put_u_long(0);
+	if (portmapper.call() == -1)
+	{
+		return -1;
+	}
+
+	unsigned long value = portmapper.get_u_long();
+	if ((portmapper.decode_error() == true) || (value == 0) || (value > 0xffff))
+	{
+		// Program not registered
+		return -1;
+	}
+
+	port = value;
+	return 0;
+
+}
+
+int rpc_client::connect_address(string address, unsigned short port)
+{
+
+	// Resolution (cached), IPv6/IPv4 and the connect deadline are handled by the connector
+	if ((rpc_socket = tcp_connector::connect_host(address, port, timeout_ms)) == -1)
+	{
+		return -1;
+	}
+
+	// Non-blocking socket, waiting is done through poll() with the call deadline
+	fcntl(rpc_socket, F_SETFL, fcntl(rpc_socket, F_GETFL) | O_NONBLOCK);
+	int flag = 1;
+	setsockopt(rpc_socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+
+	return 0;
+
+}
+
+int rpc_client::reserve(unsigned int bytes)
+{
+
+	if (send_index + bytes <= send_size)
+	{
+		return 0;
+	}
+
+	unsigned int new_size = (send_size == 0) ? RPC_CLIENT_INITIAL_BUFFER_SIZE : send_size;
+	while (new_size < send_index + bytes)
+	{
+		new_size *= 2;
+	}
+
+	char *new_buffer = (char *) realloc(send_buffer, new_size);
+	if (new_buffer == NULL)
+	{
+		return -1;
+	}
+	send_buffer = new_buffer;
+	send_size = new_size;
+
+	return 0;
+
+}
+
+void rpc_client::begin_call(unsigned long procedure)
+{
+
+	send_index = 4; // Leave room for record mark
+	send_error = false;
+	tail_data = NULL;
+	tail_length = 0;
+	xid++;
+
+	put_u_long(xid);
+	put_u_long(RPC_MSG_CALL);
+	put_u_long(RPC_VERSION);
+	put_u_long(program);
+	put_u_long(version);
+	put_u_long(procedure);
+	put_u_long(0); // Credentials: AUTH_NONE
+	put_u_long(0);
+	put_u_long(0); // Verifier: AUTH_NONE
+	put_u_long(0);
+
+	return;
+
+}
+
+void rpc_client::put_long(long value)
+{
+
+	put_u_long((unsigned long) value);
+	return;
+
+}
+
+void rpc_client::put_u_long(unsigned long value)
+{
+
+	if (reserve(4) == -1)
+	{
+		send_error = true; // Reported by call()
+		return;
+	}
+
+	unsigned char *p = (unsigned char *) send_buffer + send_index;
+	p[0] = (value >> 24) & 0xff;
+	p[1] = (value >> 16) & 0xff;
+	p[2] = (value >> 8) & 0xff;
+	p[3] = value & 0xff;
+	send_index += 4;
+
+	return;
+
+}
+
+void rpc_client::put_string(const char *value)
+{
+
+	unsigned int length = strlen(value);
+	unsigned int padded = (length + 3) & ~3;
+
+	put_u_long(length);
+	if (reserve(padded) == -1)
+	{
+		send_error = true;
+		return;
+	}
+	memcpy(send_buffer + send_index, value, length);
+	memset(send_buffer + send_index + length, 0, padded - length);
+	send_index += padded;
+
+	return;
+
+}
+
+void rpc_client::put_opaque(const char *data, unsigned int length)
+{
+
+	// Only the length goes into the encode buffer, data is handed to writev() directly
+	put_u_long(length);
+	tail_data = data;
+	tail_length = length;
+
+	return;
+
+}
+
+void rpc_client::start_deadline()
+{
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	return;
+
+}
+
+int rpc_client::wait_fd(short events)
+{
+
+	struct pollfd fds;
+	struct timespec now;
+	int remaining;
+
+	if (timeout_ms == 0)
+	{
+		remaining = -1; // Wait forever
+	}
+	else
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		remaining = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+		if (remaining < 0)
+		{
+			return -1;
+		}
+	}
+
+	fds.fd = rpc_socket;
+	fds.events = events;
+	fds.revents = 0;
+	int ret;
+	do
+	{
+		ret = poll(&fds, 1, remaining);
+	}
+	while ((ret == -1) && (errno == EINTR));
+
+	if (ret != 1)
+	{
+		return -1; // Timeout or error
+	}
+
+	return 0;
+
+}
+
+int rpc_client::send_call()
+{
+
+	static const char padding[4] = { 0, 0, 0, 0 };
+	struct iovec iov[3];
+	int iov_count;
+	unsigned long record_length;
+
+	// Record mark (single fragment)
+	record_length = send_index - 4 + tail_length + ((4 - (tail_length & 3)) & 3);
+	record_length |= RPC_LAST_FRAGMENT;
+	unsigned char *p = (unsigned char *) send_buffer;
+	p[0] = (record_length >> 24) & 0xff;
+	p[1] = (record_length >> 16) & 0xff;
+	p[2] = (record_length >> 8) & 0xff;
+	p[3] = record_length & 0xff;
+
+	iov[0].iov_base = send_buffer;
+	iov[0].iov_len = send_index;
+	iov_count = 1;
+	if (tail_length > 0)
+	{
+		iov[1].iov_base = (void *) tail_data;
+		iov[1].iov_len = tail_length;
+		iov[2].iov_base = (void *) padding;
+		iov[2].iov_len = (4 - (tail_length & 3)) & 3;
+		iov_count = (iov[2].iov_len > 0) ? 3 : 2;
+	}
+
+	// Once part of the call is on the wire, the server would take what follows a failure as its rest
+	struct iovec *next = iov;
+	bool started = false;
+	while (iov_count > 0)
+	{
+
+		ssize_t written = writev(rpc_socket, next, iov_count);
+		if (written == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				if (wait_fd(POLLOUT) == -1)
+					return (started == true) ? drop_channel() : -1;
+				continue;
+			}
+			return (started == true) ? drop_channel() : -1;
+		}
+		if (written > 0)
+		{
+			started = true;
+		}
+
+		// Skip over what has been sent (partial write)
+		while ((iov_count > 0) && ((size_t) written >= next->iov_len))
+		{
+			written -= next->iov_len;
+			next++;
+			iov_count--;
+		}
+		if (iov_count > 0)
+		{
+			next->iov_base = (char *) next->iov_base + written;
+			next->iov_len -= written;
+		}
+
+	}
+
+	return 0;
+
+}
+
+// Fails without losing sync only if nothing was read, a partly read record mark or fragment leaves the
+// connection closed (the caller drops it in the middle of a record anyway).
+int rpc_client::receive_bytes(char *buffer, unsigned int count)
+{
+
+	unsigned int done = 0;
+
+	while (done < count)
+	{
+
+		ssize_t bytes_read = recv(rpc_socket, buffer + done, count - done, 0);
+		if (bytes_read == 0)
+		{
+			return drop_channel(); // Connection closed
+		}
+		if (bytes_read == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				if (wait_fd(POLLIN) == -1)
+					return (done > 0) ? drop_channel() : -1;
+				continue;
+			}
+			return (done > 0) ? drop_channel() : -1;
+		}
+		done += bytes_read;
+
+	}
+
+	return 0;
+
+}
+
+int rpc_client::drop_channel()
+{
+
+	if (rpc_socket != -1)
+	{
+		close(rpc_socket);
+		rpc_socket = -1;
+	}
+
+	return -1;
+
+}
+
+int rpc_client::receive_reply()
+{
+
+	unsigned char mark[4];
+	unsigned long fragment, limit, new_size;
+	unsigned int fragments;
+	bool last;
+
+	// Record marks come from the wire, a corrupt one must not make the buffer grow without bounds
+	limit = (unsigned long) max_result_size + RPC_CLIENT_REPLY_OVERHEAD;
+
+	do
+	{
+
+		// Assemble one complete record from its fragments. Once its first mark is in, a failure leaves the
+		// rest of the record on the wire, and the stream can't be resynchronized.
+		recv_length = 0;
+		fragments = 0;
+		do
+		{
+			if (receive_bytes((char *) mark, 4) == -1)
+			{
+				return (fragments == 0) ? -1 : drop_channel();
+			}
+			fragments++;
+			fragment = ((unsigned long) mark[0] << 24) | (mark[1] << 16) | (mark[2] << 8) | mark[3];
+			last = (fragment & RPC_LAST_FRAGMENT) != 0;
+			fragment &= ~RPC_LAST_FRAGMENT;
+
+			if (fragment > limit - recv_length)
+			{
+				return drop_channel();
+			}
+
+			if (recv_length + fragment > recv_size)
+			{
+				new_size = (recv_size == 0) ? RPC_CLIENT_INITIAL_BUFFER_SIZE : recv_size;
+				while (new_size < recv_length + fragment)
+				{
+					new_size *= 2;
+				}
+				if (new_size > limit)
+				{
+					new_size = limit;
+				}
+				char *new_buffer = (char *) realloc(recv_buffer, new_size);
+				if (new_buffer == NULL)
+				{
+					return drop_channel();
+				}
+				recv_buffer = new_buffer;
+				recv_size = new_size;
+			}
+
+			if (receive_bytes(recv_buffer + recv_length, fragment) == -1)
+			{
+				return drop_channel();
+			}
+			recv_length += fragment;
+		}
+		while (last == false);
+
+		recv_index = 0;
+		recv_error = false;
+
+	}
+	while (get_u_long() != xid); // Drop stale replies (e.g. of a call that timed out earlier)
+
+	// Check reply header
+	if (get_u_long() != RPC_MSG_REPLY)
+		return -1;
+	if (get_u_long() != RPC_MSG_ACCEPTED)
+		return -1;
+	get_u_long(); // Verifier flavor
+	unsigned long verifier_length = get_u_long();
+	if (((verifier_length + 3) & ~3UL) > recv_length - recv_index)
+		return -1;
+	recv_index += (verifier_length + 3) & ~3UL;
+	if (get_u_long() != RPC_SUCCESS)
+		return -1;
+
+	return (recv_error == true) ? -1 : 0;
+
+}
+
+int rpc_client::call()
+{
+
+	if (rpc_socket == -1)
+	{
+		return -1;
+	}
+
+	if (send_error == true)
+	{
+		// Encoding failed (out of memory)
+		return -1;
+	}
+
+	start_deadline();
+	if (send_call() == -1)
+	{
+		return -1;
+	}
+
+	return receive_reply();
+
+}
+
+long rpc_client::get_long()
+{
+
+	return (long) (int) get_u_long(); // Sign-extend 32-bit XDR int
+
+}
+
+unsigned long rpc_client::get_u_long()
+{
+
+	if (recv_index + 4 > recv_length)
+	{
+		recv_error = true;
+		return 0;
+	}
+
+	unsigned char *p = (unsigned char *) recv_buffer + recv_index;
+	recv_index += 4;
+
+	return ((unsigned long) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+
+}
+
+unsigned int rpc_client::get_opaque(char **data)
+{
+
+	unsigned int length = get_u_long();
+
+	// Padded length in unsigned long, a length near 2^32 must not wrap around (recv_index <= recv_length)
+	if (((length + 3UL) & ~3UL) > recv_length - recv_index)
+	{
+		recv_error = true;
+		*data = NULL;
+		return 0;
+	}
+
+	*data = recv_buffer + recv_index;
+	recv_index += (length + 3) & ~3;
+
+	return length;
+
+}
+
+bool rpc_client::decode_error()
+{
+
+	return recv_error;
+
+}
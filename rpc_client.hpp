@@ -0,0 +1,94 @@
+/*
+ * rpc_client.hpp
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#ifndef RPC_CLIENT_HPP
+#define RPC_CLIENT_HPP
+
+#include <string>
+#include <time.h>
+
+#define RPC_CLIENT_INITIAL_BUFFER_SIZE				1024
+#define RPC_CLIENT_DEFAULT_TIMEOUT					25000 // ms
+#define RPC_CLIENT_DEFAULT_MAX_RESULT_SIZE			65536 // Bytes (see set_max_result_size)
+#define RPC_CLIENT_REPLY_OVERHEAD					512 // Reply header, verifier of up to 400 bytes included
+#define RPC_PORTMAPPER_PORT							111
+
+using namespace std;
+
+// Minimal ONC RPC (RFC 1831) client over TCP. Encode and decode buffers are kept for the lifetime of
+// the client and only grow, so a call does not allocate once the buffers have reached working size.
+class rpc_client
+{
+
+public:
+	rpc_client(unsigned long program, unsigned long version);
+	~rpc_client();
+	int open_channel(string address, unsigned short port = 0); // Port 0 = ask portmapper
+	int get_fd(); // Socket descriptor (for use with poll/epoll)
+	void set_timeout(unsigned int milliseconds); // Time to wait for a reply (0 = wait forever)
+	void set_max_result_size(unsigned int bytes); // Larger replies to the calls that follow are rejected
+
+	// Call assembly
+	void begin_call(unsigned long procedure);
+	void put_long(long value);
+	void put_u_long(unsigned long value);
+	void put_string(const char *value);
+	void put_opaque(const char *data, unsigned int length); // Sent from caller's buffer, must be last
+	int call(); // Send call and wait for reply (0 = success, -1 = RPC failure)
+
+	// Reply decoding (valid until next call)
+	long get_long();
+	unsigned long get_u_long();
+	unsigned int get_opaque(char **data);
+	bool decode_error();
+
+private:
+	int reserve(unsigned int bytes);
+	int send_call();
+	int receive_reply();
+	int receive_bytes(char *buffer, unsigned int count);
+	int drop_channel(); // Closes a connection whose record stream is out of step, returns -1
+	void start_deadline();
+	int wait_fd(short events);
+	int query_portmapper(string address, unsigned short & port);
+	int connect_address(string address, unsigned short port);
+	int rpc_socket; // Socket descriptor
+	unsigned long program; // RPC program number
+	unsigned long version; // RPC program version
+	unsigned long xid; // Transaction ID of current call
+	unsigned int timeout_ms; // Reply timeout (ms)
+	unsigned int max_result_size; // Largest result accepted (bytes, reply header not included)
+	struct timespec deadline; // Absolute deadline of current call
+	char *send_buffer; // Encode buffer (record mark + call header + arguments)
+	unsigned int send_size; // Allocated size of encode buffer
+	unsigned int send_index; // Bytes encoded
+	bool send_error; // Encoding failed (out of memory)
+	const char *tail_data; // Opaque argument sent straight from caller's buffer
+	unsigned int tail_length;
+	char *recv_buffer; // Decode buffer (complete reply record)
+	unsigned int recv_size; // Allocated size of decode buffer
+	unsigned int recv_length; // Length of reply record
+	unsigned int recv_index; // Decode position
+	bool recv_error; // Decoding ran past end of reply
+
+};
+
+#endif
@@ -20,6 +20,7 @@
  */
 
 #include <string>
+#include <vector>
 #include <iostream>
 #include <stdexcept>
 #include <errno.h>
@@ -29,8 +30,11 @@
 #include <unistd.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
 #include <termios.h>
 #include <fcntl.h>
+#include <poll.h>
 #include "serial_session.hpp"
 
 using namespace std;
@@ -66,31 +70,36 @@ serial_session::serial_session(int port, bool lock, unsigned int lock_timeout, i
 		throw_opentmlib_error(-OPENTMLIB_ERROR_SERIAL_BAD_PORT);
 	}
 
-	// Allocate memory for session buffer
-	if ((session_buffer_ptr = (char *) malloc(SERIAL_SESSION_LOCAL_BUFFER_SIZE)) == NULL)
-	{
-		throw_opentmlib_error(-OPENTMLIB_ERROR_MEMORY_ALLOCATION);
-	}
+	// Set up receive buffer (memory is taken when data arrives)
+	framer = new stream_framer(SERIAL_SESSION_LOCAL_BUFFER_SIZE);
 
 	// Open COM port
 	char device_file[20];
 	sprintf(device_file, "/dev/ttyS%d", port);
 	if ((file_descriptor = open(device_file, O_RDWR | O_NOCTTY | O_NDELAY)) == -1)
 	{
-		free(session_buffer_ptr);
+		delete framer;
 		throw_opentmlib_error(-OPENTMLIB_ERROR_SERIAL_OPEN);
 	}
 
+	// Event used by abort (possibly from another thread) to wake up blocked reads/writes
+	if ((abort_event = eventfd(0, EFD_NONBLOCK)) == -1)
+	{
+		close(file_descriptor);
+		delete framer;
+		throw_opentmlib_error(-errno);
+	}
+
 	// Save current settings, then set basic opions
 	tcgetattr(file_descriptor, &old_settings);
 	set_basic_options();
 
 	// Initialize member variables
-	timeout = 5; // 5 s
+	timeout_ms = 5000; // 5 s
 	term_char_enable = 1; // Termination character enabled
 	term_character = '\n';
-	write_index = 0;
 	eol_char = '\n';
+	stream = NULL;
 	string_size = 200;
 	throw_on_scpi_error = 1;
 	tracing = 0;
@@ -103,54 +112,120 @@ serial_session::serial_session(int port, bool lock, unsigned int lock_timeout, i
 serial_session::~serial_session()
 {
 
+	// Send writes still held back by coalescing (errors can't be reported any more)
+	try
+	{
+		flush();
+	}
+
+	catch (opentmlib_exception & e)
+	{
+	}
+
+	// Reading thread must be gone before the port is closed
+	delete stream;
+
 	// Restore settings saved in constructor
 	tcsetattr(file_descriptor, TCSANOW, &old_settings);
 
+	close(abort_event);
+
 	// Close COM port
 	if (close(file_descriptor) == -1)
 	{
 		throw_opentmlib_error(-OPENTMLIB_ERROR_SERIAL_CLOSE);
 	}
 
-	// Free session buffer memory
-	free(session_buffer_ptr);
+	// Free receive buffer
+	delete framer;
 
 	return;
 
 }
 
-int serial_session::write_buffer(char *buffer, int count)
+void serial_session::begin_operation()
 {
 
-	int bytes_written, done;
-	struct timeval timeout_s;
-	fd_set writefdset;
+	uint64_t count;
 
-	done = 0;
+	// An abort applies to the operation it interrupts. One left over from before (e.g. issued just after
+	// the previous operation ended) is dropped, the event is non-blocking.
+	if ((read(abort_event, &count, sizeof(uint64_t)) == -1) && (errno != EAGAIN))
+	{
+		throw_opentmlib_error(-errno);
+	}
 
-	// Set up timeout structure
-	timeout_s.tv_sec = timeout;
-	timeout_s.tv_usec = 0;
+	return;
+
+}
 
-	// Set up file descriptor set for write
-	FD_ZERO(&writefdset);
-	FD_SET(file_descriptor, &writefdset);
+// Waits until the port is ready after read/write returned EAGAIN
+void serial_session::wait_ready(bool for_write)
+{
 
+	struct pollfd fds[2];
+	int ret;
+
+	// Abort event is always watched
+	fds[0].fd = file_descriptor;
+	fds[0].events = (for_write == true) ? POLLOUT : POLLIN;
+	fds[1].fd = abort_event;
+	fds[1].events = POLLIN;
+
+	// Timeout is what is left of the operation's deadline
 	do
 	{
+		ret = poll(fds, 2, remaining_time());
+	}
+	while ((ret == -1) && (errno == EINTR));
+	if (ret == -1)
+	{
+		throw_opentmlib_error(-errno);
+	}
+	if (ret == 0)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_TIMEOUT);
+	}
 
-		if (timeout != 0)
+	if (fds[1].revents & POLLIN)
+	{
+		// Abort requested, reset event and drop partial message
+		uint64_t count;
+		if (read(abort_event, &count, sizeof(uint64_t)) == -1)
 		{
-			// Wait for write to become possible
-			if (select(file_descriptor + 1, NULL, &writefdset, NULL, &timeout_s) != 1)
-			{
-				throw_opentmlib_error(-OPENTMLIB_ERROR_TIMEOUT);
-			}
+			throw_opentmlib_error(-errno);
 		}
+		framer->reset();
+		throw_opentmlib_error(-OPENTMLIB_ERROR_TRANSACTION_ABORTED);
+	}
+
+	return;
+
+}
+
+int serial_session::write_buffer(char *buffer, int count)
+{
 
-		// Write buffer to socket
-		if ((bytes_written = send(file_descriptor, buffer, count, 0)) == -1)
+	int bytes_written, done;
+	operation_deadline deadline_scope(this);
+
+	flush(); // Writes held back by coalescing go first
+
+	done = 0;
+
+	do
+	{
+
+		// Try to write first (port is opened non-blocking), wait only if the output queue is full
+		if ((bytes_written = write(file_descriptor, buffer + done, count - done)) == -1)
 		{
+			if (errno == EAGAIN)
+			{
+				wait_ready(true);
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
 			throw_opentmlib_error(-errno);
 		}
 
@@ -166,36 +241,35 @@ int serial_session::write_buffer(char *buffer, int count)
 int serial_session::read_buffer(char *buffer, int max)
 {
 
-	int bytes_read, done;
-	struct timeval timeout_s;
-	fd_set readfdset;
+	int bytes_read;
+	operation_deadline deadline_scope(this);
 
-	// Set up timeout structure
-	timeout_s.tv_sec = timeout;
-	timeout_s.tv_usec = 0;
+	flush(); // Held back writes (the command this read is for) go first
 
-	// Set up file descriptor set for read
-	FD_ZERO(&readfdset);
-	FD_SET(file_descriptor, &readfdset);
+	if (stream != NULL)
+	{
+		// Reading thread owns the receive side
+		throw_opentmlib_error(-OPENTMLIB_ERROR_STREAM_ACTIVE);
+	}
 
 	if (term_char_enable == 0)
 	{
 
 		// Not checking for term character, just read as much data as we get
 
-		if (timeout != 0)
+		// Deliver data read ahead earlier first
+		if (framer->get_count() > 0)
 		{
-			// Wait for data to become possible
-			if (select(file_descriptor + 1, &readfdset, NULL, NULL, &timeout_s) != 1)
-			{
-				throw_opentmlib_error(-OPENTMLIB_ERROR_TIMEOUT);
-			}
+			return framer->extract(buffer, max);
 		}
 
-		// No need to buffer data locally, read directly to target buffer
-		if ((bytes_read = read(file_descriptor, buffer, max)) == -1)
+		// No need to buffer data locally, read directly to target buffer (wait only if nothing is there)
+		while ((bytes_read = read(file_descriptor, buffer, max)) <= 0)
 		{
-			throw_opentmlib_error(-errno);
+			if ((bytes_read == 0) || (errno == EAGAIN))
+				wait_ready(false);
+			else if (errno != EINTR)
+				throw_opentmlib_error(-errno);
 		}
 
 		return bytes_read;
@@ -206,71 +280,40 @@ int serial_session::read_buffer(char *buffer, int max)
 
 		// Checking for term character and using local buffer
 
-		if (max > SERIAL_SESSION_LOCAL_BUFFER_SIZE)
+		if (max > (int) framer->get_limit())
 		{
 			// Potential buffer overflow
 			throw_opentmlib_error(-OPENTMLIB_ERROR_SERIAL_REQUEST_TOO_MUCH);
 		}
 
-		// Check if data in local buffer includes term character
-		// In this case, no recv() should be done
-		int i = 0;
-		while ((*(session_buffer_ptr + i) != term_character) && (i < write_index)) i++;
-		if (i < write_index)
+		// Read ahead until a complete message is buffered. Data following the message stays buffered
+		// for the next call.
+		while ((bytes_read = framer->extract_message(buffer, max, term_character)) == 0)
 		{
-			// Found term character, copy buffer contents up to term character to target buffer
-			memcpy(buffer, session_buffer_ptr, i + 1);
-			// Copy remaining data (if any) to beginning of buffer
-			if (write_index - i - 1 > 0)
-				memcpy(session_buffer_ptr, session_buffer_ptr + i + 1, write_index - i - 1);
-			write_index -= i + 1;
-			return i + 1;
-		}
-
-		done = write_index; // Start with what we have in local buffer already
 
-		do
-		{
-
-			if (timeout != 0)
+			if ((bytes_read = framer->fill(file_descriptor)) <= 0)
 			{
-				// Wait for data to become possible
-				if (select(file_descriptor + 1, &readfdset, NULL, NULL, &timeout_s) != 1)
+				if ((bytes_read == -1) && (errno != EAGAIN) && (errno != EINTR))
 				{
-					throw_opentmlib_error(-OPENTMLIB_ERROR_TIMEOUT);
+					throw_opentmlib_error(-errno);
 				}
-			}
-
-			// Read data to local buffer
-			if ((bytes_read = read(file_descriptor, session_buffer_ptr + done, max - done)) == -1)
-			{
-				throw_opentmlib_error(-errno);
-			}
 
-			// Check if data read includes term character
-			int i = 0;
-			while ((*(session_buffer_ptr + done + i) != term_character) && (i < bytes_read)) i++;
-			if (i < bytes_read)
-			{
-				// Found term character, copy buffer up to term character to target
-				memcpy(buffer, session_buffer_ptr, done + i + 1);
-				// Copy remaining data (if any) to beginning of local buffer
-				if (bytes_read - i - 1 > 0)
-					memcpy(session_buffer_ptr, session_buffer_ptr + done + i + 1, bytes_read - i - 1);
-				write_index = bytes_read - i - 1;
-				return done + i + 1;
+				// Nothing there yet, wait for data to become available
+				if ((bytes_read == 0) || (errno == EAGAIN))
+					wait_ready(false);
+				bytes_read = 0;
 			}
 
-			done += bytes_read;
+		}
 
+		if (bytes_read == -1)
+		{
+			// No termination character found but max number of bytes requested reached
+			// Caller got what we have...
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BUFFER_OVERFLOW);
 		}
-		while (done < max);
 
-		// No termination character found but max number of bytes requested reached
-		// Return what we have...
-		memcpy(buffer, session_buffer_ptr, max);
-		write_index = 0;
-		throw_opentmlib_error(-OPENTMLIB_ERROR_BUFFER_OVERFLOW);
+		return bytes_read;
 
 	}
 
@@ -692,7 +735,8 @@ void serial_session::set_attribute(unsigned int attribute, unsigned int value)
 		break;
 
 	case OPENTMLIB_ATTRIBUTE_TIMEOUT:
-		timeout = value;
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT_MS:
+		set_timeout(attribute, value);
 		break;
 
 	case OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE:
@@ -774,7 +818,8 @@ unsigned int serial_session::get_attribute(unsigned int attribute)
 		return eol_char;
 
 	case OPENTMLIB_ATTRIBUTE_TIMEOUT:
-		return timeout;
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT_MS:
+		return get_timeout(attribute);
 
 	case OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE:
 		return term_char_enable;
@@ -813,9 +858,22 @@ unsigned int serial_session::get_attribute(unsigned int attribute)
 void serial_session::io_operation(unsigned int operation, unsigned int value)
 {
 
+	flush_for_operation(operation);
+
 	switch (operation)
 	{
 
+	case OPENTMLIB_OPERATION_ABORT:
+		{
+			// Wake up read/write blocked in another thread
+			uint64_t increment = 1;
+			if (write(abort_event, &increment, sizeof(uint64_t)) != sizeof(uint64_t))
+			{
+				throw_opentmlib_error(-errno);
+			}
+		}
+		break;
+
 	default:
 		throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_OPERATION);
 
@@ -824,3 +882,77 @@ void serial_session::io_operation(unsigned int operation, unsigned int value)
 	return;
 
 }
+
+// Subscribes to readings the instrument sends on its own (e.g. INIT:CONT ON in talk-only mode). From now
+// on a thread receives and parses them, read_buffer is not available until the stream is stopped.
+void serial_session::start_stream(unsigned int capacity)
+{
+
+	vector<char> buffer;
+	int count;
+
+	if (stream != NULL)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_STREAM_ACTIVE);
+	}
+
+	stream = new reading_stream(file_descriptor, term_character, capacity);
+
+	try
+	{
+		// Data read ahead earlier is the start of the stream
+		buffer.resize(framer->get_count() + 1);
+		count = 0;
+		while (framer->get_count() > 0)
+		{
+			count += framer->extract(&buffer[count], buffer.size() - count);
+		}
+		stream->start(&buffer[0], count);
+	}
+
+	catch (opentmlib_exception & e)
+	{
+		delete stream;
+		stream = NULL;
+		throw e;
+	}
+
+	return;
+
+}
+
+// Copies up to max readings (oldest first) and returns how many. Waits up to the timeout if none are
+// there, 0 is returned if none arrived.
+int serial_session::read_readings(stream_reading *readings, int max)
+{
+
+	operation_deadline deadline_scope(this);
+
+	if (stream == NULL)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_OPERATION_UNSUPPORTED);
+	}
+
+	return stream->read(readings, max, remaining_time(), abort_event);
+
+}
+
+// Ends the subscription. Readings not read yet are discarded, so is a reading that was only partially
+// received (the instrument should be told to stop sending first).
+void serial_session::stop_stream()
+{
+
+	delete stream;
+	stream = NULL;
+
+	return;
+
+}
+
+uint64_t serial_session::get_stream_dropped()
+{
+
+	return (stream != NULL) ? stream->get_dropped() : 0;
+
+}
+
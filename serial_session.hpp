@@ -26,6 +26,8 @@
 #include <string>
 #include "io_session.hpp"
 #include "io_monitor.hpp"
+#include "stream_framer.hpp"
+#include "reading_stream.hpp"
 
 #define SERIAL_SESSION_LOCAL_BUFFER_SIZE					1024
 
@@ -42,8 +44,16 @@ public:
 	void set_attribute(unsigned int attribute, unsigned int value);
 	unsigned int get_attribute(unsigned int attribute);
 	void io_operation(unsigned int operation, unsigned int value);
+	void start_stream(unsigned int capacity = READING_STREAM_CAPACITY); // Readings pushed by the instrument
+	int read_readings(stream_reading *readings, int max); // Waits (until timeout) for at least one
+	void stop_stream();
+	uint64_t get_stream_dropped(); // Readings lost because they weren't read in time
+
+protected:
+	void begin_operation(); // Forgets an abort issued while no operation was in progress
 
 private:
+	void wait_ready(bool for_write); // Wait for I/O readiness, timeout or abort
 	int set_basic_options();
 	void set_attribute_baudrate(unsigned int value);
 	unsigned int get_attribute_baudrate();
@@ -61,8 +71,9 @@ private:
 private:
 	int file_descriptor;
 	struct termios old_settings;
-	char *session_buffer_ptr; // Pointer to local session buffer
-	int write_index; // Write index into local session buffer
+	stream_framer *framer; // Receive buffer (read-ahead and message framing)
+	int abort_event; // eventfd signalled by abort
+	reading_stream *stream; // Continuous stream subscription (NULL = none)
 
 };
 
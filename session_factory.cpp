@@ -22,8 +22,10 @@
 #include <boost/tokenizer.hpp>
 #include <boost/lexical_cast.hpp>
 #include <iostream>
+#include <limits.h>
 #include "session_factory.hpp"
 #include "vxi11_session.hpp"
+#include "hislip_session.hpp"
 #include "socket_session.hpp"
 #include "usbtmc_session.hpp"
 #include "serial_session.hpp"
@@ -195,6 +197,28 @@ io_session *session_factory::open_session(string resource, bool lock, unsigned i
 		{
 			board = 0;
 		}
+		string protocol = (pieces.size() >= 3) ? pieces[2] : "";
+		uppercase(protocol); // Copy, sub-address is passed on as given
+		if ((protocol.find("HISLIP") == 0) && ((pieces.size() == 3) || (pieces.size() == 4) &&
+			(uppercase(pieces[3]) == "INSTR")))
+		{
+			// This is a HiSLIP instrument (sub-address may be followed by ",port")
+			string sub_address = pieces[2];
+			int hislip_port = HISLIP_SESSION_PORT;
+			int comma = sub_address.find(',');
+			if (comma != -1)
+			{
+				istringstream stream(sub_address.substr(comma + 1));
+				if (!(stream >> hislip_port) || (hislip_port < 0) || (hislip_port > 0xffff))
+				{
+					throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_RESOURCE_STRING);
+				}
+				sub_address = sub_address.substr(0, comma);
+			}
+			session = new hislip_session(pieces[1], sub_address, hislip_port, lock, 5, monitor);
+			session->name = name;
+			goto session_created;
+		}
 		if ((pieces.size() < 4) || (pieces.size() == 4) && (uppercase(pieces[3]) == "INSTR"))
 		{
 			// This is a VXI-11 instrument
@@ -231,7 +255,22 @@ io_session *session_factory::open_session(string resource, bool lock, unsigned i
 			{
 				throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_RESOURCE_STRING);
 			}
-			session = new socket_session(pieces[1], port, lock, 5, monitor);
+			unsigned int connect_timeout = SOCKET_SESSION_CONNECT_TIMEOUT;
+			if (alias != "")
+			{
+				string temp = store->lookup(alias, "connect_timeout");
+				if (temp != "")
+				{
+					double seconds; // Fractions allowed, 0 = wait as long as the system does
+					istringstream stream(temp);
+					if (!(stream >> seconds) || (seconds < 0) || (seconds > UINT_MAX / 1000))
+					{
+						throw_opentmlib_error(-OPENTMLIB_ERROR_CSTORE_BAD_VALUE);
+					}
+					connect_timeout = (unsigned int) (seconds * 1000 + 0.5);
+				}
+			}
+			session = new socket_session(pieces[1], port, lock, 5, monitor, connect_timeout);
 			session->name = name;
 			goto session_created;
 		}
@@ -353,13 +392,13 @@ session_created:
 		temp = store->lookup(alias, "timeout");
 		if (temp != "")
 		{
-			int seconds;
+			double seconds; // Fractions allowed (e.g. 0.05)
 			istringstream stream(temp);
-			if (!(stream >> seconds))
+			if (!(stream >> seconds) || (seconds < 0) || (seconds > UINT_MAX / 1000))
 			{
 				throw_opentmlib_error(-OPENTMLIB_ERROR_CSTORE_BAD_VALUE);
 			}
-			session->set_attribute(OPENTMLIB_ATTRIBUTE_TIMEOUT, seconds);
+			session->set_attribute(OPENTMLIB_ATTRIBUTE_TIMEOUT_MS, (unsigned int) (seconds * 1000 + 0.5));
 		}
 		else
 		{
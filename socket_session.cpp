@@ -20,6 +20,7 @@
  */
 
 #include <string>
+#include <vector>
 #include <iostream>
 #include <stdexcept>
 #include <errno.h>
@@ -31,12 +32,18 @@
 #include <unistd.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include "socket_session.hpp"
 
 using namespace std;
 
 socket_session::socket_session(string address, unsigned short int port, bool lock,
-	unsigned int lock_timeout, io_monitor *monitor)
+	unsigned int lock_timeout, io_monitor *monitor, unsigned int connect_timeout)
 {
 
 	if (lock == true)
@@ -44,53 +51,38 @@ socket_session::socket_session(string address, unsigned short int port, bool loc
 		throw_opentmlib_error(-OPENTMLIB_ERROR_LOCKING_NOT_SUPPORTED);
 	}
 
-	// Allocate memory for session buffer
-	if ((session_buffer_ptr = (char *) malloc(SOCKET_SESSION_LOCAL_BUFFER_SIZE)) == NULL)
-	{
-		throw_opentmlib_error(-OPENTMLIB_ERROR_MEMORY_ALLOCATION);
-	}
+	// Set up receive buffer (memory is taken when data arrives)
+	framer = new stream_framer(SOCKET_SESSION_LOCAL_BUFFER_SIZE);
 
-	if ((instrument_socket = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+	// Establish TCP connection (address may be a host name, IPv4 or IPv6 address)
+	if ((instrument_socket = tcp_connector::connect_host(address, port, connect_timeout)) == -1)
 	{
-		free(session_buffer_ptr);
-		throw_opentmlib_error(-OPENTMLIB_ERROR_SOCKET_CREATE);
+		delete framer;
+		if ((errno == EMFILE) || (errno == ENFILE) || (errno == ENOBUFS) || (errno == ENOMEM))
+			throw_opentmlib_error(-OPENTMLIB_ERROR_SOCKET_CREATE);
+		throw_opentmlib_error(-OPENTMLIB_ERROR_SOCKET_CONNECT);
 	}
 
-	struct in_addr
-	{
-		unsigned long s_addr;
-	};
+	// I/O is tried first and waited for only if the socket isn't ready
+	fcntl(instrument_socket, F_SETFL, fcntl(instrument_socket, F_GETFL) | O_NONBLOCK);
 
-	struct sockaddr_in
+	// Event used by abort (possibly from another thread) to wake up blocked reads/writes
+	if ((abort_event = eventfd(0, EFD_NONBLOCK)) == -1)
 	{
-		short int sin_family; // Address family
-		unsigned short int sin_port; // Port number
-		struct in_addr sin_addr; // Internet address
-		unsigned char sin_zero[8]; // Padding
-	};
-
-	struct sockaddr_in instrument_address;
-
-	// Fill address structure
-	memset(&instrument_address, 0, sizeof(struct sockaddr_in));
-	instrument_address.sin_family = PF_INET; // IPv4
-	instrument_address.sin_port = htons(port); // Port number
-	instrument_address.sin_addr.s_addr = inet_addr(address.c_str()); // IP Address
-
-	// Establish TCP connection
-	if (connect(instrument_socket, (struct sockaddr *) &instrument_address,
-		sizeof(struct sockaddr_in)) == -1)
-	{
-		free(session_buffer_ptr);
-		throw_opentmlib_error(-OPENTMLIB_ERROR_SOCKET_CONNECT);
+		close(instrument_socket);
+		delete framer;
+		throw_opentmlib_error(-errno);
 	}
 
 	// Initialize member variables
-	timeout = 5; // 5 s
+	timeout_ms = 5000; // 5 s
 	term_char_enable = 1; // Termination character enabled
 	term_character = '\n';
 	eol_char = '\n';
-	write_index = 0;
+	latency_mode = 0;
+	spin_time = SOCKET_SESSION_DEFAULT_SPIN_TIME;
+	spinning = false;
+	stream = NULL;
 	string_size = 200;
 	throw_on_scpi_error = 1;
 	tracing = 0;
@@ -103,51 +95,125 @@ socket_session::socket_session(string address, unsigned short int port, bool loc
 socket_session::~socket_session()
 {
 
+	// Send writes still held back by coalescing (errors can't be reported any more)
+	try
+	{
+		flush();
+	}
+
+	catch (opentmlib_exception & e)
+	{
+	}
+
+	// Reading thread must be gone before the socket is closed
+	delete stream;
+
+	close(abort_event);
+
 	// Close socket
 	if (close(instrument_socket) == -1)
 	{
 		throw_opentmlib_error(-OPENTMLIB_ERROR_SOCKET_CLOSE);
 	}
 
-	// Free session buffer memory
-	free(session_buffer_ptr);
+	// Free receive buffer
+	delete framer;
 
 	return;
 
 }
 
-int socket_session::write_buffer(char *buffer, int count)
+void socket_session::begin_operation()
 {
 
-	int bytes_written, done;
-	struct timeval timeout_s;
-	fd_set writefdset;
+	uint64_t count;
 
-	done = 0;
+	// An abort applies to the operation it interrupts. One left over from before (e.g. issued just after
+	// the previous operation ended) is dropped, the event is non-blocking.
+	if ((read(abort_event, &count, sizeof(uint64_t)) == -1) && (errno != EAGAIN))
+	{
+		throw_opentmlib_error(-errno);
+	}
+
+	return;
+
+}
+
+// Waits until the socket is ready after send/recv returned EAGAIN (poll has no descriptor number limit,
+// unlike select)
+void socket_session::wait_ready(bool for_write)
+{
 
-	// Set up timeout structure
-	timeout_s.tv_sec = timeout;
-	timeout_s.tv_usec = 0;
+	struct pollfd fds[2];
+	int ret;
 
-	// Set up file descriptor set for write
-	FD_ZERO(&writefdset);
-	FD_SET(instrument_socket, &writefdset);
+	// In latency mode, data usually arrives within microseconds. Catching it by spinning avoids the
+	// scheduler wakeup of a blocking wait.
+	if ((for_write == false) && (spinning == true) && (spin_ready() == true))
+	{
+		return;
+	}
 
+	// Abort event is always watched
+	fds[0].fd = instrument_socket;
+	fds[0].events = (for_write == true) ? POLLOUT : POLLIN;
+	fds[1].fd = abort_event;
+	fds[1].events = POLLIN;
+
+	// Timeout is what is left of the operation's deadline
 	do
 	{
+		ret = poll(fds, 2, remaining_time());
+	}
+	while ((ret == -1) && (errno == EINTR));
+	if (ret == -1)
+	{
+		throw_opentmlib_error(-errno);
+	}
+	if (ret == 0)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_TIMEOUT);
+	}
 
-		if (timeout != 0)
+	if (fds[1].revents & POLLIN)
+	{
+		// Abort requested, reset event and drop partial message
+		uint64_t count;
+		if (read(abort_event, &count, sizeof(uint64_t)) == -1)
 		{
-			// Wait for write to become possible
-			if (select(instrument_socket + 1, NULL, &writefdset, NULL, &timeout_s) != 1)
-			{
-				throw_opentmlib_error(-OPENTMLIB_ERROR_TIMEOUT);
-			}
+			throw_opentmlib_error(-errno);
 		}
+		framer->reset();
+		throw_opentmlib_error(-OPENTMLIB_ERROR_TRANSACTION_ABORTED);
+	}
+
+	return;
+
+}
+
+int socket_session::write_buffer(char *buffer, int count)
+{
+
+	int bytes_written, done;
+	operation_deadline deadline_scope(this);
+
+	flush(); // Writes held back by coalescing go first
+
+	done = 0;
+
+	do
+	{
 
-		// Write buffer to socket
-		if ((bytes_written = send(instrument_socket, buffer, count, 0)) == -1)
+		// Try to write first (socket is non-blocking), wait only if the send buffer is full
+		if ((bytes_written = send(instrument_socket, buffer + done, count - done, MSG_NOSIGNAL)) == -1)
 		{
+			if (errno == EAGAIN)
+			{
+				wait_ready(true);
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
 			throw_opentmlib_error(-errno);
 		}
 
@@ -160,40 +226,224 @@ int socket_session::write_buffer(char *buffer, int count)
 
 }
 
+// Sends part of a file with sendfile, so data goes from the page cache to the socket without passing
+// through user space.
+void socket_session::write_from_file(int fd, off_t offset, off_t length, bool end_on_last)
+{
+
+	ssize_t ret;
+	bool started = false;
+
+	// Socket is non-blocking, so waiting is done by wait_ready (deadline, abort)
+	while (length > 0)
+	{
+
+		ret = sendfile(instrument_socket, fd, &offset,
+			(length > SOCKET_SESSION_SENDFILE_CHUNK) ? SOCKET_SESSION_SENDFILE_CHUNK : length);
+		if (ret == -1)
+		{
+			if (errno == EAGAIN)
+			{
+				wait_ready(true);
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
+			if (((errno == EINVAL) || (errno == ENOSYS) || (errno == ESPIPE)) && (started == false))
+			{
+				// File type can't be sent this way, write it through write_buffer instead
+				io_session::write_from_file(fd, offset, length, end_on_last);
+				return;
+			}
+			throw_opentmlib_error(-errno);
+		}
+		if (ret == 0)
+		{
+			// File ended early
+			throw_opentmlib_error(-OPENTMLIB_ERROR_IO_ISSUE);
+		}
+
+		started = true;
+		length -= ret;
+
+	}
+
+	return;
+
+}
+
+// Moves binblock data from the socket to a file with splice (through a pipe), so it never passes through
+// user space. Only data read ahead earlier is copied.
+void socket_session::read_to_file(int fd, off_t length)
+{
+
+	char buffer[4096];
+	int pipe_fds[2], count, done;
+	ssize_t ret, in_pipe;
+	bool copy_rest = false;
+
+	// Data read ahead into the receive buffer goes first
+	while ((length > 0) && (framer->get_count() > 0))
+	{
+		count = framer->extract(buffer, (length > (off_t) sizeof(buffer)) ? sizeof(buffer) : length);
+		for (done = 0; done < count; done += ret)
+		{
+			if ((ret = write(fd, buffer + done, count - done)) == -1)
+			{
+				throw_opentmlib_error(-errno);
+			}
+		}
+		length -= count;
+	}
+
+	if (length == 0)
+	{
+		return;
+	}
+
+	if (pipe2(pipe_fds, O_NONBLOCK) == -1)
+	{
+		throw_opentmlib_error(-errno);
+	}
+	fcntl(pipe_fds[1], F_SETPIPE_SZ, SOCKET_SESSION_SPLICE_PIPE_SIZE); // Larger moves per call where permitted
+
+	try
+	{
+
+		in_pipe = 0;
+		while ((length > 0) || (in_pipe > 0))
+		{
+
+			// Socket to pipe
+			if (length > 0)
+			{
+				ret = splice(instrument_socket, NULL, pipe_fds[1], NULL, (length > SOCKET_SESSION_SPLICE_PIPE_SIZE) ?
+					SOCKET_SESSION_SPLICE_PIPE_SIZE : length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (ret == 0)
+				{
+					// Connection closed by instrument
+					throw_opentmlib_error(-OPENTMLIB_ERROR_IO_ISSUE);
+				}
+				if (ret > 0)
+				{
+					length -= ret;
+					in_pipe += ret;
+					quick_ack();
+				}
+				else if ((errno == EAGAIN) && (in_pipe == 0))
+				{
+					wait_ready(false);
+					continue;
+				}
+				else if ((errno != EAGAIN) && (errno != EINTR))
+				{
+					throw_opentmlib_error(-errno);
+				}
+			}
+
+			// Pipe to file
+			if (in_pipe > 0)
+			{
+				ret = splice(pipe_fds[0], NULL, fd, NULL, in_pipe, SPLICE_F_MOVE);
+				if (ret == -1)
+				{
+					if (errno == EINTR)
+						continue;
+					if (errno != EINVAL)
+						throw_opentmlib_error(-errno);
+
+					// File can't be spliced to (e.g. opened with O_APPEND), empty the pipe and copy the rest
+					while (in_pipe > 0)
+					{
+						count = read(pipe_fds[0], buffer, sizeof(buffer));
+						if (count == -1)
+						{
+							if (errno == EINTR)
+								continue;
+							throw_opentmlib_error(-errno);
+						}
+						if (count == 0)
+						{
+							// Pipe holds less than it was given
+							throw_opentmlib_error(-OPENTMLIB_ERROR_IO_ISSUE);
+						}
+						for (done = 0; done < count; done += ret)
+						{
+							if ((ret = write(fd, buffer + done, count - done)) == -1)
+							{
+								if (errno == EINTR)
+								{
+									ret = 0;
+									continue;
+								}
+								throw_opentmlib_error(-errno);
+							}
+						}
+						in_pipe -= count;
+					}
+					copy_rest = true;
+					break;
+				}
+				in_pipe -= ret;
+			}
+
+		}
+
+	}
+
+	catch (opentmlib_exception & e)
+	{
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		throw e;
+	}
+
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+
+	if ((copy_rest == true) && (length > 0))
+	{
+		io_session::read_to_file(fd, length);
+	}
+
+	return;
+
+}
+
 int socket_session::read_buffer(char *buffer, int max)
 {
 
-	int bytes_read, done;
-	struct timeval timeout_s;
-	fd_set readfdset;
+	int bytes_read;
+	operation_deadline deadline_scope(this);
 
-	// Set up timeout structure
-	timeout_s.tv_sec = timeout;
-	timeout_s.tv_usec = 0;
+	flush(); // Held back writes (the command this read is for) go first
 
-	// Set up file descriptor set for read
-	FD_ZERO(&readfdset);
-	FD_SET(instrument_socket, &readfdset);
+	if (stream != NULL)
+	{
+		// Reading thread owns the receive side
+		throw_opentmlib_error(-OPENTMLIB_ERROR_STREAM_ACTIVE);
+	}
 
 	if (term_char_enable == 0)
 	{
 
 		// Not checking for term character, just read as much data as we get
 
-		if (timeout != 0)
+		// Deliver data read ahead earlier first
+		if (framer->get_count() > 0)
 		{
-			// Wait for data to become possible
-			if (select(instrument_socket + 1, &readfdset, NULL, NULL, &timeout_s) != 1)
-			{
-				throw_opentmlib_error(-OPENTMLIB_ERROR_TIMEOUT);
-			}
+			return framer->extract(buffer, max);
 		}
 
-		// No need to buffer data locally, read directly to target buffer
-		if ((bytes_read = recv(instrument_socket, buffer, max, 0)) == -1)
+		// No need to buffer data locally, read directly to target buffer (wait only if nothing is there)
+		while ((bytes_read = recv(instrument_socket, buffer, max, 0)) == -1)
 		{
-			throw_opentmlib_error(-errno);
+			if (errno == EAGAIN)
+				wait_ready(false);
+			else if (errno != EINTR)
+				throw_opentmlib_error(-errno);
 		}
+		quick_ack();
 
 		return bytes_read;
 
@@ -203,71 +453,46 @@ int socket_session::read_buffer(char *buffer, int max)
 
 		// Checking for term character and using local buffer
 
-		if (max > SOCKET_SESSION_LOCAL_BUFFER_SIZE)
+		if (max > (int) framer->get_limit())
 		{
 			// Potential buffer overflow
 			throw_opentmlib_error(-OPENTMLIB_ERROR_SOCKET_REQUEST_TOO_MUCH);
 		}
 
-		// Check if data in local buffer includes term character
-		// In this case, no recv() should be done
-		int i = 0;
-		while ((*(session_buffer_ptr + i) != term_character) && (i < write_index)) i++;
-		if (i < write_index)
+		// Read ahead until a complete message is buffered. Data following the message stays buffered
+		// for the next call.
+		while ((bytes_read = framer->extract_message(buffer, max, term_character)) == 0)
 		{
-			// Found term character, copy buffer contents up to term character to target buffer
-			memcpy(buffer, session_buffer_ptr, i + 1);
-			// Copy remaining data (if any) to beginning of buffer
-			if (write_index - i - 1 > 0)
-				memcpy(session_buffer_ptr, session_buffer_ptr + i + 1, write_index - i - 1);
-			write_index -= i + 1;
-			return i + 1;
-		}
-
-		done = write_index; // Start with what we have in local buffer already
 
-		do
-		{
-
-			if (timeout != 0)
+			if ((bytes_read = framer->fill(instrument_socket)) == -1)
 			{
-				// Wait for data to become possible
-				if (select(instrument_socket + 1, &readfdset, NULL, NULL, &timeout_s) != 1)
+				if ((errno != EAGAIN) && (errno != EINTR))
 				{
-					throw_opentmlib_error(-OPENTMLIB_ERROR_TIMEOUT);
+					throw_opentmlib_error(-errno);
 				}
-			}
 
-			// Read data to local buffer
-			if ((bytes_read = recv(instrument_socket, session_buffer_ptr + done, max - done, 0)) == -1)
-			{
-				throw_opentmlib_error(-errno);
+				// Nothing there yet, wait for data to become available
+				if (errno == EAGAIN)
+					wait_ready(false);
+				continue;
 			}
-
-			// Check if data read includes term character
-			int i = 0;
-			while ((*(session_buffer_ptr + done + i) != term_character) && (i < bytes_read)) i++;
-			if (i < bytes_read)
+			quick_ack();
+			if (bytes_read == 0)
 			{
-				// Found term character, copy buffer up to term character to target
-				memcpy(buffer, session_buffer_ptr, done + i + 1);
-				// Copy remaining data (if any) to beginning of local buffer
-				if (bytes_read - i - 1 > 0)
-					memcpy(session_buffer_ptr, session_buffer_ptr + done + i + 1, bytes_read - i - 1);
-				write_index = bytes_read - i - 1;
-				return done + i + 1;
+				// Connection closed by instrument
+				throw_opentmlib_error(-OPENTMLIB_ERROR_IO_ISSUE);
 			}
 
-			done += bytes_read;
+		}
 
+		if (bytes_read == -1)
+		{
+			// No termination character found but max number of bytes requested reached
+			// Caller got what we have...
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BUFFER_OVERFLOW);
 		}
-		while (done < max);
 
-		// No termination character found but max number of bytes requested reached
-		// Return what we have...
-		memcpy(buffer, session_buffer_ptr, max);
-		write_index = 0;
-		throw_opentmlib_error(-OPENTMLIB_ERROR_BUFFER_OVERFLOW);
+		return bytes_read;
 
 	}
 
@@ -312,7 +537,8 @@ void socket_session::set_attribute(unsigned int attribute, unsigned int value)
 		break;
 
 	case OPENTMLIB_ATTRIBUTE_TIMEOUT:
-		timeout = value;
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT_MS:
+		set_timeout(attribute, value);
 		break;
 
 	case OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE:
@@ -331,6 +557,22 @@ void socket_session::set_attribute(unsigned int attribute, unsigned int value)
 		term_character = value;
 		break;
 
+	case OPENTMLIB_ATTRIBUTE_SOCKET_BUFFER_SIZE:
+		framer->set_limit(value); // Largest message (buffer grows up to this size as needed)
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_SOCKET_LATENCY_MODE:
+		set_latency_mode(value, spin_time);
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_SOCKET_SPIN_TIME:
+		if (value > 1000000)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE_VALUE);
+		}
+		set_latency_mode(latency_mode, value);
+		break;
+
 	default:
 		throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE);
 
@@ -370,7 +612,8 @@ unsigned int socket_session::get_attribute(unsigned int attribute)
 		return eol_char;
 
 	case OPENTMLIB_ATTRIBUTE_TIMEOUT:
-		return timeout;
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT_MS:
+		return get_timeout(attribute);
 
 	case OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE:
 		return term_char_enable;
@@ -379,7 +622,13 @@ unsigned int socket_session::get_attribute(unsigned int attribute)
 		return term_character;
 
 	case OPENTMLIB_ATTRIBUTE_SOCKET_BUFFER_SIZE:
-		return SOCKET_SESSION_LOCAL_BUFFER_SIZE;
+		return framer->get_limit();
+
+	case OPENTMLIB_ATTRIBUTE_SOCKET_LATENCY_MODE:
+		return latency_mode;
+
+	case OPENTMLIB_ATTRIBUTE_SOCKET_SPIN_TIME:
+		return spin_time;
 
 	default:
 		throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE);
@@ -388,12 +637,104 @@ unsigned int socket_session::get_attribute(unsigned int attribute)
 
 }
 
+bool socket_session::spin_ready()
+{
+
+	struct pollfd fds[2];
+	struct timespec start, now;
+	long elapsed;
+
+	fds[0].fd = instrument_socket;
+	fds[0].events = POLLIN;
+	fds[1].fd = abort_event;
+	fds[1].events = POLLIN;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do
+	{
+		if (poll(fds, 2, 0) > 0)
+		{
+			// Abort is left to the blocking wait, which handles it
+			return (fds[1].revents == 0);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+	}
+	while (elapsed < (long) spin_time);
+
+	return false;
+
+}
+
+void socket_session::set_latency_mode(unsigned int mode, unsigned int spin_time)
+{
+
+	int flag, busy_poll;
+
+	if (mode > 1)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE_VALUE);
+	}
+
+	// Send small messages right away (no Nagle delay)
+	flag = mode;
+	if (setsockopt(instrument_socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int)) == -1)
+	{
+		throw_opentmlib_error(-errno);
+	}
+
+	// Let the kernel poll the network device for data while a read waits. Raising the value above the
+	// system default (net.core.busy_read) needs CAP_NET_ADMIN, so this is done where permitted only.
+	busy_poll = (mode == 1) ? spin_time : 0;
+	setsockopt(instrument_socket, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(int));
+
+	latency_mode = mode;
+	this->spin_time = spin_time;
+
+	// On a single CPU, spinning would only keep the peer (e.g. a local simulator) from running
+	spinning = (mode == 1) && (spin_time > 0) && (sysconf(_SC_NPROCESSORS_ONLN) > 1);
+
+	quick_ack();
+
+	return;
+
+}
+
+void socket_session::quick_ack()
+{
+
+	int flag = 1;
+
+	// Acknowledge received data immediately instead of delaying the ACK. The kernel may fall back to
+	// delayed ACKs on its own, so this is renewed after every receive.
+	if (latency_mode == 1)
+	{
+		setsockopt(instrument_socket, IPPROTO_TCP, TCP_QUICKACK, &flag, sizeof(int));
+	}
+
+	return;
+
+}
+
 void socket_session::io_operation(unsigned int operation, unsigned int value)
 {
 
+	flush_for_operation(operation);
+
 	switch (operation)
 	{
 
+	case OPENTMLIB_OPERATION_ABORT:
+		{
+			// Wake up read/write blocked in another thread
+			uint64_t increment = 1;
+			if (write(abort_event, &increment, sizeof(uint64_t)) != sizeof(uint64_t))
+			{
+				throw_opentmlib_error(-errno);
+			}
+		}
+		break;
+
 	default:
 		throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_OPERATION);
 
@@ -402,3 +743,77 @@ void socket_session::io_operation(unsigned int operation, unsigned int value)
 	return;
 
 }
+
+// Subscribes to readings the instrument sends on its own (e.g. INIT:CONT ON in talk-only mode). From now
+// on a thread receives and parses them, read_buffer is not available until the stream is stopped.
+void socket_session::start_stream(unsigned int capacity)
+{
+
+	vector<char> buffer;
+	int count;
+
+	if (stream != NULL)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_STREAM_ACTIVE);
+	}
+
+	stream = new reading_stream(instrument_socket, term_character, capacity);
+
+	try
+	{
+		// Data read ahead earlier is the start of the stream
+		buffer.resize(framer->get_count() + 1);
+		count = 0;
+		while (framer->get_count() > 0)
+		{
+			count += framer->extract(&buffer[count], buffer.size() - count);
+		}
+		stream->start(&buffer[0], count);
+	}
+
+	catch (opentmlib_exception & e)
+	{
+		delete stream;
+		stream = NULL;
+		throw e;
+	}
+
+	return;
+
+}
+
+// Copies up to max readings (oldest first) and returns how many. Waits up to the timeout if none are
+// there, 0 is returned if none arrived.
+int socket_session::read_readings(stream_reading *readings, int max)
+{
+
+	operation_deadline deadline_scope(this);
+
+	if (stream == NULL)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_OPERATION_UNSUPPORTED);
+	}
+
+	return stream->read(readings, max, remaining_time(), abort_event);
+
+}
+
+// Ends the subscription. Readings not read yet are discarded, so is a reading that was only partially
+// received (the instrument should be told to stop sending first).
+void socket_session::stop_stream()
+{
+
+	delete stream;
+	stream = NULL;
+
+	return;
+
+}
+
+uint64_t socket_session::get_stream_dropped()
+{
+
+	return (stream != NULL) ? stream->get_dropped() : 0;
+
+}
+
@@ -25,8 +25,15 @@
 #include <string>
 #include "io_session.hpp"
 #include "io_monitor.hpp"
+#include "stream_framer.hpp"
+#include "tcp_connector.hpp"
+#include "reading_stream.hpp"
 
-#define SOCKET_SESSION_LOCAL_BUFFER_SIZE					1024*1024*10
+#define SOCKET_SESSION_LOCAL_BUFFER_SIZE					1024*1024*10 // Default limit, see SOCKET_BUFFER_SIZE
+#define SOCKET_SESSION_DEFAULT_SPIN_TIME					50 // us
+#define SOCKET_SESSION_CONNECT_TIMEOUT					5000 // ms
+#define SOCKET_SESSION_SENDFILE_CHUNK					(4 * 1024 * 1024) // Bytes per sendfile call
+#define SOCKET_SESSION_SPLICE_PIPE_SIZE					(1024 * 1024) // Pipe between socket and file
 
 using namespace std;
 
@@ -35,18 +42,36 @@ class socket_session : public io_session
 
 public:
 	socket_session(string address, unsigned short int port = 5025, bool lock = false,
-		unsigned int lock_timeout = 5, io_monitor *monitor = NULL);
+		unsigned int lock_timeout = 5, io_monitor *monitor = NULL,
+		unsigned int connect_timeout = SOCKET_SESSION_CONNECT_TIMEOUT); // connect_timeout in ms, 0 = none
 	~socket_session();
 	int write_buffer(char *buffer, int count);
 	int read_buffer(char *buffer, int max);
 	void set_attribute(unsigned int attribute, unsigned int value);
 	unsigned int get_attribute(unsigned int attribute);
 	void io_operation(unsigned int operation, unsigned int value);
+	void start_stream(unsigned int capacity = READING_STREAM_CAPACITY); // Readings pushed by the instrument
+	int read_readings(stream_reading *readings, int max); // Waits (until timeout) for at least one
+	void stop_stream();
+	uint64_t get_stream_dropped(); // Readings lost because they weren't read in time
+
+protected:
+	void begin_operation(); // Forgets an abort issued while no operation was in progress
+	void write_from_file(int fd, off_t offset, off_t length, bool end_on_last); // sendfile
+	void read_to_file(int fd, off_t length); // splice
 
 private:
+	void wait_ready(bool for_write); // Wait for I/O readiness, timeout or abort
+	bool spin_ready(); // Poll for received data without sleeping (latency mode)
+	void set_latency_mode(unsigned int mode, unsigned int spin_time);
+	void quick_ack();
 	int instrument_socket; // Socket descriptor
-	char *session_buffer_ptr; // Pointer to local session buffer
-	int write_index; // Write index into local session buffer
+	stream_framer *framer; // Receive buffer (read-ahead and message framing)
+	int abort_event; // eventfd signalled by abort
+	unsigned int latency_mode; // 1 = TCP_NODELAY, quick ACKs, busy polling and spinning reads
+	unsigned int spin_time; // Time to spin before blocking in latency mode (us)
+	bool spinning; // Spin before blocking (latency mode, more than one CPU, spin time set)
+	reading_stream *stream; // Continuous stream subscription (NULL = none)
 
 };
 
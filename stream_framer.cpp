@@ -0,0 +1,288 @@
+/*
+ * stream_framer.cpp
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include "stream_framer.hpp"
+#include "buffer_pool.hpp"
+#include "opentmlib.hpp"
+
+using namespace std;
+
+stream_framer::stream_framer(unsigned int limit)
+{
+
+	ring = NULL; // Allocated when data arrives
+	capacity = 0;
+	this->limit = limit;
+	head = 0;
+	count = 0;
+	scanned = 0;
+	scanned_for = 0;
+
+	return;
+
+}
+
+stream_framer::~stream_framer()
+{
+
+	buffer_pool::release(ring, capacity);
+
+	return;
+
+}
+
+unsigned int stream_framer::get_limit()
+{
+
+	return limit;
+
+}
+
+void stream_framer::set_limit(unsigned int limit)
+{
+
+	if ((limit == 0) || (limit < count))
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_BAD_ATTRIBUTE_VALUE);
+	}
+
+	this->limit = limit;
+
+	// Give memory back if the ring is now larger than it may become
+	if ((capacity > limit) && (capacity > STREAM_FRAMER_INITIAL_SIZE))
+	{
+		if (resize(limit) == -1)
+		{
+			throw_opentmlib_error(-OPENTMLIB_ERROR_MEMORY_ALLOCATION);
+		}
+	}
+
+	return;
+
+}
+
+unsigned int stream_framer::get_count()
+{
+
+	return count;
+
+}
+
+int stream_framer::fill(int fd)
+{
+
+	struct iovec free_space[2];
+	unsigned int tail;
+	int segments, ret;
+
+	if (count == capacity)
+	{
+		// Ring is full (or not allocated yet), grow it
+		if (capacity >= limit)
+		{
+			errno = ENOBUFS;
+			return -1;
+		}
+		if (resize((capacity == 0) ? STREAM_FRAMER_INITIAL_SIZE :
+			((capacity * 2 < limit) ? capacity * 2 : limit)) == -1)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	// Free space is [tail, head) and may wrap around the end of the ring
+	tail = head + count;
+	if (tail >= capacity)
+		tail -= capacity;
+	free_space[0].iov_base = ring + tail;
+	if (tail >= head)
+	{
+		free_space[0].iov_len = capacity - tail;
+		free_space[1].iov_base = ring;
+		free_space[1].iov_len = head;
+		segments = (head > 0) ? 2 : 1;
+	}
+	else
+	{
+		free_space[0].iov_len = head - tail;
+		segments = 1;
+	}
+
+	// One system call takes whatever the device has ready (up to the free space)
+	do
+	{
+		ret = readv(fd, free_space, segments);
+	}
+	while ((ret == -1) && (errno == EINTR));
+
+	if (ret > 0)
+		count += ret;
+
+	return ret;
+
+}
+
+// Copies the next message (up to and including the termination character) to buffer and returns its
+// length. Returns 0 if no complete message is buffered yet. If the message is longer than max, max bytes
+// are copied out and -1 is returned.
+int stream_framer::extract_message(char *buffer, int max, char term_character)
+{
+
+	unsigned int start, first_length, length = 0;
+	char *found;
+
+	if (term_character != scanned_for)
+	{
+		// Termination character was changed, search everything again
+		scanned = 0;
+		scanned_for = term_character;
+	}
+
+	// Search the part not searched before (memchr is vectorized by the C library). Buffered data is
+	// [head, head + count) and may consist of two segments.
+	found = NULL;
+	start = head + scanned;
+	if (start >= capacity)
+		start -= capacity;
+	if ((start >= head) && (head + count > capacity))
+	{
+		// Search end of first segment, then second segment
+		first_length = capacity - start;
+		if ((found = (char *) memchr(ring + start, term_character, first_length)) != NULL)
+			length = found - (ring + start) + scanned + 1;
+		else if ((found = (char *) memchr(ring, term_character, head + count - capacity)) != NULL)
+			length = found - ring + scanned + first_length + 1;
+	}
+	else
+	{
+		if ((found = (char *) memchr(ring + start, term_character, count - scanned)) != NULL)
+			length = found - (ring + start) + scanned + 1;
+	}
+
+	if (found == NULL)
+	{
+		scanned = count;
+		if (count >= (unsigned int) max)
+		{
+			// No termination character within max bytes
+			copy_out(buffer, max);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (length > (unsigned int) max)
+	{
+		copy_out(buffer, max);
+		return -1;
+	}
+
+	copy_out(buffer, length);
+	return length;
+
+}
+
+int stream_framer::extract(char *buffer, int max)
+{
+
+	unsigned int length;
+
+	length = (count < (unsigned int) max) ? count : max;
+	copy_out(buffer, length);
+
+	return length;
+
+}
+
+void stream_framer::reset()
+{
+
+	head = 0;
+	count = 0;
+	scanned = 0;
+
+	return;
+
+}
+
+// Moves buffered data to the start of a new ring of (at least) the given size.
+int stream_framer::resize(unsigned int size)
+{
+
+	char *new_ring;
+	unsigned int new_capacity, buffered, buffered_scanned;
+
+	new_capacity = size;
+	if ((new_ring = buffer_pool::allocate(new_capacity)) == NULL)
+	{
+		return -1;
+	}
+
+	buffered = count;
+	buffered_scanned = scanned;
+	if (buffered > 0)
+	{
+		copy_out(new_ring, buffered);
+	}
+	buffer_pool::release(ring, capacity);
+
+	ring = new_ring;
+	capacity = new_capacity;
+	head = 0;
+	count = buffered;
+	scanned = buffered_scanned;
+
+	return 0;
+
+}
+
+void stream_framer::copy_out(char *buffer, unsigned int length)
+{
+
+	unsigned int first_length;
+
+	first_length = capacity - head;
+	if (length <= first_length)
+	{
+		memcpy(buffer, ring + head, length);
+	}
+	else
+	{
+		memcpy(buffer, ring + head, first_length);
+		memcpy(buffer + first_length, ring, length - first_length);
+	}
+
+	head += length;
+	if (head >= capacity)
+		head -= capacity;
+	count -= length;
+	scanned = (scanned > length) ? scanned - length : 0;
+	if (count == 0)
+		head = 0; // Keep following reads contiguous
+
+	return;
+
+}
@@ -0,0 +1,60 @@
+/*
+ * stream_framer.hpp
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#ifndef STREAM_FRAMER_HPP
+#define STREAM_FRAMER_HPP
+
+#define STREAM_FRAMER_INITIAL_SIZE					4096
+
+using namespace std;
+
+// Receive buffer for byte stream sessions (socket, serial). Data is read ahead into a ring buffer as far
+// as space allows and cut into messages at the termination character. Messages are copied out straight
+// from the ring, so leftover data never has to be moved. The ring is taken from the buffer pool on first
+// use and grows (doubling) while it runs full, up to the limit.
+class stream_framer
+{
+
+public:
+	stream_framer(unsigned int limit);
+	~stream_framer();
+	unsigned int get_limit(); // Largest message that can be framed
+	void set_limit(unsigned int limit); // Buffered data must fit
+	unsigned int get_count(); // Bytes buffered
+	int fill(int fd); // Read from fd into free space (returns bytes read, 0 = end of file, -1 = error in errno)
+	int extract_message(char *buffer, int max, char term_character); // See stream_framer.cpp
+	int extract(char *buffer, int max); // Copy out up to max buffered bytes (no framing)
+	void reset(); // Drop buffered data
+
+private:
+	void copy_out(char *buffer, unsigned int length);
+	int resize(unsigned int size);
+	char *ring; // Ring buffer (NULL until first used)
+	unsigned int capacity; // Size of ring buffer
+	unsigned int limit; // Size up to which the ring may grow
+	unsigned int head; // Index of oldest buffered byte
+	unsigned int count; // Number of bytes buffered
+	unsigned int scanned; // Bytes (from head) known not to contain the termination character
+	char scanned_for; // Termination character used for scanned
+
+};
+
+#endif
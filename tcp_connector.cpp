@@ -0,0 +1,282 @@
+/*
+ * tcp_connector.cpp
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include "tcp_connector.hpp"
+
+using namespace std;
+
+pthread_mutex_t tcp_connector::lock = PTHREAD_MUTEX_INITIALIZER;
+map<string, tcp_connector::cache_entry> tcp_connector::cache;
+
+static long long monotonic_ms()
+{
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+}
+
+int tcp_connector::connect_host(string host, unsigned short port, unsigned int timeout_ms)
+{
+
+	vector<struct sockaddr_storage> addresses;
+	vector<socklen_t> lengths;
+	vector<struct pollfd> pending;
+	long long now, deadline, next_start;
+	unsigned int next, i;
+	int fd, ret, error, wait, last_error;
+	socklen_t error_length;
+
+	if ((ret = resolve(host, addresses, lengths)) != 0)
+	{
+		errno = (ret == EAI_SYSTEM) ? errno : EHOSTUNREACH;
+		return -1;
+	}
+
+	for (i = 0; i < addresses.size(); i++)
+	{
+		if (addresses[i].ss_family == AF_INET6)
+			((struct sockaddr_in6 *) &addresses[i])->sin6_port = htons(port);
+		else
+			((struct sockaddr_in *) &addresses[i])->sin_port = htons(port);
+	}
+
+	now = monotonic_ms();
+	deadline = (timeout_ms == 0) ? -1 : now + timeout_ms;
+	next_start = now;
+	next = 0;
+	fd = -1;
+	last_error = EHOSTUNREACH;
+
+	while (fd == -1)
+	{
+		now = monotonic_ms();
+
+		// Start next attempt when its time has come or nothing else is pending
+		if ((next < addresses.size()) && ((now >= next_start) || pending.empty()))
+		{
+			ret = start_attempt(&addresses[next], lengths[next]);
+			next++;
+			next_start = now + TCP_CONNECTOR_ATTEMPT_DELAY;
+			if (ret == -1)
+			{
+				last_error = errno;
+				next_start = now;
+				continue;
+			}
+			struct pollfd attempt = { ret, POLLOUT, 0 };
+			pending.push_back(attempt);
+		}
+
+		if (pending.empty())
+		{
+			errno = last_error;
+			return -1;
+		}
+
+		// Sleep until an attempt completes, the next one is due or time is up
+		if ((deadline != -1) && (now >= deadline))
+		{
+			last_error = ETIMEDOUT;
+			break;
+		}
+		wait = -1;
+		if (next < addresses.size())
+			wait = (next_start > now) ? (int) (next_start - now) : 0;
+		if ((deadline != -1) && ((wait == -1) || (deadline - now < wait)))
+			wait = (int) (deadline - now);
+
+		ret = poll(&pending[0], pending.size(), wait);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			last_error = errno;
+			break;
+		}
+
+		for (i = 0; i < pending.size(); )
+		{
+			if (pending[i].revents == 0)
+			{
+				i++;
+				continue;
+			}
+			error = 0;
+			error_length = sizeof(error);
+			getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+			if (error == 0)
+			{
+				fd = pending[i].fd;
+				pending.erase(pending.begin() + i);
+				break;
+			}
+
+			// This address failed, don't wait for the delay to try the next one
+			close(pending[i].fd);
+			pending.erase(pending.begin() + i);
+			last_error = error;
+			next_start = now;
+		}
+	}
+
+	for (i = 0; i < pending.size(); i++)
+		close(pending[i].fd);
+
+	if (fd == -1)
+	{
+		errno = last_error;
+		return -1;
+	}
+
+	// Sessions use blocking sockets
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+	return fd;
+
+}
+
+void tcp_connector::flush_cache()
+{
+
+	pthread_mutex_lock(&lock);
+	cache.clear();
+	pthread_mutex_unlock(&lock);
+
+	return;
+
+}
+
+// Looks up host (cached), addresses are returned with alternating address families as recommended by
+// RFC 8305, starting with the family getaddrinfo preferred.
+int tcp_connector::resolve(string host, vector<struct sockaddr_storage> & addresses, vector<socklen_t> & lengths)
+{
+
+	struct addrinfo hints, *result, *entry;
+	vector<struct addrinfo *> first, second;
+	map<string, cache_entry>::iterator cached;
+	struct timespec now;
+	struct sockaddr_storage address;
+	unsigned int i;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&lock);
+	cached = cache.find(host);
+	if ((cached != cache.end()) && (cached->second.expires > now.tv_sec))
+	{
+		addresses = cached->second.addresses;
+		lengths = cached->second.lengths;
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&lock);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	if ((ret = getaddrinfo(host.c_str(), NULL, &hints, &result)) != 0)
+	{
+		return ret;
+	}
+
+	for (entry = result; entry != NULL; entry = entry->ai_next)
+	{
+		if ((entry->ai_family != AF_INET) && (entry->ai_family != AF_INET6))
+			continue;
+		if (first.empty() || (entry->ai_family == first[0]->ai_family))
+			first.push_back(entry);
+		else
+			second.push_back(entry);
+	}
+
+	addresses.clear();
+	lengths.clear();
+	for (i = 0; (i < first.size()) || (i < second.size()); i++)
+	{
+		if (i < first.size())
+		{
+			memset(&address, 0, sizeof(address));
+			memcpy(&address, first[i]->ai_addr, first[i]->ai_addrlen);
+			addresses.push_back(address);
+			lengths.push_back(first[i]->ai_addrlen);
+		}
+		if (i < second.size())
+		{
+			memset(&address, 0, sizeof(address));
+			memcpy(&address, second[i]->ai_addr, second[i]->ai_addrlen);
+			addresses.push_back(address);
+			lengths.push_back(second[i]->ai_addrlen);
+		}
+	}
+	freeaddrinfo(result);
+
+	if (addresses.empty())
+	{
+		return EAI_NONAME;
+	}
+
+	pthread_mutex_lock(&lock);
+	cache[host].addresses = addresses;
+	cache[host].lengths = lengths;
+	cache[host].expires = now.tv_sec + TCP_CONNECTOR_CACHE_TIME;
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+
+}
+
+// Creates a non-blocking socket and starts connecting. Returns the socket or -1 (errno) if the attempt
+// failed right away.
+int tcp_connector::start_attempt(struct sockaddr_storage *address, socklen_t length)
+{
+
+	int fd, error;
+
+	fd = socket(address->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (fd == -1)
+	{
+		return -1;
+	}
+
+	if ((connect(fd, (struct sockaddr *) address, length) == -1) && (errno != EINPROGRESS))
+	{
+		error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+
+	return fd;
+
+}
@@ -0,0 +1,63 @@
+/*
+ * tcp_connector.hpp
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#ifndef TCP_CONNECTOR_HPP
+#define TCP_CONNECTOR_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define TCP_CONNECTOR_ATTEMPT_DELAY					250 // ms between parallel attempts (RFC 8305)
+#define TCP_CONNECTOR_CACHE_TIME					60 // s a resolved host name is kept
+
+using namespace std;
+
+// Opens TCP connections to instruments. Host names (or address strings) are resolved with getaddrinfo
+// and the result is cached for the process. The addresses found (IPv6 and IPv4) are tried Happy Eyeballs
+// style: a new attempt is started every TCP_CONNECTOR_ATTEMPT_DELAY ms (or as soon as one fails) while
+// earlier ones are still pending, and the first connection established wins. Everything is bounded by one
+// deadline, so an instrument that is switched off costs the timeout, not the SYN retry time of the kernel.
+class tcp_connector
+{
+
+public:
+	static int connect_host(string host, unsigned short port, unsigned int timeout_ms); // Socket or -1 (errno)
+	static void flush_cache();
+
+private:
+	struct cache_entry
+	{
+		vector<struct sockaddr_storage> addresses; // Port not set
+		vector<socklen_t> lengths;
+		time_t expires; // CLOCK_MONOTONIC seconds
+	};
+	static int resolve(string host, vector<struct sockaddr_storage> & addresses, vector<socklen_t> & lengths);
+	static int start_attempt(struct sockaddr_storage *address, socklen_t length);
+	static pthread_mutex_t lock;
+	static map<string, cache_entry> cache;
+
+};
+
+#endif
@@ -0,0 +1,229 @@
+/*
+ * bench_usbtmc.cpp (checks and benchmarks the USBTMC driver against the emulator, see usbtmc_rig.sh)
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ *
+ * Usage: bench_usbtmc [-m minor] [-n iterations] [-s binblock size]
+ * Without a minor number, the instrument with serial number RIG0001 (the emulator) is used. Exits with 1
+ * if a check fails.
+ */
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "usbtmc_session.hpp"
+#include "opentmlib.hpp"
+
+using namespace std;
+
+#define BENCH_SERIAL_NUMBER "RIG0001"
+
+static double now_us()
+{
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+
+}
+
+// Prints min/median/p99/max of a latency series (us)
+static void report_latency(const char *name, vector<double> & samples)
+{
+
+	sort(samples.begin(), samples.end());
+	printf("%-24s min %8.1f  median %8.1f  p99 %8.1f  max %8.1f us\n", name, samples.front(),
+		samples[samples.size() / 2], samples[(samples.size() * 99) / 100], samples.back());
+
+}
+
+static void report_throughput(const char *name, double bytes, double elapsed_us)
+{
+
+	printf("%-24s %8.1f MB/s (%.0f bytes in %.3f s)\n", name, bytes / elapsed_us, bytes, elapsed_us / 1e6);
+
+}
+
+static void check(bool condition, const char *what)
+{
+
+	if (!condition)
+	{
+		fprintf(stderr, "bench_usbtmc: check failed: %s\n", what);
+		exit(1);
+	}
+
+}
+
+// Aborts a read blocked in another thread
+static void *abort_thread(void *argument)
+{
+
+	usleep(200000);
+	((io_session *) argument)->abort();
+	return NULL;
+
+}
+
+int main(int argc, char **argv)
+{
+
+	int minor = -1, iterations = 1000, size = 1048576, option, i;
+	vector<double> samples;
+	string response;
+	double start;
+	pthread_t thread;
+
+	while ((option = getopt(argc, argv, "m:n:s:")) != -1)
+	{
+		switch (option)
+		{
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-m minor] [-n iterations] [-s binblock size]\n", argv[0]);
+			exit(2);
+		}
+	}
+	if ((iterations < 1) || (size < 1))
+	{
+		fprintf(stderr, "bench_usbtmc: iterations and size must be positive\n");
+		exit(2);
+	}
+
+	char *buffer = new char[size];
+
+	try
+	{
+
+		usbtmc_session *session;
+		if (minor == -1)
+			session = new usbtmc_session("", "", BENCH_SERIAL_NUMBER);
+		else
+			session = new usbtmc_session(minor);
+		session->set_attribute(OPENTMLIB_ATTRIBUTE_TIMEOUT_MS, 2000);
+
+		// Identity
+		session->query_string("*IDN?", response);
+		cout << "Instrument ID: " << response << endl;
+		check(response.compare(0, 9, "openTMlib") == 0, "*IDN? response");
+
+		// Round trip of a short query (write, then read)
+		samples.clear();
+		for (i = 0; i < iterations; i++)
+		{
+			start = now_us();
+			session->query_string("*OPC?", response);
+			samples.push_back(now_us() - start);
+			check(response.compare(0, 1, "1") == 0, "*OPC? response");
+		}
+		report_latency("*OPC? round trip", samples);
+
+		// Status byte (READ_STATUS_BYTE, answered on the interrupt endpoint)
+		samples.clear();
+		for (i = 0; i < iterations; i++)
+		{
+			start = now_us();
+			session->read_stb();
+			samples.push_back(now_us() - start);
+		}
+		report_latency("READ_STATUS_BYTE", samples);
+
+		// Service request (SRQ notification on the interrupt endpoint)
+		samples.clear();
+		for (i = 0; i < iterations; i++)
+		{
+			start = now_us();
+			session->write_string("SRQ");
+			check((session->wait_srq() & 0x40) != 0, "RQS bit of SRQ notification");
+			samples.push_back(now_us() - start);
+			session->write_string("*CLS");
+		}
+		report_latency("SRQ write to wakeup", samples);
+
+		// Binblock reads
+		char query[32];
+		snprintf(query, sizeof(query), "DATA? %d", size);
+		start = now_us();
+		for (i = 0; i < iterations / 10 + 1; i++)
+		{
+			session->write_string(query);
+			check(session->read_binblock(buffer, size) == size, "DATA? binblock length");
+			check((buffer[0] == ' ') && (buffer[size - 1] == (char) (32 + (size - 1) % 95)), "DATA? binblock data");
+			session->read_string(response); // Terminating NL
+		}
+		report_throughput("Binblock read", (double) size * i, now_us() - start);
+
+		// Binblock writes (dropped by the emulator)
+		for (i = 0; i < size; i++)
+			buffer[i] = i;
+		start = now_us();
+		for (i = 0; i < iterations / 10 + 1; i++)
+			session->write_binblock(buffer, size);
+		session->query_string("*OPC?", response);
+		report_throughput("Binblock write", (double) size * i, now_us() - start);
+
+		// Abort a read nothing is going to answer (INITIATE_ABORT_BULK_IN)
+		pthread_create(&thread, NULL, abort_thread, session);
+		try
+		{
+			session->read_string(response);
+			check(false, "read without query returned");
+		}
+		catch (opentmlib_exception & e)
+		{
+			check(e.code == -OPENTMLIB_ERROR_TRANSACTION_ABORTED, "aborted read error code");
+		}
+		pthread_join(thread, NULL);
+		session->query_string("*OPC?", response);
+		check(response.compare(0, 1, "1") == 0, "*OPC? response after abort");
+		cout << "Abort of pending read: ok" << endl;
+
+		// Device clear (INITIATE_CLEAR) discards a response not read
+		session->write_string("*IDN?");
+		session->clear();
+		session->query_string("*OPC?", response);
+		check(response.compare(0, 1, "1") == 0, "*OPC? response after clear");
+		cout << "Device clear: ok" << endl;
+
+		delete session;
+
+	}
+	catch (opentmlib_exception & e)
+	{
+		fprintf(stderr, "bench_usbtmc: %s (%d)\n", e.what(), e.code);
+		exit(1);
+	}
+
+	delete[] buffer;
+	exit(0);
+
+}
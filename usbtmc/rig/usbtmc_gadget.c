@@ -0,0 +1,915 @@
+/*
+ * usbtmc_gadget.c (USBTMC/USB488 instrument emulator for the test rig, see usbtmc_rig.sh)
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+/*
+ * Emulates a USBTMC/USB488 instrument through FunctionFS, so the driver can be tested and benchmarked
+ * against a dummy_hcd gadget on any Linux box. The interface has a bulk OUT, a bulk IN and an interrupt
+ * IN endpoint. Usage: usbtmc_gadget [-v] <FunctionFS mount point>
+ *
+ * Commands understood (anything else is accepted and ignored):
+ * *IDN?			Identity
+ * *OPC?			Responds 1 (round trip latency)
+ * *STB?			Status byte
+ * *CLS				Clears the status byte
+ * SRQ				Sends a service request on the interrupt IN endpoint
+ * DATA? <n>		Responds with a definite length binblock of n bytes (read throughput)
+ *
+ * Messages that aren't commands (e.g. binblocks written) are counted and dropped, which is what write
+ * throughput is measured with. INITIATE_ABORT_BULK_IN/OUT, INITIATE_CLEAR, READ_STATUS_BYTE (answered
+ * through the interrupt IN endpoint), GET_CAPABILITIES and the USB488 REN/GTL/LLO requests are handled on
+ * the control endpoint.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <endian.h>
+#include <sys/ioctl.h>
+#include <linux/usb/functionfs.h>
+
+/* Byte order of descriptors (constant expressions, unlike htole16/htole32) */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define cpu_to_le16(x)							(x)
+#define cpu_to_le32(x)							(x)
+#else
+#define cpu_to_le16(x)							((((x) >> 8) & 0xffu) | (((x) & 0xffu) << 8))
+#define cpu_to_le32(x)							((((x) & 0xff000000u) >> 24) | (((x) & 0x00ff0000u) >> 8) | \
+												(((x) & 0x0000ff00u) << 8) | (((x) & 0x000000ffu) << 24))
+#endif
+
+#define GADGET_CHUNK							65536 /* Bytes per read/write on the bulk endpoints */
+#define GADGET_COMMAND_MAX						4096 /* Bytes of a message kept for command parsing */
+#define GADGET_NOTIFICATIONS					16 /* Interrupt IN notifications queued */
+#define GADGET_IDENTITY							"openTMlib,USBTMC emulator,0,1.0\n"
+
+/* USBTMC message IDs, requests and status values (see usbtmc.c) */
+#define USBTMC_MSGID_DEV_DEP_MSG_OUT			1
+#define USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN		2
+#define USBTMC_MSGID_TRIGGER					128
+#define USBTMC_BREQUEST_INITIATE_ABORT_BULK_OUT	1
+#define USBTMC_BREQUEST_CHECK_ABORT_BULK_OUT_STATUS	2
+#define USBTMC_BREQUEST_INITIATE_ABORT_BULK_IN	3
+#define USBTMC_BREQUEST_CHECK_ABORT_BULK_IN_STATUS	4
+#define USBTMC_BREQUEST_INITIATE_CLEAR			5
+#define USBTMC_BREQUEST_CHECK_CLEAR_STATUS		6
+#define USBTMC_BREQUEST_GET_CAPABILITIES		7
+#define USBTMC_BREQUEST_INDICATOR_PULSE			64
+#define USBTMC_BREQUEST_READ_STATUS_BYTE		128
+#define USBTMC_BREQUEST_REN_CONTROL				160
+#define USBTMC_BREQUEST_GO_TO_LOCAL				161
+#define USBTMC_BREQUEST_LOCAL_LOCKOUT			162
+#define USBTMC_STATUS_SUCCESS					0x01
+#define USBTMC_STATUS_PENDING					0x02
+#define USBTMC_STATUS_FAILED					0x80
+#define USBTMC_NOTIFY_SRQ						0x81
+#define USBTMC_NOTIFY_STB						0x80
+#define USBTMC_STB_MAV							0x10 /* Message available */
+#define USBTMC_STB_RQS							0x40 /* Requesting service */
+
+/* Descriptors: one interface (application specific class, USBTMC subclass, USB488 protocol) */
+#define GADGET_INTERFACE(endpoints) \
+	{ \
+		.bLength = sizeof(struct usb_interface_descriptor), \
+		.bDescriptorType = USB_DT_INTERFACE, \
+		.bNumEndpoints = endpoints, \
+		.bInterfaceClass = 0xfe, \
+		.bInterfaceSubClass = 3, \
+		.bInterfaceProtocol = 1, \
+		.iInterface = 1 \
+	}
+#define GADGET_ENDPOINT(address, attributes, size, interval) \
+	{ \
+		.bLength = USB_DT_ENDPOINT_SIZE, \
+		.bDescriptorType = USB_DT_ENDPOINT, \
+		.bEndpointAddress = address, \
+		.bmAttributes = attributes, \
+		.wMaxPacketSize = cpu_to_le16(size), \
+		.bInterval = interval \
+	}
+#define GADGET_COMPANION(bytes_per_interval) \
+	{ \
+		.bLength = USB_DT_SS_EP_COMP_SIZE, \
+		.bDescriptorType = USB_DT_SS_ENDPOINT_COMP, \
+		.wBytesPerInterval = cpu_to_le16(bytes_per_interval) \
+	}
+
+struct gadget_descriptors
+{
+	struct usb_interface_descriptor interface;
+	struct usb_endpoint_descriptor_no_audio bulk_out;
+	struct usb_endpoint_descriptor_no_audio bulk_in;
+	struct usb_endpoint_descriptor_no_audio interrupt_in;
+} __attribute__((packed));
+
+struct gadget_ss_descriptors
+{
+	struct usb_interface_descriptor interface;
+	struct usb_endpoint_descriptor_no_audio bulk_out;
+	struct usb_ss_ep_comp_descriptor bulk_out_companion;
+	struct usb_endpoint_descriptor_no_audio bulk_in;
+	struct usb_ss_ep_comp_descriptor bulk_in_companion;
+	struct usb_endpoint_descriptor_no_audio interrupt_in;
+	struct usb_ss_ep_comp_descriptor interrupt_in_companion;
+} __attribute__((packed));
+
+static const struct
+{
+	struct usb_functionfs_descs_head_v2 header;
+	__le32 fs_count;
+	__le32 hs_count;
+	__le32 ss_count;
+	struct gadget_descriptors fs;
+	struct gadget_descriptors hs;
+	struct gadget_ss_descriptors ss;
+} __attribute__((packed)) descriptors =
+{
+	.header =
+	{
+		.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+		.length = cpu_to_le32(sizeof(descriptors)),
+		.flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC | FUNCTIONFS_HAS_SS_DESC)
+	},
+	.fs_count = cpu_to_le32(4),
+	.hs_count = cpu_to_le32(4),
+	.ss_count = cpu_to_le32(7),
+	.fs =
+	{
+		.interface = GADGET_INTERFACE(3),
+		.bulk_out = GADGET_ENDPOINT(1 | USB_DIR_OUT, USB_ENDPOINT_XFER_BULK, 64, 0),
+		.bulk_in = GADGET_ENDPOINT(2 | USB_DIR_IN, USB_ENDPOINT_XFER_BULK, 64, 0),
+		.interrupt_in = GADGET_ENDPOINT(3 | USB_DIR_IN, USB_ENDPOINT_XFER_INT, 8, 1)
+	},
+	.hs =
+	{
+		.interface = GADGET_INTERFACE(3),
+		.bulk_out = GADGET_ENDPOINT(1 | USB_DIR_OUT, USB_ENDPOINT_XFER_BULK, 512, 0),
+		.bulk_in = GADGET_ENDPOINT(2 | USB_DIR_IN, USB_ENDPOINT_XFER_BULK, 512, 0),
+		.interrupt_in = GADGET_ENDPOINT(3 | USB_DIR_IN, USB_ENDPOINT_XFER_INT, 8, 4)
+	},
+	.ss =
+	{
+		.interface = GADGET_INTERFACE(3),
+		.bulk_out = GADGET_ENDPOINT(1 | USB_DIR_OUT, USB_ENDPOINT_XFER_BULK, 1024, 0),
+		.bulk_out_companion = GADGET_COMPANION(0),
+		.bulk_in = GADGET_ENDPOINT(2 | USB_DIR_IN, USB_ENDPOINT_XFER_BULK, 1024, 0),
+		.bulk_in_companion = GADGET_COMPANION(0),
+		.interrupt_in = GADGET_ENDPOINT(3 | USB_DIR_IN, USB_ENDPOINT_XFER_INT, 8, 4),
+		.interrupt_in_companion = GADGET_COMPANION(8)
+	}
+};
+
+#define GADGET_INTERFACE_NAME					"USBTMC emulator"
+
+static const struct
+{
+	struct usb_functionfs_strings_head header;
+	struct
+	{
+		__le16 code;
+		const char name[sizeof(GADGET_INTERFACE_NAME)];
+	} __attribute__((packed)) lang0;
+} __attribute__((packed)) strings =
+{
+	.header =
+	{
+		.magic = cpu_to_le32(FUNCTIONFS_STRINGS_MAGIC),
+		.length = cpu_to_le32(sizeof(strings)),
+		.str_count = cpu_to_le32(1),
+		.lang_count = cpu_to_le32(1)
+	},
+	.lang0 =
+	{
+		cpu_to_le16(0x0409), /* en-us */
+		GADGET_INTERFACE_NAME
+	}
+};
+
+/* A response: head, body_length generated bytes (binblock data) and tail */
+struct gadget_response
+{
+	char head[32];
+	size_t head_length;
+	size_t body_length;
+	char tail[2];
+	size_t tail_length;
+};
+
+/* State shared by the control endpoint (main thread), the bulk thread and the interrupt thread */
+static struct
+{
+	int ep0, bulk_out, bulk_in, interrupt_in;
+	int verbose;
+	pthread_mutex_t lock;
+	pthread_cond_t changed; /* Signalled when enabled or notifications change */
+	int enabled; /* Configured by the host */
+	unsigned int bulk_in_packet_size; /* wMaxPacketSize of bulk IN at the current speed */
+	/* Response being delivered */
+	struct gadget_response response;
+	size_t response_total;
+	size_t response_sent;
+	int response_queued;
+	/* REQUEST_DEV_DEP_MSG_IN waiting for the response (bulk IN transfer pending on the host) */
+	int request_pending;
+	int sending; /* DEV_DEP_MSG_IN being written */
+	unsigned char request_tag;
+	unsigned int bytes_sent; /* Of the current transfer (NBYTES_TXD) */
+	int abort_in; /* INITIATE_ABORT_BULK_IN received while sending */
+	/* Message being received */
+	int abort_out; /* INITIATE_ABORT_BULK_OUT received, drop message being received */
+	unsigned char out_tag;
+	unsigned int bytes_received; /* Of the current message (NBYTES_RXD) */
+	int receiving;
+	unsigned char stb;
+	unsigned char notifications[GADGET_NOTIFICATIONS][2];
+	unsigned int notify_head, notify_tail;
+	/* Counters, printed on exit */
+	unsigned long long messages, bytes_in, bytes_out, triggers, srqs, aborts;
+} gadget =
+{
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.changed = PTHREAD_COND_INITIALIZER
+};
+
+static volatile sig_atomic_t stopping;
+
+static void fail(const char *what)
+{
+
+	perror(what);
+	exit(1);
+
+}
+
+/* Byte of the generated binblock data (printable, so it never matches the usual termination character) */
+static char body_byte(size_t index)
+{
+
+	return 32 + (index % 95);
+
+}
+
+/* Copies length bytes of the response, starting at offset */
+static void response_copy(struct gadget_response *response, size_t offset, char *destination, size_t length)
+{
+
+	size_t part;
+
+	while (length > 0)
+	{
+		if (offset < response->head_length)
+		{
+			part = response->head_length - offset;
+			if (part > length)
+				part = length;
+			memcpy(destination, &response->head[offset], part);
+		}
+		else if (offset < response->head_length + response->body_length)
+		{
+			part = response->head_length + response->body_length - offset;
+			if (part > length)
+				part = length;
+			for (size_t i = 0; i < part; i++)
+				destination[i] = body_byte(offset - response->head_length + i);
+		}
+		else
+		{
+			part = length;
+			memcpy(destination, &response->tail[offset - response->head_length - response->body_length], part);
+		}
+		offset += part;
+		destination += part;
+		length -= part;
+	}
+
+}
+
+/* Queues an interrupt IN notification (called with the lock held) */
+static void queue_notification(unsigned char notify1, unsigned char notify2)
+{
+
+	if (gadget.notify_head - gadget.notify_tail >= GADGET_NOTIFICATIONS)
+		return; /* Host isn't listening */
+	gadget.notifications[gadget.notify_head % GADGET_NOTIFICATIONS][0] = notify1;
+	gadget.notifications[gadget.notify_head % GADGET_NOTIFICATIONS][1] = notify2;
+	gadget.notify_head++;
+	pthread_cond_broadcast(&gadget.changed);
+
+}
+
+/* Status byte as reported to the host (called with the lock held) */
+static unsigned char status_byte(void)
+{
+
+	return gadget.stb | (gadget.response_queued ? USBTMC_STB_MAV : 0);
+
+}
+
+/* Executes a complete message (called with the lock held) */
+static void execute(char *command, size_t length)
+{
+
+	struct gadget_response *response = &gadget.response;
+	unsigned long long count;
+	char digits[24];
+
+	while ((length > 0) && ((command[length - 1] == '\n') || (command[length - 1] == '\r')))
+		length--;
+	command[length] = 0;
+	if (gadget.verbose)
+		fprintf(stderr, "usbtmc_gadget: %.60s\n", command);
+
+	memset(response, 0, sizeof(struct gadget_response));
+	if (strcmp(command, "*IDN?") == 0)
+	{
+		strcpy(response->head, GADGET_IDENTITY);
+	}
+	else if (strcmp(command, "*OPC?") == 0)
+	{
+		strcpy(response->head, "1\n");
+	}
+	else if (strcmp(command, "*STB?") == 0)
+	{
+		snprintf(response->head, sizeof(response->head), "%u\n", gadget.stb);
+	}
+	else if (strcmp(command, "*CLS") == 0)
+	{
+		gadget.stb = 0;
+		return;
+	}
+	else if (strcmp(command, "SRQ") == 0)
+	{
+		gadget.stb |= USBTMC_STB_RQS;
+		gadget.srqs++;
+		queue_notification(USBTMC_NOTIFY_SRQ, gadget.stb);
+		return;
+	}
+	else if (sscanf(command, "DATA? %llu", &count) == 1)
+	{
+		snprintf(digits, sizeof(digits), "%llu", count);
+		snprintf(response->head, sizeof(response->head), "#%zu%s", strlen(digits), digits);
+		response->body_length = count;
+		strcpy(response->tail, "\n");
+	}
+	else
+	{
+		return;
+	}
+
+	response->head_length = strlen(response->head);
+	response->tail_length = strlen(response->tail);
+	gadget.response_total = response->head_length + response->body_length + response->tail_length;
+	gadget.response_sent = 0;
+	gadget.response_queued = 1;
+
+}
+
+/* Writes count bytes to the bulk IN endpoint. Returns 0 or -1 if the host went away. */
+static int bulk_write(const char *buffer, size_t count)
+{
+
+	ssize_t ret;
+
+	while (1)
+	{
+		ret = write(gadget.bulk_in, buffer, count);
+		if (ret >= 0)
+			return 0;
+		if (errno != EINTR)
+			return -1;
+	}
+
+}
+
+/* Answers the pending REQUEST_DEV_DEP_MSG_IN with one DEV_DEP_MSG_IN transfer (called with the lock held,
+ * released while writing). max_size and the termination character come from the request. */
+static void respond(unsigned int max_size, int term_char_enabled, unsigned char term_char)
+{
+
+	static char buffer[GADGET_CHUNK];
+	size_t size, total, done, part, offset, i;
+	unsigned int packet_size;
+	int eom;
+
+	/* Bytes of this transfer, up to and including the termination character */
+	size = gadget.response_total - gadget.response_sent;
+	if (size > max_size)
+		size = max_size;
+	if (term_char_enabled)
+	{
+		for (offset = 0; offset < size; offset += part)
+		{
+			part = (size - offset < GADGET_CHUNK) ? size - offset : GADGET_CHUNK;
+			response_copy(&gadget.response, gadget.response_sent + offset, buffer, part);
+			for (i = 0; (i < part) && ((unsigned char) buffer[i] != term_char); i++)
+				;
+			if (i < part)
+			{
+				size = offset + i + 1;
+				break;
+			}
+		}
+	}
+	eom = (gadget.response_sent + size == gadget.response_total);
+
+	gadget.request_pending = 0;
+	gadget.sending = 1;
+	gadget.bytes_sent = 0;
+	packet_size = gadget.bulk_in_packet_size;
+	offset = gadget.response_sent;
+	gadget.response_sent += size;
+	if (eom)
+		gadget.response_queued = 0;
+	pthread_mutex_unlock(&gadget.lock);
+
+	/* Header, data and alignment bytes, in chunks */
+	total = (12 + size + 3) & ~3;
+	memset(buffer, 0, 12);
+	buffer[0] = USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN;
+	buffer[1] = gadget.request_tag;
+	buffer[2] = ~gadget.request_tag;
+	buffer[4] = size & 255;
+	buffer[5] = (size >> 8) & 255;
+	buffer[6] = (size >> 16) & 255;
+	buffer[7] = (size >> 24) & 255;
+	buffer[8] = eom;
+	for (done = 0; done < total; done += part)
+	{
+		part = (total - done < GADGET_CHUNK) ? total - done : GADGET_CHUNK;
+		if (done == 0)
+		{
+			response_copy(&gadget.response, offset, &buffer[12], (part - 12 < size) ? part - 12 : size);
+			if (part - 12 > size)
+				memset(&buffer[12 + size], 0, part - 12 - size);
+		}
+		else
+		{
+			i = (done - 12 < size) ? size - (done - 12) : 0;
+			if (i > part)
+				i = part;
+			response_copy(&gadget.response, offset + done - 12, buffer, i);
+			memset(&buffer[i], 0, part - i);
+		}
+		if (__atomic_load_n(&gadget.abort_in, __ATOMIC_ACQUIRE))
+			break;
+		if (bulk_write(buffer, part) < 0)
+			break;
+		__atomic_store_n(&gadget.bytes_sent, done + part, __ATOMIC_RELEASE);
+	}
+
+	/* A transfer shorter than the host asked for ends with a short packet. Aborting it does the same. */
+	if ((done == total) ? ((total % packet_size == 0) && (total < ((12 + max_size + packet_size - 1) /
+		packet_size) * packet_size)) : 1)
+		bulk_write(buffer, 0);
+
+	pthread_mutex_lock(&gadget.lock);
+	gadget.bytes_out += size;
+	gadget.sending = 0;
+	gadget.abort_in = 0;
+
+}
+
+/* Waits until the host has configured the gadget. Returns 0, or -1 when stopping. */
+static int wait_enabled(void)
+{
+
+	pthread_mutex_lock(&gadget.lock);
+	while (!gadget.enabled && !stopping)
+		pthread_cond_wait(&gadget.changed, &gadget.lock);
+	pthread_mutex_unlock(&gadget.lock);
+
+	return stopping ? -1 : 0;
+
+}
+
+/* Receives messages on the bulk OUT endpoint. Requests for responses are answered right away. */
+static void *bulk_thread(void *unused)
+{
+
+	static char buffer[GADGET_CHUNK];
+	static char command[GADGET_COMMAND_MAX + 1];
+	unsigned char header[12];
+	size_t header_length = 0, remaining = 0, command_length = 0, want, offset, part;
+	unsigned int size;
+	ssize_t ret;
+	int eom = 0;
+
+	while (wait_enabled() == 0)
+	{
+
+		/* Read the rest of the header, or of the message */
+		if (header_length < 12)
+			want = 12 - header_length;
+		else
+			want = (remaining < GADGET_CHUNK) ? remaining : GADGET_CHUNK;
+		ret = read(gadget.bulk_out, buffer, want);
+		if (ret < 0)
+		{
+			if ((errno != EINTR) && (errno != ESHUTDOWN))
+				perror("usbtmc_gadget: bulk OUT");
+			if (errno != EINTR)
+			{
+				/* Disabled, start over with the next message */
+				header_length = 0;
+				usleep(10000);
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&gadget.lock);
+		if (gadget.abort_out)
+		{
+			/* Message dropped, this is the start of the next one */
+			gadget.abort_out = 0;
+			header_length = 0;
+			remaining = 0;
+		}
+		for (offset = 0; offset < (size_t) ret; offset += part)
+		{
+			if (header_length < 12)
+			{
+				part = (12 - header_length < ret - offset) ? 12 - header_length : ret - offset;
+				memcpy(&header[header_length], &buffer[offset], part);
+				header_length += part;
+				if (header_length < 12)
+					continue;
+				size = header[4] | (header[5] << 8) | (header[6] << 16) | ((unsigned int) header[7] << 24);
+				if (header[0] == USBTMC_MSGID_DEV_DEP_MSG_OUT)
+				{
+					/* Payload and alignment bytes follow */
+					remaining = (size + 3) & ~3U;
+					eom = header[8] & 1;
+					gadget.out_tag = header[1];
+					gadget.bytes_received = 0;
+					gadget.receiving = 1;
+					gadget.messages++;
+				}
+				else if (header[0] == USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN)
+				{
+					gadget.request_tag = header[1];
+					gadget.request_pending = 1;
+					if (gadget.response_queued)
+						respond(size, header[8] & 2, header[9]);
+					header_length = 0;
+				}
+				else
+				{
+					if (header[0] == USBTMC_MSGID_TRIGGER)
+						gadget.triggers++;
+					header_length = 0;
+				}
+				/* Empty DEV_DEP_MSG_OUT */
+				if ((header_length == 12) && (remaining == 0))
+				{
+					if (eom)
+					{
+						execute(command, command_length);
+						command_length = 0;
+					}
+					header_length = 0;
+					gadget.receiving = 0;
+				}
+				continue;
+			}
+			part = (remaining < ret - offset) ? remaining : ret - offset;
+			if (command_length < GADGET_COMMAND_MAX)
+			{
+				size = header[4] | (header[5] << 8) | (header[6] << 16) | ((unsigned int) header[7] << 24);
+				size -= gadget.bytes_received < size ? gadget.bytes_received : size; /* Payload left */
+				size = (size < part) ? size : part;
+				if (size > GADGET_COMMAND_MAX - command_length)
+					size = GADGET_COMMAND_MAX - command_length;
+				memcpy(&command[command_length], &buffer[offset], size);
+				command_length += size;
+			}
+			gadget.bytes_received += part;
+			gadget.bytes_in += part;
+			remaining -= part;
+			if (remaining == 0)
+			{
+				/* A message without EOM is continued by the next one */
+				if (eom)
+				{
+					execute(command, command_length);
+					command_length = 0;
+				}
+				header_length = 0;
+				gadget.receiving = 0;
+			}
+		}
+		pthread_mutex_unlock(&gadget.lock);
+
+	}
+
+	return NULL;
+
+}
+
+/* Sends queued notifications on the interrupt IN endpoint (each write waits for the host to poll) */
+static void *interrupt_thread(void *unused)
+{
+
+	unsigned char notification[2];
+
+	pthread_mutex_lock(&gadget.lock);
+	while (!stopping)
+	{
+		if (!gadget.enabled || (gadget.notify_head == gadget.notify_tail))
+		{
+			pthread_cond_wait(&gadget.changed, &gadget.lock);
+			continue;
+		}
+		memcpy(notification, gadget.notifications[gadget.notify_tail % GADGET_NOTIFICATIONS], 2);
+		gadget.notify_tail++;
+		pthread_mutex_unlock(&gadget.lock);
+		if ((write(gadget.interrupt_in, notification, 2) < 0) && (errno != ESHUTDOWN))
+			perror("usbtmc_gadget: interrupt IN");
+		pthread_mutex_lock(&gadget.lock);
+	}
+	pthread_mutex_unlock(&gadget.lock);
+
+	return NULL;
+
+}
+
+/* Answers a class request on the control endpoint */
+static void setup(const struct usb_ctrlrequest *request)
+{
+
+	unsigned char reply[24];
+	size_t length;
+	int zero_length_packet = 0;
+
+	memset(reply, 0, sizeof(reply));
+	reply[0] = USBTMC_STATUS_SUCCESS;
+	length = 1;
+
+	if (((request->bRequestType & USB_TYPE_MASK) != USB_TYPE_CLASS) || !(request->bRequestType & USB_DIR_IN))
+	{
+		/* Not ours, stall */
+		if (request->bRequestType & USB_DIR_IN)
+		{
+			if (read(gadget.ep0, NULL, 0) < 0)
+			{
+				/* Stalled */
+			}
+		}
+		else if (write(gadget.ep0, NULL, 0) < 0)
+		{
+			/* Stalled */
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&gadget.lock);
+	switch (request->bRequest)
+	{
+
+	case USBTMC_BREQUEST_INITIATE_ABORT_BULK_OUT:
+		reply[1] = gadget.out_tag;
+		if (gadget.receiving)
+		{
+			gadget.abort_out = 1;
+			gadget.receiving = 0;
+			gadget.aborts++;
+		}
+		else
+			reply[0] = USBTMC_STATUS_FAILED;
+		length = 2;
+		break;
+
+	case USBTMC_BREQUEST_CHECK_ABORT_BULK_OUT_STATUS:
+		reply[4] = gadget.bytes_received & 255;
+		reply[5] = (gadget.bytes_received >> 8) & 255;
+		reply[6] = (gadget.bytes_received >> 16) & 255;
+		reply[7] = (gadget.bytes_received >> 24) & 255;
+		length = 8;
+		break;
+
+	case USBTMC_BREQUEST_INITIATE_ABORT_BULK_IN:
+		reply[1] = gadget.request_tag;
+		if (gadget.sending)
+		{
+			__atomic_store_n(&gadget.abort_in, 1, __ATOMIC_RELEASE);
+			gadget.aborts++;
+		}
+		else if (gadget.request_pending)
+		{
+			/* Nothing to send, end the transfer with a short packet */
+			gadget.request_pending = 0;
+			zero_length_packet = 1;
+			gadget.aborts++;
+		}
+		else
+			reply[0] = USBTMC_STATUS_FAILED;
+		length = 2;
+		break;
+
+	case USBTMC_BREQUEST_CHECK_ABORT_BULK_IN_STATUS:
+		if (gadget.sending)
+		{
+			reply[0] = USBTMC_STATUS_PENDING;
+			reply[1] = 1; /* More data queued */
+		}
+		reply[4] = gadget.bytes_sent & 255;
+		reply[5] = (gadget.bytes_sent >> 8) & 255;
+		reply[6] = (gadget.bytes_sent >> 16) & 255;
+		reply[7] = (gadget.bytes_sent >> 24) & 255;
+		length = 8;
+		break;
+
+	case USBTMC_BREQUEST_INITIATE_CLEAR:
+		gadget.response_queued = 0;
+		gadget.abort_out = gadget.receiving;
+		gadget.receiving = 0;
+		break;
+
+	case USBTMC_BREQUEST_CHECK_CLEAR_STATUS:
+		length = 2;
+		break;
+
+	case USBTMC_BREQUEST_GET_CAPABILITIES:
+		reply[2] = 0x00; /* bcdUSBTMC 1.00 */
+		reply[3] = 0x01;
+		reply[4] = 0x04; /* Accepts INDICATOR_PULSE */
+		reply[5] = 0x01; /* Supports TermChar */
+		reply[12] = 0x00; /* bcdUSB488 1.00 */
+		reply[13] = 0x01;
+		reply[14] = 0x07; /* USB488.2, REN/GTL/LLO, TRIGGER */
+		reply[15] = 0x0f; /* SCPI, SR1, RL1, DT1 */
+		length = 24;
+		break;
+
+	case USBTMC_BREQUEST_READ_STATUS_BYTE:
+		/* The status byte goes through the interrupt IN endpoint, reading it clears RQS */
+		reply[1] = le16toh(request->wValue) & 0x7f;
+		queue_notification(USBTMC_NOTIFY_STB | reply[1], status_byte());
+		gadget.stb &= ~USBTMC_STB_RQS;
+		length = 3;
+		break;
+
+	case USBTMC_BREQUEST_INDICATOR_PULSE:
+	case USBTMC_BREQUEST_REN_CONTROL:
+	case USBTMC_BREQUEST_GO_TO_LOCAL:
+	case USBTMC_BREQUEST_LOCAL_LOCKOUT:
+		break;
+
+	default:
+		pthread_mutex_unlock(&gadget.lock);
+		if (read(gadget.ep0, NULL, 0) < 0)
+		{
+			/* Stalled */
+		}
+		return;
+
+	}
+	pthread_mutex_unlock(&gadget.lock);
+
+	if (length > le16toh(request->wLength))
+		length = le16toh(request->wLength);
+	if (write(gadget.ep0, reply, length) < 0)
+		perror("usbtmc_gadget: ep0");
+
+	if (zero_length_packet)
+		bulk_write(NULL, 0);
+
+}
+
+static void stop(int signal)
+{
+
+	stopping = 1;
+
+}
+
+static int open_endpoint(const char *directory, const char *name)
+{
+
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", directory, name);
+	if ((fd = open(path, O_RDWR)) < 0)
+		fail(path);
+
+	return fd;
+
+}
+
+int main(int argc, char **argv)
+{
+
+	struct usb_functionfs_event events[4];
+	struct usb_endpoint_descriptor descriptor;
+	struct sigaction action;
+	pthread_t bulk, interrupt;
+	const char *directory;
+	ssize_t ret;
+	int n;
+
+	if ((argc == 3) && (strcmp(argv[1], "-v") == 0))
+		gadget.verbose = 1;
+	else if (argc != 2)
+	{
+		fprintf(stderr, "Usage: %s [-v] <FunctionFS mount point>\n", argv[0]);
+		return 1;
+	}
+	directory = argv[argc - 1];
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	/* Descriptors and strings make the endpoint files appear */
+	gadget.ep0 = open_endpoint(directory, "ep0");
+	if (write(gadget.ep0, &descriptors, sizeof(descriptors)) < 0)
+		fail("usbtmc_gadget: descriptors");
+	if (write(gadget.ep0, &strings, sizeof(strings)) < 0)
+		fail("usbtmc_gadget: strings");
+	gadget.bulk_out = open_endpoint(directory, "ep1");
+	gadget.bulk_in = open_endpoint(directory, "ep2");
+	gadget.interrupt_in = open_endpoint(directory, "ep3");
+	gadget.bulk_in_packet_size = 512;
+
+	if ((pthread_create(&bulk, NULL, bulk_thread, NULL) != 0) ||
+		(pthread_create(&interrupt, NULL, interrupt_thread, NULL) != 0))
+		fail("usbtmc_gadget: pthread_create");
+
+	fprintf(stderr, "usbtmc_gadget: ready\n");
+
+	while (!stopping)
+	{
+
+		ret = read(gadget.ep0, events, sizeof(events));
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			fail("usbtmc_gadget: ep0");
+		}
+
+		for (n = 0; n < ret / (ssize_t) sizeof(struct usb_functionfs_event); n++)
+		{
+			switch (events[n].type)
+			{
+
+			case FUNCTIONFS_ENABLE:
+				pthread_mutex_lock(&gadget.lock);
+				if (ioctl(gadget.bulk_in, FUNCTIONFS_ENDPOINT_DESC, &descriptor) == 0)
+					gadget.bulk_in_packet_size = le16toh(descriptor.wMaxPacketSize);
+				gadget.enabled = 1;
+				pthread_cond_broadcast(&gadget.changed);
+				pthread_mutex_unlock(&gadget.lock);
+				break;
+
+			case FUNCTIONFS_DISABLE:
+			case FUNCTIONFS_UNBIND:
+				pthread_mutex_lock(&gadget.lock);
+				gadget.enabled = 0;
+				gadget.request_pending = 0;
+				gadget.notify_tail = gadget.notify_head;
+				pthread_mutex_unlock(&gadget.lock);
+				break;
+
+			case FUNCTIONFS_SETUP:
+				setup(&events[n].u.setup);
+				break;
+
+			default:
+				break;
+
+			}
+		}
+
+	}
+
+	fprintf(stderr, "usbtmc_gadget: %llu messages, %llu bytes in, %llu bytes out, %llu triggers, %llu SRQs, "
+		"%llu aborts\n", gadget.messages, gadget.bytes_in, gadget.bytes_out, gadget.triggers, gadget.srqs,
+		gadget.aborts);
+
+	return 0;
+
+}
@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# Copyright (C) 2011 Stefan Kopp, Gechingen, Germany
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# The GNU General Public License is available at
+# http://www.gnu.org/copyleft/gpl.html.
+#
+# Tests the USBTMC driver without an instrument: the emulator (usbtmc_gadget) becomes a USB device through
+# FunctionFS, connected to this machine by dummy_hcd, and bench_usbtmc runs against it. Needs root, a
+# kernel with dummy_hcd, libcomposite and usb_f_fs (modules or built in), the driver built in .. and the
+# rig built here (make). Arguments are passed to bench_usbtmc (e.g. -n 10000 -s 4194304).
+
+rig=$(cd "$(dirname "$0")" && pwd)
+gadget=/sys/kernel/config/usb_gadget/usbtmc_rig
+ffs=/dev/usbtmc_rig
+module="usbtmc"
+
+cleanup()
+{
+	[ -n "$gadget_pid" ] && kill "$gadget_pid" 2>/dev/null
+	if [ -d $gadget ]; then
+		echo "" > $gadget/UDC 2>/dev/null
+		rm -f $gadget/configs/c.1/ffs.usbtmc
+		rmdir $gadget/configs/c.1/strings/0x409 $gadget/configs/c.1 $gadget/functions/ffs.usbtmc \
+			$gadget/strings/0x409 $gadget 2>/dev/null
+	fi
+	[ -n "$gadget_pid" ] && wait "$gadget_pid" 2>/dev/null
+	mountpoint -q $ffs && umount $ffs
+	rmdir $ffs 2>/dev/null
+}
+trap cleanup EXIT INT TERM
+
+set -e
+
+# Gadget side: dummy host controller and device controller pair, configfs and FunctionFS
+modprobe dummy_hcd 2>/dev/null || true
+modprobe libcomposite 2>/dev/null || true
+modprobe usb_f_fs 2>/dev/null || true
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+
+mkdir $gadget
+echo 0x1d6b > $gadget/idVendor # Linux Foundation
+echo 0x0104 > $gadget/idProduct # Multifunction Composite Gadget
+mkdir $gadget/strings/0x409
+echo "openTMlib" > $gadget/strings/0x409/manufacturer
+echo "USBTMC emulator" > $gadget/strings/0x409/product
+echo "RIG0001" > $gadget/strings/0x409/serialnumber
+mkdir $gadget/configs/c.1
+mkdir $gadget/configs/c.1/strings/0x409
+echo "USBTMC" > $gadget/configs/c.1/strings/0x409/configuration
+mkdir $gadget/functions/ffs.usbtmc
+ln -s $gadget/functions/ffs.usbtmc $gadget/configs/c.1
+
+# Emulator writes the descriptors, then the gadget can be bound to the dummy device controller
+mkdir -p $ffs
+mount -t functionfs usbtmc $ffs
+"$rig/usbtmc_gadget" $ffs &
+gadget_pid=$!
+for i in $(seq 50); do
+	[ -e $ffs/ep3 ] && break
+	sleep 0.1
+done
+[ -e $ffs/ep3 ] || { echo "usbtmc_gadget did not start"; exit 1; }
+ls /sys/class/udc | grep dummy_udc | head -n 1 > $gadget/UDC
+
+# Host side: driver (re)loaded, instrument found by its serial number
+/sbin/rmmod $module 2>/dev/null || true
+/sbin/insmod "$rig/../$module.ko"
+udevadm settle
+for i in $(seq 50); do
+	grep -qx RIG0001 /sys/class/usbtmc/usbtmc*/serial_number 2>/dev/null && break
+	sleep 0.1
+done
+
+"$rig/bench_usbtmc" "$@"
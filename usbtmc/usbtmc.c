@@ -27,10 +27,30 @@
 #include <linux/completion.h>
 #include <linux/ioctl.h>
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/moduleparam.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/uio.h>
+#include <linux/aio.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/sched/mm.h>
+#include <linux/device.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "usbtmc.h"
 #include "../opentmlib.h"
 
+#define CREATE_TRACE_POINTS
+#include "usbtmc_trace.h"
+
 #define USBTMC_DEBUG
 
 /* Define for debugging messages. If USBTMC_DEBUG is defined, messages are sent to kernel log. */
@@ -40,12 +60,30 @@
 	#define PDEBUG(fmt, args...) /* Do nothing */
 #endif
 
-/* Size of driver internal buffer for regular I/O (bytes). Must be a multiple of 4 and at least as large
- * as USB parameter wMaxPacketSize (which is usually 512 bytes). */
-#define USBTMC_SIZE_IOBUFFER 							4096
+/* Size of each device's buffer for regular I/O (bytes). Transfers larger than this are sent and received
+ * in pieces of this size. Must be a multiple of USB parameter wMaxPacketSize (512 bytes for high speed,
+ * 1024 bytes for super speed). */
+#define USBTMC_SIZE_IOBUFFER 							65536
+
+/* Number of bulk transfers a read or write keeps in flight (each carries up to USBTMC_SIZE_IOBUFFER
+ * bytes). While one completed transfer is copied to/from user space, the others keep the bus busy. */
+#define USBTMC_TRANSFERS_IN_FLIGHT						4
+
+/* Parts of a read or write at least this large go straight to/from user memory (see
+ * usbtmc_direct_transfer) if the host controller allows. Smaller ones aren't worth pinning pages for. */
+#define USBTMC_DIRECT_MIN_SIZE							65536
 
-/* Default timeout (jiffies) */
-#define USBTMC_DEFAULT_TIMEOUT 							5 * HZ
+/* Number of buckets of the bulk transfer latency histogram (debugfs, see usbtmc_stats_show). Bucket 0
+ * counts transfers taking less than 1 us, bucket n those taking 2^(n-1) to 2^n - 1 us, the last one all
+ * longer ones. */
+#define USBTMC_LATENCY_BUCKETS							24
+
+/* Default for the largest transfer requested with a single DEV_DEP_MSG_IN/DEV_DEP_MSG_OUT header
+ * (bytes). See module parameter max_transfer_size. */
+#define USBTMC_DEFAULT_MAX_TRANSFER_SIZE				(1024 * 1024)
+
+/* Default timeout (ms) */
+#define USBTMC_DEFAULT_TIMEOUT 							5000
 
 /* Maximum number of read cycles to empty bulk in endpoint during CLEAR and ABORT_BULK_IN requests.
  * Ends the loop if (for whatever reason) a short packet is not read in time. */
@@ -55,6 +93,10 @@
 #define USBTMC_DRV_STATE_CLOSED							0
 #define USBTMC_DRV_STATE_OPEN							1
 
+/* USB488 interrupt IN notifications (bNotify1) */
+#define USBTMC_NOTIFY_SRQ								0x81 /* Service request, bNotify2 = STB */
+#define USBTMC_NOTIFY_STB								0x80 /* READ_STATUS_BYTE response (bits 0-6 = bTag) */
+
 /* USBTMC base class status values */
 #define USBTMC_STATUS_SUCCESS							0x01
 #define USBTMC_STATUS_PENDING							0x02
@@ -101,19 +143,59 @@ static struct usb_device_id usbtmc_devices[] =
 	{ } /* Empty (terminating) entry */
 };
 
+/* Largest transfer size used by new devices (can be changed per device with attribute
+ * OPENTMLIB_ATTRIBUTE_USBTMC_MAX_TRANSFER_SIZE). Instruments with little memory may need smaller values. */
+static unsigned int max_transfer_size = USBTMC_DEFAULT_MAX_TRANSFER_SIZE;
+module_param(max_transfer_size, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(max_transfer_size, "Largest USBTMC transfer size for new devices (bytes)");
+
 /* Base (first) major/minor number to be used. The major number used is allocated dynamically in
  * usbtmc_init. */
 static dev_t dev;
 
-/* This array will hold the private data pointers of the instruments. It is used by the driver to get
- * access to the various instrument/USB sessions and retrieve instrument information. It is also used
- * to track the status of the minor numbers allocated by the driver (NULL = minor number unused). */
-static struct usbtmc_device_data *usbtmc_devs[USBTMC_MAX_DEVICES];
+/* Device class. Registering each minor number with it publishes the device node (/dev/usbtmc<minor>) and
+ * the instrument's identity in sysfs (/sys/class/usbtmc/usbtmc<minor>), for udev rules and for sessions
+ * looking for an instrument. */
+static struct class *usbtmc_class;
+
+/* debugfs directory of the driver (/sys/kernel/debug/usbtmc), holds a directory for each instrument */
+static struct dentry *usbtmc_debugfs;
+
+/* Maps the minor numbers in use to the private data of their devices. Minor numbers are allocated when an
+ * instrument is connected and released when its private data is freed (after disconnect and the last
+ * close, see usbtmc_delete), so a minor number is never reused while a file still refers to it. */
+static DEFINE_IDR(usbtmc_minors);
+static DEFINE_MUTEX(usbtmc_minors_lock);
+
+/* Private data of minor number 0 (control messages, see usbtmc_write) */
+static struct usbtmc_device_data *usbtmc_control;
+
+/* One bulk transfer of a pipelined read or write */
+struct usbtmc_transfer
+{
+	struct urb *urb;
+	unsigned char *buffer; /* USBTMC_SIZE_IOBUFFER bytes */
+	struct completion done; /* Completed when the URB is given back */
+	ktime_t submitted; /* Time the URB was submitted */
+};
+
+/* Bulk transfer statistics of a device (/sys/kernel/debug/usbtmc/usbtmc<minor>/stats) */
+struct usbtmc_stats
+{
+	atomic64_t transfers;
+	atomic64_t bytes_in;
+	atomic64_t bytes_out;
+	atomic64_t short_packets; /* Bulk in transfers ended by a short packet before their length */
+	atomic64_t timeouts;
+	atomic64_t aborts; /* INITIATE_ABORT_BULK_IN/OUT requests sent */
+	atomic64_t latency[USBTMC_LATENCY_BUCKETS]; /* Transfers by duration (see USBTMC_LATENCY_BUCKETS) */
+};
 
 /* This structure holds private data for each USBTMC device. One copy is allocated for each device. */
 struct usbtmc_device_data
 {
-	struct cdev cdev; /* Character device structure */
+	struct kref kref; /* Held by the minor number's connection and by each open file */
+	struct cdev *cdev; /* Character device structure (freed by the kernel once unused) */
 	int devno; /* Major and minor number used */
 	struct usb_interface *intf; /* USB interface structure */
 	const struct usb_device_id *id;
@@ -125,21 +207,60 @@ struct usbtmc_device_data
 	int driver_state; /* Open, closed... */
 	u8 term_char; /* Termination character */
 	int term_char_enabled; /* Terminate read automatically? */
-	unsigned short int timeout; /* Timeout value (s) */
+	unsigned int timeout; /* Timeout value (ms, 0 = wait forever) */
 	int set_end_indicator; /* Set end indicator with last byte of transfer */
+	unsigned int max_transfer_size; /* Largest transfer size per DEV_DEP_MSG_IN/DEV_DEP_MSG_OUT header */
 	/* Last bTag values (needed for abort) */
 	unsigned char usbtmc_last_write_bTag;
 	unsigned char usbtmc_last_read_bTag;
-	unsigned int number_of_bytes;
+	unsigned int number_of_bytes; /* Bytes of control message response in buffer (minor number zero) */
+	atomic_t abort_requested; /* Generation of the read aborted by OPENTMLIB_OPERATION_ABORT (0 = none) */
+	unsigned int read_generation; /* Generation of the last read started (io_mutex) */
+	unsigned int read_active; /* Generation of the read in progress, 0 = none (abort_mutex) */
+	struct mutex abort_mutex; /* Serializes usbtmc_abort with the start and end of reads */
+	unsigned char *buffer; /* Buffer for I/O data (USBTMC_SIZE_IOBUFFER bytes) */
+	struct mutex io_mutex; /* Serializes use of buffer and bTag (reads, writes and control operations) */
+	struct usbtmc_transfer transfers[USBTMC_TRANSFERS_IN_FLIGHT]; /* Allocated while the device is open */
+	struct usb_anchor anchor; /* Transfers in flight */
+	unsigned int interrupt_in_interval; /* bInterval of interrupt IN endpoint */
+	unsigned int interrupt_in_size; /* wMaxPacketSize of interrupt IN endpoint */
+	struct urb *interrupt_urb; /* Interrupt IN transfer, resubmitted on completion while the device is open */
+	unsigned char *interrupt_buffer; /* Notification received (interrupt_in_size bytes) */
+	spinlock_t notify_lock; /* Protects the notification latches below (set in interrupt context) */
+	int srq_asserted; /* SRQ notification received and not consumed by USBTMC_IOCTL_WAIT_SRQ yet */
+	u8 srq_stb; /* Status byte sent with SRQ notification */
+	int stb_received; /* READ_STATUS_BYTE response received through interrupt IN endpoint */
+	u8 stb_tag; /* bTag of READ_STATUS_BYTE request answered */
+	u8 stb_value; /* Status byte sent with it */
+	wait_queue_head_t notify_wait; /* Woken on each notification */
+	struct fasync_struct *fasync; /* Processes to send SIGIO when a service request arrives */
+	struct workqueue_struct *async_queue; /* Runs asynchronous reads and writes in the order submitted */
+	struct work_struct abort_work; /* Abort on behalf of a cancelled asynchronous read */
+	spinlock_t async_lock; /* Protects the state of asynchronous requests and abort_generation */
+	unsigned int abort_generation; /* Generation of the read abort_work aborts (async_lock) */
+	struct device *device; /* Class device (sysfs attributes) */
+	int disconnected; /* Set by usbtmc_disconnect, operations fail from then on */
+	struct usbtmc_stats stats; /* Bulk transfer statistics */
+	struct dentry *debugfs; /* Directory of the device in debugfs */
+};
+
+/* An asynchronous read or write (see usbtmc_rw_iter) */
+struct usbtmc_async_request
+{
+	struct work_struct work;
+	struct kiocb *iocb;
+	struct mm_struct *mm; /* Address space buf belongs to */
+	char __user *buf;
+	size_t count;
+	int write; /* 1 = write, 0 = read */
+	int cancelled; /* Cancelled before its transfer started (async_lock) */
+	unsigned int generation; /* Generation of the read once its transfer starts, 0 = not yet (async_lock) */
 };
 
 /* This structure holds registration information for the driver. The information is passed to the system
  * through usb_register(), called in the driver's init function. */
 static struct usb_driver usbtmc_driver;
 
-/* Pointer to buffer for I/O data (allocated in usbtmc_init). */
-static unsigned char *usbtmc_buffer;
-
 /* Forward declarations */
 static int usbtmc_probe(struct usb_interface *, const struct usb_device_id *);
 static void usbtmc_disconnect(struct usb_interface *);
@@ -147,7 +268,13 @@ int usbtmc_open(struct inode *, struct file *);
 int usbtmc_release(struct inode *, struct file *);
 ssize_t usbtmc_read(struct file *, char __user *, size_t, loff_t *);
 ssize_t usbtmc_write(struct file *, const char __user *, size_t, loff_t *);
+ssize_t usbtmc_read_iter(struct kiocb *, struct iov_iter *);
+ssize_t usbtmc_write_iter(struct kiocb *, struct iov_iter *);
 loff_t usbtmc_llseek(struct file *, loff_t, int);
+long usbtmc_ioctl(struct file *, unsigned int, unsigned long);
+__poll_t usbtmc_poll(struct file *, poll_table *);
+int usbtmc_fasync(int, struct file *, int);
+int usbtmc_wait_srq(struct usbtmc_device_data *p_device_data, unsigned int *value);
 int usbtmc_dispatch_control_message(struct usbtmc_io_control *control_message);
 int usbtmc_control_report_instrument(struct usbtmc_io_control *control_message);
 int usbtmc_control_io_operation(struct usbtmc_io_control *control_message);
@@ -158,8 +285,13 @@ int usbtmc_clear_in_halt(struct usbtmc_io_control *control_message);
 int usbtmc_clear_out_halt(struct usbtmc_io_control *control_message);
 int usbtmc_control_set_attribute(struct usbtmc_io_control *control_message);
 int usbtmc_control_get_attribute(struct usbtmc_io_control *control_message);
+int usbtmc_get_attribute(struct usbtmc_io_control *control_message, unsigned int *value);
 int usbtmc_indicator_pulse(struct usbtmc_io_control *control_message);
 int usbtmc_abort_bulk_in(struct usbtmc_io_control *control_message);
+int usbtmc_abort_bulk_in_status(struct usbtmc_device_data *p_device_data);
+static int usbtmc_bulk_in_max_packet_size(struct usbtmc_device_data *p_device_data);
+int usbtmc_abort(struct usbtmc_io_control *control_message);
+static int usbtmc_abort_read(struct usbtmc_device_data *p_device_data, unsigned int generation);
 int usbtmc_reset_conf(struct usbtmc_io_control *control_message);
 int usbtmc_clear(struct usbtmc_io_control *control_message);
 int usbtmc_get_capabilities(struct usbtmc_io_control *control_message, struct usbtmc_dev_capabilities *caps);
@@ -182,9 +314,15 @@ static struct file_operations fops =
 	.owner = THIS_MODULE,
 	.read = usbtmc_read,
 	.write = usbtmc_write,
+	.read_iter = usbtmc_read_iter,
+	.write_iter = usbtmc_write_iter,
 	.open = usbtmc_open,
 	.release = usbtmc_release,
 	.llseek = usbtmc_llseek,
+	.unlocked_ioctl = usbtmc_ioctl,
+	.compat_ioctl = usbtmc_ioctl, /* Arguments have the same layout for 32 bit callers */
+	.poll = usbtmc_poll,
+	.fasync = usbtmc_fasync,
 };
 
 int usbtmc_verify_state(struct usbtmc_device_data *p_device_data, int driver_state)
@@ -197,6 +335,13 @@ int usbtmc_verify_state(struct usbtmc_device_data *p_device_data, int driver_sta
 		return -OPENTMLIB_ERROR_USBTMC_MINOR_NUMBER_UNUSED;
 	}
 
+	/* Verify if the device is still connected */
+	if (READ_ONCE(p_device_data->disconnected))
+	{
+		PDEBUG("Device disconnected\n");
+		return -OPENTMLIB_ERROR_USBTMC_MINOR_NUMBER_UNUSED;
+	}
+
 	/* Verify if driver is in correct state */
 	if (p_device_data->driver_state != driver_state)
 	{
@@ -208,6 +353,590 @@ int usbtmc_verify_state(struct usbtmc_device_data *p_device_data, int driver_sta
 
 }
 
+/* Returns the private data of a minor number (NULL = minor number unused) and takes a reference to it,
+ * which the caller drops with usbtmc_put. */
+static struct usbtmc_device_data *usbtmc_get(unsigned int minor)
+{
+
+	struct usbtmc_device_data *p_device_data;
+
+	mutex_lock(&usbtmc_minors_lock);
+	p_device_data = idr_find(&usbtmc_minors, minor);
+	if (p_device_data != NULL)
+		kref_get(&p_device_data->kref);
+	mutex_unlock(&usbtmc_minors_lock);
+
+	return p_device_data;
+
+}
+
+/* Returns the private data of a minor number (NULL = minor number unused) without taking a reference.
+ * Used by the control message functions, usbtmc_write holds a reference while they run. */
+static struct usbtmc_device_data *usbtmc_find(unsigned int minor)
+{
+
+	struct usbtmc_device_data *p_device_data;
+
+	mutex_lock(&usbtmc_minors_lock);
+	p_device_data = idr_find(&usbtmc_minors, minor);
+	mutex_unlock(&usbtmc_minors_lock);
+
+	return p_device_data;
+
+}
+
+/* Frees the private data of a device once it is disconnected and closed (kref release function, called
+ * with usbtmc_minors_lock held). The minor number becomes free again. */
+static void usbtmc_delete(struct kref *kref)
+{
+
+	struct usbtmc_device_data *p_device_data = container_of(kref, struct usbtmc_device_data, kref);
+
+	/* A late abort must not run once the minor number can be reused (it doesn't take usbtmc_minors_lock) */
+	cancel_work_sync(&p_device_data->abort_work);
+	idr_remove(&usbtmc_minors, MINOR(p_device_data->devno));
+	mutex_unlock(&usbtmc_minors_lock);
+
+	destroy_workqueue(p_device_data->async_queue);
+	usb_put_dev(p_device_data->usb_dev);
+	kfree(p_device_data->buffer);
+	kfree(p_device_data);
+
+}
+
+/* Drops a reference taken with usbtmc_get (or the one of the device's connection) */
+static void usbtmc_put(struct usbtmc_device_data *p_device_data)
+{
+
+	kref_put_mutex(&p_device_data->kref, usbtmc_delete, &usbtmc_minors_lock);
+
+}
+
+/* Completion handler of pipelined transfers (interrupt context) */
+static void usbtmc_transfer_complete(struct urb *urb)
+{
+
+	complete(&((struct usbtmc_transfer *) urb->context)->done);
+
+}
+
+/* Frees the transfers of a device (cancelling any still in flight) */
+static void usbtmc_free_transfers(struct usbtmc_device_data *p_device_data)
+{
+
+	int n;
+
+	usb_kill_anchored_urbs(&p_device_data->anchor);
+
+	for (n = 0; n < USBTMC_TRANSFERS_IN_FLIGHT; n++)
+	{
+		usb_free_urb(p_device_data->transfers[n].urb);
+		kfree(p_device_data->transfers[n].buffer);
+		p_device_data->transfers[n].urb = NULL;
+		p_device_data->transfers[n].buffer = NULL;
+	}
+
+}
+
+/* Allocates URBs and buffers for pipelined reads and writes */
+static int usbtmc_alloc_transfers(struct usbtmc_device_data *p_device_data)
+{
+
+	int n;
+
+	for (n = 0; n < USBTMC_TRANSFERS_IN_FLIGHT; n++)
+	{
+		p_device_data->transfers[n].urb = usb_alloc_urb(0, GFP_KERNEL);
+		p_device_data->transfers[n].buffer = kmalloc(USBTMC_SIZE_IOBUFFER, GFP_KERNEL);
+		if ((p_device_data->transfers[n].urb == NULL) || (p_device_data->transfers[n].buffer == NULL))
+		{
+			PDEBUG("Unable to allocate transfers\n");
+			usbtmc_free_transfers(p_device_data);
+			return -ENOMEM;
+		}
+	}
+
+	return USBTMC_NO_ERROR;
+
+}
+
+/* Accounts for a bulk transfer that has ended (see struct usbtmc_stats) and traces it. Tag is the bTag
+ * of the USBTMC message the transfer belongs to, length the size of the transfer and actual the number
+ * of bytes transferred. */
+static void usbtmc_account_transfer(struct usbtmc_device_data *p_device_data, unsigned int pipe, u8 tag,
+	unsigned int length, unsigned int actual, int status, ktime_t submitted)
+{
+
+	struct usbtmc_stats *stats = &p_device_data->stats;
+	s64 duration = ktime_us_delta(ktime_get(), submitted);
+	int in = usb_pipein(pipe);
+
+	trace_usbtmc_bulk_complete(MINOR(p_device_data->devno), in, tag, length, actual, status, duration);
+
+	atomic64_inc(&stats->transfers);
+	atomic64_add(actual, in ? &stats->bytes_in : &stats->bytes_out);
+	if (in && (status == 0) && (actual < length))
+		atomic64_inc(&stats->short_packets);
+	if (status == -ETIMEDOUT)
+		atomic64_inc(&stats->timeouts);
+	atomic64_inc(&stats->latency[min_t(unsigned int, fls64(max_t(s64, duration, 0)),
+		USBTMC_LATENCY_BUCKETS - 1)]);
+
+}
+
+/* usb_bulk_msg for the device's bulk endpoints, traced and accounted (tag = bTag, see
+ * usbtmc_account_transfer) */
+static int usbtmc_bulk_msg(struct usbtmc_device_data *p_device_data, unsigned int pipe, void *data,
+	int length, int *actual, int timeout, u8 tag)
+{
+
+	ktime_t submitted = ktime_get();
+	int ret;
+
+	trace_usbtmc_bulk_submit(MINOR(p_device_data->devno), usb_pipein(pipe), tag, length);
+	*actual = 0;
+	ret = usb_bulk_msg(p_device_data->usb_dev, pipe, data, length, actual, timeout);
+	usbtmc_account_transfer(p_device_data, pipe, tag, length, *actual, ret, submitted);
+
+	return ret;
+
+}
+
+/* Queues a bulk transfer of length bytes (from/to the transfer's buffer) */
+static int usbtmc_submit_transfer(struct usbtmc_device_data *p_device_data, struct usbtmc_transfer *transfer,
+	unsigned int pipe, int length)
+{
+
+	int ret;
+
+	usb_fill_bulk_urb(transfer->urb, p_device_data->usb_dev, pipe, transfer->buffer, length,
+		usbtmc_transfer_complete, transfer);
+	init_completion(&transfer->done);
+	usb_anchor_urb(transfer->urb, &p_device_data->anchor);
+
+	trace_usbtmc_bulk_submit(MINOR(p_device_data->devno), usb_pipein(pipe),
+		p_device_data->usbtmc_last_write_bTag, length);
+	transfer->submitted = ktime_get();
+	if ((ret = usb_submit_urb(transfer->urb, GFP_KERNEL)) < 0)
+	{
+		PDEBUG("usb_submit_urb() returned %d\n", ret);
+		usb_unanchor_urb(transfer->urb);
+		return ret;
+	}
+
+	return USBTMC_NO_ERROR;
+
+}
+
+/* Consumes an abort of the read in progress (see usbtmc_abort). Returns 1 if there was one. */
+static int usbtmc_abort_taken(struct usbtmc_device_data *p_device_data)
+{
+
+	return atomic_cmpxchg(&p_device_data->abort_requested, p_device_data->read_generation, 0) ==
+		p_device_data->read_generation;
+
+}
+
+/* Waits for a transfer submitted by usbtmc_submit_transfer to complete by deadline (jiffies, see
+ * usbtmc_remaining_timeout). Returns the transfer's status. On timeout or signal, all transfers in flight
+ * are cancelled. Transfers of a read or write belong to the last request sent (usbtmc_last_write_bTag). */
+static int usbtmc_wait_transfer(struct usbtmc_device_data *p_device_data, struct usbtmc_transfer *transfer,
+	unsigned long deadline)
+{
+
+	long ret;
+
+	if (try_wait_for_completion(&transfer->done))
+		ret = 0;
+	else if (p_device_data->timeout == 0)
+		ret = wait_for_completion_interruptible(&transfer->done);
+	else if (time_after_eq(jiffies, deadline))
+		ret = -ETIMEDOUT;
+	else if ((ret = wait_for_completion_interruptible_timeout(&transfer->done, deadline - jiffies)) == 0)
+		ret = -ETIMEDOUT;
+	else if (ret > 0)
+		ret = 0;
+
+	if (ret < 0)
+		usb_kill_anchored_urbs(&p_device_data->anchor);
+	else
+		ret = transfer->urb->status;
+
+	usbtmc_account_transfer(p_device_data, transfer->urb->pipe, p_device_data->usbtmc_last_write_bTag,
+		transfer->urb->transfer_buffer_length, transfer->urb->actual_length, ret, transfer->submitted);
+
+	return ret;
+
+}
+
+/* Decides whether a part of a read or write goes straight to/from user memory. The user pages follow the
+ * header, at an offset that is no multiple of wMaxPacketSize, so this needs a host controller taking
+ * scatter-gather lists without length constraints. */
+static int usbtmc_direct_possible(struct usbtmc_device_data *p_device_data, const void __user *buf,
+	unsigned int count)
+{
+
+	struct usb_bus *bus = p_device_data->usb_dev->bus;
+
+	if ((count < USBTMC_DIRECT_MIN_SIZE) || !bus->no_sg_constraint)
+		return 0;
+
+	/* Header, pages, tail */
+	return (DIV_ROUND_UP(offset_in_page(buf) + count, PAGE_SIZE) + 2 <= bus->sg_tablesize);
+
+}
+
+/* Sends (to_device = 1) or receives count bytes of user memory at address in a single bulk transfer,
+ * without copying. The user pages are pinned and handed to the host controller in a scatter-gather list,
+ * between head and tail (kernel buffers, tail_size may be 0). Returns the number of bytes transferred
+ * (including head and tail) or an error. */
+static int usbtmc_direct_transfer(struct usbtmc_device_data *p_device_data, unsigned int pipe,
+	unsigned long address, unsigned int count, unsigned char *head, unsigned int head_size,
+	unsigned char *tail, unsigned int tail_size, int to_device, unsigned long deadline)
+{
+
+	struct usbtmc_transfer *transfer = &p_device_data->transfers[0];
+	struct page **pages;
+	struct scatterlist *sgl;
+	unsigned int offset, length, left, n, num_pages, num_sgs;
+	int pinned = 0, ret;
+
+	offset = offset_in_page(address);
+	num_pages = DIV_ROUND_UP(offset + count, PAGE_SIZE);
+	num_sgs = num_pages + ((tail_size > 0) ? 2 : 1);
+
+	pages = kmalloc_array(num_pages, sizeof(struct page *), GFP_KERNEL);
+	sgl = kmalloc_array(num_sgs, sizeof(struct scatterlist), GFP_KERNEL);
+	if ((pages == NULL) || (sgl == NULL))
+	{
+		ret = -ENOMEM;
+		goto exit_free;
+	}
+
+	/* Receiving data writes to the pages */
+	pinned = pin_user_pages_fast(address & PAGE_MASK, num_pages, to_device ? 0 : FOLL_WRITE, pages);
+	if (pinned != num_pages)
+	{
+		PDEBUG("pin_user_pages_fast() returned %d\n", pinned);
+		ret = (pinned < 0) ? pinned : -OPENTMLIB_ERROR_USBTMC_MEMORY_ACCESS_ERROR;
+		goto exit_unpin;
+	}
+
+	sg_init_table(sgl, num_sgs);
+	sg_set_buf(&sgl[0], head, head_size);
+	left = count;
+	for (n = 0; n < num_pages; n++)
+	{
+		length = min_t(unsigned int, PAGE_SIZE - offset, left);
+		sg_set_page(&sgl[n + 1], pages[n], length, offset);
+		left -= length;
+		offset = 0;
+	}
+	if (tail_size > 0)
+		sg_set_buf(&sgl[num_pages + 1], tail, tail_size);
+
+	usb_fill_bulk_urb(transfer->urb, p_device_data->usb_dev, pipe, NULL, head_size + count + tail_size,
+		usbtmc_transfer_complete, transfer);
+	transfer->urb->sg = sgl;
+	transfer->urb->num_sgs = num_sgs;
+	init_completion(&transfer->done);
+	usb_anchor_urb(transfer->urb, &p_device_data->anchor);
+
+	trace_usbtmc_bulk_submit(MINOR(p_device_data->devno), usb_pipein(pipe),
+		p_device_data->usbtmc_last_write_bTag, head_size + count + tail_size);
+	transfer->submitted = ktime_get();
+	if ((ret = usb_submit_urb(transfer->urb, GFP_KERNEL)) < 0)
+	{
+		PDEBUG("usb_submit_urb() returned %d\n", ret);
+		usb_unanchor_urb(transfer->urb);
+	}
+	else if ((ret = usbtmc_wait_transfer(p_device_data, transfer, deadline)) == 0)
+	{
+		ret = transfer->urb->actual_length;
+	}
+
+	/* The URB goes back to carrying transfer->buffer */
+	transfer->urb->sg = NULL;
+	transfer->urb->num_sgs = 0;
+
+exit_unpin:
+	if (pinned > 0)
+		unpin_user_pages_dirty_lock(pages, pinned, !to_device);
+
+exit_free:
+	kfree(sgl);
+	kfree(pages);
+
+	return ret;
+
+}
+
+/* Receives the response to a REQUEST_DEV_DEP_MSG_IN straight into user memory (see
+ * usbtmc_direct_transfer). Returns the number of message bytes received or an error. */
+static int usbtmc_read_direct(struct usbtmc_device_data *p_device_data, char __user *buf,
+	unsigned int this_part, int max_size, unsigned long deadline)
+{
+
+	unsigned char *header = p_device_data->transfers[0].buffer;
+	unsigned int num_of_characters;
+	int ret;
+
+	/* The transfer length is a multiple of wMaxPacketSize. Bytes beyond the user's (alignment bytes or
+	 * excess sent by the instrument) land in the tail, a buffer of its own because the host controller
+	 * writes to it through a separate mapping. */
+	ret = usbtmc_direct_transfer(p_device_data,
+		usb_rcvbulkpipe(p_device_data->usb_dev, p_device_data->bulk_in_endpoint), (unsigned long) buf,
+		this_part, header, 12, p_device_data->transfers[1].buffer,
+		ALIGN(12 + this_part, max_size) - 12 - this_part, 0, deadline);
+
+	/* How many characters did the instrument send? */
+	num_of_characters = 0;
+	if (ret >= 12)
+	{
+		num_of_characters = header[4] + (header[5] << 8) + (header[6] << 16) + (header[7] << 24);
+		if (num_of_characters > this_part)
+			num_of_characters = this_part;
+	}
+
+	/* Transfer ended by INITIATE_ABORT_BULK_IN (see usbtmc_abort)? Such a transfer falls short of the
+	 * response. One that arrived in full is kept, the abort came too late for it. */
+	if (((ret < 12) || (ret - 12 < num_of_characters)) && usbtmc_abort_taken(p_device_data))
+	{
+		usbtmc_abort_bulk_in_status(p_device_data);
+		return -OPENTMLIB_ERROR_TRANSACTION_ABORTED;
+	}
+
+	if (ret < 0)
+	{
+		PDEBUG("Bulk in transfer returned %d\n", ret);
+		return ret;
+	}
+
+	if (ret < 12)
+	{
+		PDEBUG("Response too short for header (%d bytes)\n", ret);
+		return -EPROTO;
+	}
+
+	if (num_of_characters > ret - 12)
+		num_of_characters = ret - 12;
+
+	return num_of_characters;
+
+}
+
+/* Completion handler of the interrupt IN transfer (interrupt context). Latches USB488 notifications and
+ * resubmits the transfer. */
+static void usbtmc_interrupt_complete(struct urb *urb)
+{
+
+	struct usbtmc_device_data *p_device_data = urb->context;
+	unsigned char *notification = p_device_data->interrupt_buffer;
+	unsigned long flags;
+	int ret, srq = 0;
+
+	switch (urb->status)
+	{
+
+	case 0:
+		break;
+
+	case -ECONNRESET:
+	case -ENOENT:
+	case -ESHUTDOWN:
+	case -EPIPE:
+		/* Killed (device closed or disconnected) or endpoint stalled */
+		PDEBUG("Interrupt in transfer ended with %d\n", urb->status);
+		return;
+
+	default:
+		PDEBUG("Interrupt in transfer returned %d\n", urb->status);
+		goto resubmit;
+
+	}
+
+	if (urb->actual_length >= 2)
+	{
+		spin_lock_irqsave(&p_device_data->notify_lock, flags);
+		if (notification[0] == USBTMC_NOTIFY_SRQ)
+		{
+			p_device_data->srq_asserted = 1;
+			p_device_data->srq_stb = notification[1];
+			srq = 1;
+		}
+		else if (notification[0] & USBTMC_NOTIFY_STB)
+		{
+			p_device_data->stb_received = 1;
+			p_device_data->stb_tag = notification[0] & 0x7f;
+			p_device_data->stb_value = notification[1];
+		}
+		spin_unlock_irqrestore(&p_device_data->notify_lock, flags);
+
+		wake_up_interruptible(&p_device_data->notify_wait);
+		if (srq)
+			kill_fasync(&p_device_data->fasync, SIGIO, POLL_PRI);
+	}
+
+resubmit:
+	if ((ret = usb_submit_urb(urb, GFP_ATOMIC)) < 0)
+		PDEBUG("Resubmitting interrupt in transfer returned %d\n", ret);
+
+}
+
+/* Cancels and frees the interrupt IN transfer of a device */
+static void usbtmc_free_interrupt(struct usbtmc_device_data *p_device_data)
+{
+
+	if (p_device_data->interrupt_urb != NULL)
+		usb_kill_urb(p_device_data->interrupt_urb);
+	usb_free_urb(p_device_data->interrupt_urb);
+	kfree(p_device_data->interrupt_buffer);
+	p_device_data->interrupt_urb = NULL;
+	p_device_data->interrupt_buffer = NULL;
+
+}
+
+/* Starts receiving notifications through the interrupt IN endpoint (if the device has one) */
+static int usbtmc_start_interrupt(struct usbtmc_device_data *p_device_data)
+{
+
+	int ret;
+
+	p_device_data->srq_asserted = 0;
+	p_device_data->stb_received = 0;
+
+	if (p_device_data->interrupt_in_endpoint == 0)
+		return USBTMC_NO_ERROR;
+
+	p_device_data->interrupt_urb = usb_alloc_urb(0, GFP_KERNEL);
+	p_device_data->interrupt_buffer = kmalloc(p_device_data->interrupt_in_size, GFP_KERNEL);
+	if ((p_device_data->interrupt_urb == NULL) || (p_device_data->interrupt_buffer == NULL))
+	{
+		PDEBUG("Unable to allocate interrupt in transfer\n");
+		usbtmc_free_interrupt(p_device_data);
+		return -ENOMEM;
+	}
+
+	usb_fill_int_urb(p_device_data->interrupt_urb, p_device_data->usb_dev,
+		usb_rcvintpipe(p_device_data->usb_dev, p_device_data->interrupt_in_endpoint),
+		p_device_data->interrupt_buffer, p_device_data->interrupt_in_size, usbtmc_interrupt_complete,
+		p_device_data, p_device_data->interrupt_in_interval);
+
+	if ((ret = usb_submit_urb(p_device_data->interrupt_urb, GFP_KERNEL)) < 0)
+	{
+		PDEBUG("usb_submit_urb() returned %d\n", ret);
+		usbtmc_free_interrupt(p_device_data);
+		return ret;
+	}
+
+	return USBTMC_NO_ERROR;
+
+}
+
+/* Consumes a latched SRQ notification (wait_event condition, also true once the device is disconnected) */
+static int usbtmc_take_srq(struct usbtmc_device_data *p_device_data, unsigned int *value)
+{
+
+	int ret = 0;
+
+	if (READ_ONCE(p_device_data->disconnected))
+		return 1; /* Wait ends, caller fails */
+
+	spin_lock_irq(&p_device_data->notify_lock);
+	if (p_device_data->srq_asserted)
+	{
+		*value = p_device_data->srq_stb;
+		p_device_data->srq_asserted = 0;
+		ret = 1;
+	}
+	spin_unlock_irq(&p_device_data->notify_lock);
+
+	return ret;
+
+}
+
+/* Checks for the interrupt IN response to READ_STATUS_BYTE request tag (wait_event condition, also true
+ * once the device is disconnected) */
+static int usbtmc_stb_received(struct usbtmc_device_data *p_device_data, u8 tag)
+{
+
+	int ret;
+
+	if (READ_ONCE(p_device_data->disconnected))
+		return 1; /* Wait ends, caller fails */
+
+	spin_lock_irq(&p_device_data->notify_lock);
+	ret = p_device_data->stb_received && (p_device_data->stb_tag == tag);
+	spin_unlock_irq(&p_device_data->notify_lock);
+
+	return ret;
+
+}
+
+/* Waits (until the device's timeout) for a service request and returns the status byte sent with it. A
+ * service request arriving before the call is returned right away. Does not hold the device's mutex, so
+ * reads and writes can go on meanwhile. */
+int usbtmc_wait_srq(struct usbtmc_device_data *p_device_data, unsigned int *value)
+{
+
+	long ret;
+
+	if (p_device_data->interrupt_urb == NULL)
+		return -OPENTMLIB_ERROR_USBTMC_FEATURE_NOT_SUPPORTED;
+
+	if (p_device_data->timeout == 0)
+		ret = wait_event_interruptible(p_device_data->notify_wait, usbtmc_take_srq(p_device_data, value));
+	else if ((ret = wait_event_interruptible_timeout(p_device_data->notify_wait,
+		usbtmc_take_srq(p_device_data, value), msecs_to_jiffies(p_device_data->timeout))) == 0)
+		ret = -OPENTMLIB_ERROR_TIMEOUT;
+	else if (ret > 0)
+		ret = USBTMC_NO_ERROR;
+	if ((ret == USBTMC_NO_ERROR) && READ_ONCE(p_device_data->disconnected))
+		ret = -OPENTMLIB_ERROR_USBTMC_MINOR_NUMBER_UNUSED;
+
+	return ret;
+
+}
+
+/* Reports POLLPRI while a service request is latched (see usbtmc_wait_srq). Writes are always possible. */
+__poll_t usbtmc_poll(struct file *filp, poll_table *wait)
+{
+
+	struct usbtmc_device_data *p_device_data;
+	__poll_t mask;
+
+	/* Get pointer to private data structure */
+	p_device_data = filp->private_data;
+
+	if ((usbtmc_verify_state(p_device_data, USBTMC_DRV_STATE_OPEN) != USBTMC_NO_ERROR) ||
+		(MINOR(p_device_data->devno) == 0))
+		return EPOLLERR;
+
+	poll_wait(filp, &p_device_data->notify_wait, wait);
+
+	mask = EPOLLOUT | EPOLLWRNORM;
+	spin_lock_irq(&p_device_data->notify_lock);
+	if (p_device_data->srq_asserted)
+		mask |= EPOLLPRI;
+	spin_unlock_irq(&p_device_data->notify_lock);
+
+	return mask;
+
+}
+
+/* Registers (or unregisters) a process for SIGIO on service requests */
+int usbtmc_fasync(int fd, struct file *filp, int on)
+{
+
+	struct usbtmc_device_data *p_device_data;
+
+	/* Get pointer to private data structure */
+	p_device_data = filp->private_data;
+
+	return fasync_helper(fd, filp, on, &p_device_data->fasync);
+
+}
+
 /* This method is called when opening an instrument device file. It looks for the device's USB endpoints
  * for later access. */
 int usbtmc_open(struct inode *inode, struct file *filp)
@@ -221,12 +950,16 @@ int usbtmc_open(struct inode *inode, struct file *filp)
 		
 	PDEBUG("usbtmc_open() called\n");
 	
-	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[iminor(inode)];
-	
-	/* Verify pointer and driver state */
+	/* Get pointer to private data structure (the file holds a reference until usbtmc_release) */
+	if ((p_device_data = usbtmc_get(iminor(inode))) == NULL)
+		return -OPENTMLIB_ERROR_USBTMC_MINOR_NUMBER_UNUSED;
+
+	/* Serialize with other opens and with usbtmc_disconnect */
+	mutex_lock(&p_device_data->io_mutex);
+
+	/* Verify driver state */
 	if ((ret = usbtmc_verify_state(p_device_data, USBTMC_DRV_STATE_CLOSED)) != USBTMC_NO_ERROR)
-		return ret;
+		goto exit;
 	
 	/* Store pointer in file structure's private data field for access by other entry points */
 	filp->private_data = p_device_data;
@@ -272,23 +1005,43 @@ int usbtmc_open(struct inode *inode, struct file *filp)
 	for (n = 0; n < current_setting->desc.bNumEndpoints; n++)
 	{
 		endpoint = &(current_setting->endpoint[n].desc);
-		if (!(endpoint->bEndpointAddress & USB_DIR_IN) &&
+		if ((endpoint->bEndpointAddress & USB_DIR_IN) &&
 			((endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK)== USB_ENDPOINT_XFER_INT))
 		{
 			interrupt_in_endpoint = endpoint->bEndpointAddress;
+			p_device_data->interrupt_in_interval = endpoint->bInterval;
+			p_device_data->interrupt_in_size = le16_to_cpu(endpoint->wMaxPacketSize);
 			PDEBUG("Found interrupt in endpoint at %u\n", interrupt_in_endpoint);
 			n = current_setting->desc.bNumEndpoints; /* Exit loop */
 		}
 	}
 	p_device_data->interrupt_in_endpoint = interrupt_in_endpoint;
 
+	/* Allocate transfers for reads and writes */
+	if ((ret = usbtmc_alloc_transfers(p_device_data)) != USBTMC_NO_ERROR)
+		goto exit;
+
+	/* Listen for service requests */
+	if ((ret = usbtmc_start_interrupt(p_device_data)) != USBTMC_NO_ERROR)
+	{
+		usbtmc_free_transfers(p_device_data);
+		goto exit;
+	}
+
 minor_null:
-	
+
 	/* Update driver state */
 	p_device_data->driver_state = USBTMC_DRV_STATE_OPEN;
-	
+	mutex_unlock(&p_device_data->io_mutex);
+
 	return USBTMC_NO_ERROR;
-	
+
+exit:
+
+	mutex_unlock(&p_device_data->io_mutex);
+	usbtmc_put(p_device_data);
+	return ret;
+
 }
 
 /* This method is called when closing the instrument device file. */
@@ -296,32 +1049,71 @@ int usbtmc_release(struct inode *inode, struct file *filp)
 {
 
 	struct usbtmc_device_data *p_device_data;
-	int ret;
-			
+
 	PDEBUG("usbtmc_release() called\n");
-	
-	/* Get pointer to private data structure */
+
+	/* Get pointer to private data structure (valid until the reference taken by usbtmc_open is dropped,
+	 * even if the device has been disconnected meanwhile) */
 	p_device_data = filp->private_data;
-	
-	/* Verify pointer and driver state */
-	if ((ret = usbtmc_verify_state(p_device_data, USBTMC_DRV_STATE_OPEN)) != USBTMC_NO_ERROR)
-		return ret;
-	
+
+	mutex_lock(&p_device_data->io_mutex);
+	if (MINOR(p_device_data->devno) != 0)
+	{
+		usbtmc_fasync(-1, filp, 0);
+		usbtmc_free_interrupt(p_device_data);
+		usbtmc_free_transfers(p_device_data);
+	}
+
 	/* Update driver state */
 	p_device_data->driver_state = USBTMC_DRV_STATE_CLOSED;
-	
+	mutex_unlock(&p_device_data->io_mutex);
+
+	usbtmc_put(p_device_data);
+
 	return USBTMC_NO_ERROR;
 
 }
 
-/* This function reads the instrument's output buffer through a USMTMC DEV_DEP_MSG_IN message. */
-ssize_t usbtmc_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/* Returns the timeout (ms) for the next USB transfer of a read or write that has to complete by deadline
+ * (jiffies). All transfers of one read() or write() call share the deadline. Returns 0 (no timeout) if
+ * the timeout is disabled and -ETIMEDOUT if the deadline has passed. */
+static int usbtmc_remaining_timeout(struct usbtmc_device_data *p_device_data, unsigned long deadline)
+{
+
+	if (p_device_data->timeout == 0)
+		return 0;
+
+	if (time_after_eq(jiffies, deadline))
+		return -ETIMEDOUT;
+
+	return jiffies_to_msecs(deadline - jiffies);
+
+}
+
+/* Takes the mutex of an instrument (or minor number zero) before using its I/O buffer or bTag. Each
+ * instrument has its own, so instruments don't wait for each other. */
+static int usbtmc_lock(struct usbtmc_device_data *p_device_data)
+{
+
+	if (mutex_lock_interruptible(&p_device_data->io_mutex))
+		return -ERESTARTSYS;
+
+	return USBTMC_NO_ERROR;
+
+}
+
+/* This function reads the instrument's output buffer through a USMTMC DEV_DEP_MSG_IN message (called
+ * with the instrument's mutex held, see usbtmc_read). */
+static ssize_t usbtmc_read_locked(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
 {
 
 	struct usbtmc_device_data *p_device_data;
 	unsigned int pipe;
-	int ret, actual, remaining, done, this_part;
-	unsigned long int num_of_characters; // TODO: Shouldn't a normal unsigned int be enough?
+	int ret, actual, remaining, done, this_part, max_size, oldest, in_flight;
+	unsigned int num_of_characters, expected, submitted, received, copied, length, offset, this_copy;
+	struct usbtmc_transfer *transfer;
+	unsigned long deadline;
+	int transfer_timeout;
 	
 	PDEBUG("usbtmc_read() called\n");
 
@@ -335,43 +1127,51 @@ ssize_t usbtmc_read(struct file *filp, char __user *buf, size_t count, loff_t *f
 	if (MINOR(p_device_data->devno) == 0)
 		goto minor_null;
 
-	usbtmc_devs[0]->number_of_bytes = 0; /* In case of data left over in buffer for minor number zero */
-		
+	/* Get wMaxPacketSize (bulk in reads are multiples of it) */
+	if ((max_size = usbtmc_bulk_in_max_packet_size(p_device_data)) == 0)
+		return -OPENTMLIB_ERROR_USBTMC_UNABLE_TO_GET_WMAXPACKETSIZE;
+
 	remaining = count;
 	done = 0;
+	deadline = jiffies + msecs_to_jiffies(p_device_data->timeout); /* For the entire call */
 	
 	while (remaining > 0)
 	{
 
-		/* Check if remaining data bytes to be read fit in the driver's buffer. Make sure there is enough
-		 * space for the header (12 bytes) and alignment bytes (up to 3 bytes). */
-		if (remaining > USBTMC_SIZE_IOBUFFER - 12 - 3)
+		/* Ask for as much as the transfer size limit allows with a single request */
+		if (remaining > p_device_data->max_transfer_size)
 		{
-			this_part = USBTMC_SIZE_IOBUFFER - 12 - 3;
+			this_part = p_device_data->max_transfer_size;
 		}
 		else
 		{
 			this_part = remaining;
 		}
+
+		/* Aborted between two parts of the read? */
+		if (usbtmc_abort_taken(p_device_data))
+			return -OPENTMLIB_ERROR_TRANSACTION_ABORTED;
 		
 		/* Setup IO buffer for DEV_DEP_MSG_IN message */
-		usbtmc_buffer[0x00] = USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN;
-		usbtmc_buffer[0x01] = p_device_data->bTag; /* Transfer ID (bTag) */
-		usbtmc_buffer[0x02] = ~(p_device_data->bTag); /* Inverse of bTag */
-		usbtmc_buffer[0x03] = 0; /* Reserved */
-		usbtmc_buffer[0x04] = this_part & 255; /* Max transfer (first byte) */
-		usbtmc_buffer[0x05] = (this_part >> 8) & 255; /* Second byte */
-		usbtmc_buffer[0x06] = (this_part >> 16) & 255; /* Third byte */
-		usbtmc_buffer[0x07] = (this_part >> 24) & 255; /* Fourth byte */
-		usbtmc_buffer[0x08] = p_device_data->term_char_enabled * 2;
-		usbtmc_buffer[0x09] = p_device_data->term_char; /* Term character */
-		usbtmc_buffer[0x0a] = 0; /* Reserved */
-		usbtmc_buffer[0x0b] = 0; /* Reserved */
+		p_device_data->buffer[0x00] = USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN;
+		p_device_data->buffer[0x01] = p_device_data->bTag; /* Transfer ID (bTag) */
+		p_device_data->buffer[0x02] = ~(p_device_data->bTag); /* Inverse of bTag */
+		p_device_data->buffer[0x03] = 0; /* Reserved */
+		p_device_data->buffer[0x04] = this_part & 255; /* Max transfer (first byte) */
+		p_device_data->buffer[0x05] = (this_part >> 8) & 255; /* Second byte */
+		p_device_data->buffer[0x06] = (this_part >> 16) & 255; /* Third byte */
+		p_device_data->buffer[0x07] = (this_part >> 24) & 255; /* Fourth byte */
+		p_device_data->buffer[0x08] = p_device_data->term_char_enabled * 2;
+		p_device_data->buffer[0x09] = p_device_data->term_char; /* Term character */
+		p_device_data->buffer[0x0a] = 0; /* Reserved */
+		p_device_data->buffer[0x0b] = 0; /* Reserved */
 	
 		/* Create pipe and send USB request */
+		if ((transfer_timeout = usbtmc_remaining_timeout(p_device_data, deadline)) < 0)
+			return transfer_timeout;
 		pipe = usb_sndbulkpipe(p_device_data->usb_dev, p_device_data->bulk_out_endpoint);
-		ret = usb_bulk_msg(p_device_data->usb_dev, pipe, usbtmc_buffer, 12, &actual,
-			p_device_data->timeout);
+		ret = usbtmc_bulk_msg(p_device_data, pipe, p_device_data->buffer, 12, &actual, transfer_timeout,
+			p_device_data->bTag);
 			
 		/* Store bTag (in case we need to abort) */
 		p_device_data->usbtmc_last_write_bTag = p_device_data->bTag;
@@ -386,35 +1186,131 @@ ssize_t usbtmc_read(struct file *filp, char __user *buf, size_t count, loff_t *f
 			PDEBUG("usb_bulk_msg() returned %d\n", ret);
 			return ret;
 		}
-	
-		/* Create pipe and send USB request */
-		pipe = usb_rcvbulkpipe(p_device_data->usb_dev, p_device_data->bulk_in_endpoint);
-		ret = usb_bulk_msg(p_device_data->usb_dev, pipe, usbtmc_buffer, USBTMC_SIZE_IOBUFFER, &actual,
-			p_device_data->timeout);
-		
+
 		/* Store bTag (in case we need to abort) */
 		p_device_data->usbtmc_last_read_bTag = p_device_data->bTag;
-	
-		if (ret < 0)
+
+		/* Large parts go straight to user memory if the host controller allows */
+		if (usbtmc_direct_possible(p_device_data, buf + done, this_part))
 		{
-			PDEBUG("usb_bulk_msg() returned %d\n", ret);
-			return ret;
+			if ((ret = usbtmc_read_direct(p_device_data, buf + done, this_part, max_size, deadline)) < 0)
+				return ret;
+			copied = ret;
 		}
-	
-		/* How many characters did the instrument send? */
-		num_of_characters = usbtmc_buffer[4] + (usbtmc_buffer[5] << 8) + (usbtmc_buffer[6] << 16) +
-			(usbtmc_buffer[7] << 24);
-	
-		/* Copy buffer to user space */
-		if (copy_to_user(buf + done, &usbtmc_buffer[12], num_of_characters))
+		else
 		{
-			/* There must have been an addressing problem */
-			return -OPENTMLIB_ERROR_USBTMC_MEMORY_ACCESS_ERROR;
+
+			/* Receive the response. Several bulk in reads are queued, so the bus keeps moving while completed
+			 * ones are copied to user space. The first one starts with the header, which tells how many bytes
+			 * follow. Until then, expect as many as requested. */
+			expected = 12 + ALIGN(this_part, 4);
+			submitted = 0;
+			received = 0;
+			copied = 0;
+			num_of_characters = this_part;
+			oldest = 0;
+			in_flight = 0;
+			pipe = usb_rcvbulkpipe(p_device_data->usb_dev, p_device_data->bulk_in_endpoint);
+
+			while (1)
+			{
+
+				/* Keep the queue full */
+				while ((in_flight < USBTMC_TRANSFERS_IN_FLIGHT) && (submitted < expected))
+				{
+					transfer = &p_device_data->transfers[(oldest + in_flight) % USBTMC_TRANSFERS_IN_FLIGHT];
+					length = ALIGN(expected - submitted, max_size);
+					if (length > USBTMC_SIZE_IOBUFFER)
+						length = USBTMC_SIZE_IOBUFFER;
+					if ((ret = usbtmc_submit_transfer(p_device_data, transfer, pipe, length)) < 0)
+					{
+						usb_kill_anchored_urbs(&p_device_data->anchor);
+						return ret;
+					}
+					submitted += length;
+					in_flight++;
+				}
+
+				if (in_flight == 0)
+					break;
+
+				/* Wait for the oldest read */
+				transfer = &p_device_data->transfers[oldest];
+				ret = usbtmc_wait_transfer(p_device_data, transfer, deadline);
+				oldest = (oldest + 1) % USBTMC_TRANSFERS_IN_FLIGHT;
+				in_flight--;
+
+				actual = transfer->urb->actual_length;
+				length = transfer->urb->transfer_buffer_length;
+
+				if ((ret == 0) && (received == 0) && (actual >= 12))
+				{
+					/* How many characters did the instrument send? */
+					num_of_characters = transfer->buffer[4] + (transfer->buffer[5] << 8) +
+						(transfer->buffer[6] << 16) + (transfer->buffer[7] << 24);
+					if (num_of_characters > this_part)
+						num_of_characters = this_part; /* More than asked for, don't overrun user buffer */
+					expected = 12 + ALIGN(num_of_characters, 4);
+				}
+
+				/* Transfer ended by INITIATE_ABORT_BULK_IN (see usbtmc_abort)? The device has sent the short
+				 * packet completing the transfer, so only the status check is left to do. A response that
+				 * arrived in full is kept, the abort came too late for it. */
+				if (((ret < 0) || ((actual < length) && (received + actual < expected))) &&
+					usbtmc_abort_taken(p_device_data))
+				{
+					usb_kill_anchored_urbs(&p_device_data->anchor);
+					usbtmc_abort_bulk_in_status(p_device_data);
+					return -OPENTMLIB_ERROR_TRANSACTION_ABORTED;
+				}
+
+				if (ret < 0)
+				{
+					PDEBUG("Bulk in transfer returned %d\n", ret);
+					usb_kill_anchored_urbs(&p_device_data->anchor);
+					return ret;
+				}
+
+				offset = 0;
+				if (received == 0)
+				{
+					if (actual < 12)
+					{
+						PDEBUG("Response too short for header (%d bytes)\n", actual);
+						usb_kill_anchored_urbs(&p_device_data->anchor);
+						return -EPROTO;
+					}
+					offset = 12;
+				}
+
+				/* Copy message bytes (not the alignment bytes) to user space */
+				this_copy = actual - offset;
+				if (this_copy > num_of_characters - copied)
+					this_copy = num_of_characters - copied;
+				if (copy_to_user(buf + done + copied, &transfer->buffer[offset], this_copy))
+				{
+					/* There must have been an addressing problem */
+					usb_kill_anchored_urbs(&p_device_data->anchor);
+					return -OPENTMLIB_ERROR_USBTMC_MEMORY_ACCESS_ERROR;
+				}
+				copied += this_copy;
+				received += actual;
+
+				/* Short packet ends transfer early */
+				if ((received >= expected) || (actual < length))
+					break;
+
+			}
+
+			/* Reads queued beyond the end of the response get no data */
+			usb_kill_anchored_urbs(&p_device_data->anchor);
+
 		}
 		
-		done += num_of_characters;
+		done += copied;
+		remaining -= copied;
 
-		if (num_of_characters < this_part)
+		if (copied < this_part)
 		{
 			/* Short package received (less than requested amount of bytes), exit loop */
 			remaining = 0;
@@ -429,30 +1325,93 @@ ssize_t usbtmc_read(struct file *filp, char __user *buf, size_t count, loff_t *f
 	
 minor_null:
 
-	if (p_device_data->number_of_bytes == 0)
-		return USBTMC_NO_ERROR;
-	
-	/* Copy buffer to user space */
-	if (copy_to_user(buf, &usbtmc_buffer[0], p_device_data->number_of_bytes))
+	if (p_device_data->number_of_bytes == 0)
+		return USBTMC_NO_ERROR;
+	
+	/* Copy buffer to user space */
+	if (copy_to_user(buf, &p_device_data->buffer[0], p_device_data->number_of_bytes))
+	{
+		/* There must have been an addressing problem */
+		return -OPENTMLIB_ERROR_USBTMC_MEMORY_ACCESS_ERROR;
+	}
+
+	ret = p_device_data->number_of_bytes;
+	p_device_data->number_of_bytes = 0;
+	return ret;
+
+}
+
+/* Common part of usbtmc_read and asynchronous reads (request != NULL, see usbtmc_async_work) */
+static ssize_t usbtmc_read_request(struct file *filp, char __user *buf, size_t count, loff_t *f_pos,
+	struct usbtmc_async_request *request)
+{
+
+	struct usbtmc_device_data *p_device_data;
+	int cancelled = 0;
+	ssize_t ret;
+
+	/* Get pointer to private data structure */
+	p_device_data = filp->private_data;
+
+	if ((ret = usbtmc_lock(p_device_data)) != USBTMC_NO_ERROR)
+		return ret;
+
+	/* Aborts issued from now on apply to this read (see usbtmc_abort) */
+	mutex_lock(&p_device_data->abort_mutex);
+	if (++p_device_data->read_generation == 0)
+		p_device_data->read_generation++;
+	atomic_set(&p_device_data->abort_requested, 0);
+	p_device_data->read_active = p_device_data->read_generation;
+	mutex_unlock(&p_device_data->abort_mutex);
+
+	/* An asynchronous read cancelled while it waited for the mutex ends here. Cancelling it from now on
+	 * aborts its transfer (see usbtmc_cancel_iocb). */
+	if (request != NULL)
 	{
-		/* There must have been an addressing problem */
-		return -OPENTMLIB_ERROR_USBTMC_MEMORY_ACCESS_ERROR;
+		spin_lock_irq(&p_device_data->async_lock);
+		cancelled = request->cancelled;
+		if (!cancelled)
+			request->generation = p_device_data->read_generation;
+		spin_unlock_irq(&p_device_data->async_lock);
 	}
 
-	ret = p_device_data->number_of_bytes;
-	p_device_data->number_of_bytes = 0;
+	if (cancelled)
+		ret = -OPENTMLIB_ERROR_TRANSACTION_ABORTED;
+	else
+		ret = usbtmc_read_locked(filp, buf, count, f_pos);
+
+	/* Later aborts don't concern this read */
+	mutex_lock(&p_device_data->abort_mutex);
+	p_device_data->read_active = 0;
+	atomic_set(&p_device_data->abort_requested, 0);
+	mutex_unlock(&p_device_data->abort_mutex);
+
+	mutex_unlock(&p_device_data->io_mutex);
+
 	return ret;
 
 }
 
-/* This function sends a string to an instrument by wrapping it in a USMTMC DEV_DEP_MSG_OUT message. */
-ssize_t usbtmc_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+/* Read entry point */
+ssize_t usbtmc_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+
+	return usbtmc_read_request(filp, buf, count, f_pos, NULL);
+
+}
+
+/* This function sends a string to an instrument by wrapping it in a USMTMC DEV_DEP_MSG_OUT message
+ * (called with the mutex held, see usbtmc_write). */
+static ssize_t usbtmc_write_locked(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
 {
 
 	struct usbtmc_device_data *p_device_data;
 	unsigned int pipe;
-	int ret, n, actual, remaining, done, this_part;
-	unsigned long int num_of_bytes;
+	int ret, remaining, done, this_part, oldest, in_flight;
+	unsigned long deadline;
+	unsigned int num_of_bytes, offset, sent, this_piece;
+	unsigned char *header;
+	struct usbtmc_transfer *transfer;
 	unsigned char last_transaction;
 	struct usbtmc_io_control control_message;
 	
@@ -468,18 +1427,17 @@ ssize_t usbtmc_write(struct file *filp, const char __user *buf, size_t count, lo
 	if (MINOR(p_device_data->devno) == 0)
 		goto minor_null;
 	
-	usbtmc_devs[0]->number_of_bytes = 0; /* In case of data left over in buffer for minor number zero */
-
 	remaining = count;
 	done = 0;
+	deadline = jiffies + msecs_to_jiffies(p_device_data->timeout); /* For the entire call */
 	
 	while (remaining > 0) /* Still bytes to send */
 	{
 
-		if (remaining > USBTMC_SIZE_IOBUFFER - 12)
+		if (remaining > p_device_data->max_transfer_size)
 		{
-			/* Use maximum size (limited by driver internal buffer size) */
-			this_part = USBTMC_SIZE_IOBUFFER - 12; /* Use maximum size */
+			/* Use maximum size (limited by transfer size limit) */
+			this_part = p_device_data->max_transfer_size;
 			last_transaction = 0; /* This is not the last transfer */
 		}
 		else
@@ -489,41 +1447,24 @@ ssize_t usbtmc_write(struct file *filp, const char __user *buf, size_t count, lo
 			last_transaction = 1; /* Message ends w/ this transfer */
 		}
 		
-		/* Setup IO buffer for DEV_DEP_MSG_OUT message */
-		usbtmc_buffer[0x00] = USBTMC_MSGID_DEV_DEP_MSG_OUT;
-		usbtmc_buffer[0x01] = p_device_data->bTag; /* Transfer ID (bTag) */
-		usbtmc_buffer[0x02] = ~p_device_data->bTag; /* Inverse of bTag */
-		usbtmc_buffer[0x03] = 0; /* Reserved */
-		usbtmc_buffer[0x04] = this_part & 255; /* Transfer size (first byte) */
-		usbtmc_buffer[0x05] = (this_part >> 8) & 255; /* Transfer size (second byte) */
-		usbtmc_buffer[0x06] = (this_part >> 16) & 255; /* Transfer size (third byte) */
-		usbtmc_buffer[0x07] = (this_part >> 24) & 255; /* Transfer size (fourth byte) */
-		usbtmc_buffer[0x08] = last_transaction; /* 1 = yes, 0 = no */
-		usbtmc_buffer[0x09] = 0; /* Reserved */
-		usbtmc_buffer[0x0a] = 0; /* Reserved */
-		usbtmc_buffer[0x0b] = 0; /* Reserved */
-		
-		/* Append write buffer (instrument command) to USBTMC message */
-		if (copy_from_user(&usbtmc_buffer[12], buf + done, this_part))
-		{
-			/* There must have been an addressing problem */
-			return -OPENTMLIB_ERROR_USBTMC_MEMORY_ACCESS_ERROR;
-		}	
-		
-		/* Add zero bytes to achieve 4-byte alignment */
-		num_of_bytes = 12 + this_part;
-		if (this_part % 4)
-		{
-			num_of_bytes += 4 - this_part % 4;
-			for (n = 12 + this_part; n < num_of_bytes; n++)
-				usbtmc_buffer[n] = 0;
-		}
-	
-		/* Create pipe and send USB request */
-		pipe = usb_sndbulkpipe(p_device_data->usb_dev, p_device_data->bulk_out_endpoint);
-		ret = usb_bulk_msg(p_device_data->usb_dev, pipe, usbtmc_buffer, num_of_bytes, &actual,
-			p_device_data->timeout);
-	
+		/* Setup IO buffer for DEV_DEP_MSG_OUT message (the first transfer carries the header). No transfer
+		 * is in flight between messages. */
+		oldest = 0;
+		in_flight = 0;
+		header = p_device_data->transfers[oldest].buffer;
+		header[0x00] = USBTMC_MSGID_DEV_DEP_MSG_OUT;
+		header[0x01] = p_device_data->bTag; /* Transfer ID (bTag) */
+		header[0x02] = ~p_device_data->bTag; /* Inverse of bTag */
+		header[0x03] = 0; /* Reserved */
+		header[0x04] = this_part & 255; /* Transfer size (first byte) */
+		header[0x05] = (this_part >> 8) & 255; /* Transfer size (second byte) */
+		header[0x06] = (this_part >> 16) & 255; /* Transfer size (third byte) */
+		header[0x07] = (this_part >> 24) & 255; /* Transfer size (fourth byte) */
+		header[0x08] = last_transaction; /* 1 = yes, 0 = no */
+		header[0x09] = 0; /* Reserved */
+		header[0x0a] = 0; /* Reserved */
+		header[0x0b] = 0; /* Reserved */
+
 		/* Store bTag (in case we need to abort) */
 		p_device_data->usbtmc_last_write_bTag = p_device_data->bTag;
 		
@@ -531,13 +1472,98 @@ ssize_t usbtmc_write(struct file *filp, const char __user *buf, size_t count, lo
 		p_device_data->bTag++;
 		if (p_device_data->bTag == 0)
 			p_device_data->bTag++;
-		
-		if (ret < 0)
+
+		/* Large parts go straight from user memory if the host controller allows. The alignment bytes
+		 * follow the header in the same buffer. */
+		if (usbtmc_direct_possible(p_device_data, buf + done, this_part))
 		{
-			PDEBUG("usb_bulk_msg() returned %d\n", ret);
-			return ret;
+			memset(&header[12], 0, 3);
+			ret = usbtmc_direct_transfer(p_device_data,
+				usb_sndbulkpipe(p_device_data->usb_dev, p_device_data->bulk_out_endpoint),
+				(unsigned long) (buf + done), this_part, header, 12, &header[12],
+				ALIGN(this_part, 4) - this_part, 1, deadline);
+			if (ret < 0)
+			{
+				PDEBUG("Bulk out transfer returned %d\n", ret);
+				return ret;
+			}
 		}
+		else
+		{
+
+			/* Message bytes follow the header back to back, in pieces as large as a transfer buffer. All pieces
+			 * but the last fill the buffer (a multiple of wMaxPacketSize), so the device sees a single
+			 * transfer. The next piece is copied from user space while the previous ones are on the bus. */
+			offset = 12;
+			sent = 0;
+			pipe = usb_sndbulkpipe(p_device_data->usb_dev, p_device_data->bulk_out_endpoint);
+
+			do
+			{
+
+				/* Wait for a free transfer */
+				if (in_flight == USBTMC_TRANSFERS_IN_FLIGHT)
+				{
+					ret = usbtmc_wait_transfer(p_device_data, &p_device_data->transfers[oldest], deadline);
+					if (ret < 0)
+					{
+						PDEBUG("Bulk out transfer returned %d\n", ret);
+						usb_kill_anchored_urbs(&p_device_data->anchor);
+						return ret;
+					}
+					oldest = (oldest + 1) % USBTMC_TRANSFERS_IN_FLIGHT;
+					in_flight--;
+				}
+				transfer = &p_device_data->transfers[(oldest + in_flight) % USBTMC_TRANSFERS_IN_FLIGHT];
+
+				this_piece = USBTMC_SIZE_IOBUFFER - offset;
+				if (this_piece > this_part - sent)
+					this_piece = this_part - sent;
 		
+				/* Append write buffer (instrument command) to USBTMC message */
+				if (copy_from_user(&transfer->buffer[offset], buf + done + sent, this_piece))
+				{
+					/* There must have been an addressing problem */
+					usb_kill_anchored_urbs(&p_device_data->anchor);
+					return -OPENTMLIB_ERROR_USBTMC_MEMORY_ACCESS_ERROR;
+				}
+				num_of_bytes = offset + this_piece;
+				sent += this_piece;
+		
+				/* Add zero bytes to achieve 4-byte alignment */
+				if (sent == this_part)
+					while (num_of_bytes % 4)
+						transfer->buffer[num_of_bytes++] = 0;
+	
+				/* Send USB request */
+				if ((ret = usbtmc_submit_transfer(p_device_data, transfer, pipe, num_of_bytes)) < 0)
+				{
+					usb_kill_anchored_urbs(&p_device_data->anchor);
+					return ret;
+				}
+				in_flight++;
+
+				offset = 0;
+
+			}
+			while (sent < this_part);
+
+			/* Wait for the rest of the message to go out */
+			while (in_flight > 0)
+			{
+				ret = usbtmc_wait_transfer(p_device_data, &p_device_data->transfers[oldest], deadline);
+				if (ret < 0)
+				{
+					PDEBUG("Bulk out transfer returned %d\n", ret);
+					usb_kill_anchored_urbs(&p_device_data->anchor);
+					return ret;
+				}
+				oldest = (oldest + 1) % USBTMC_TRANSFERS_IN_FLIGHT;
+				in_flight--;
+			}
+
+
+		}		
 		remaining -= this_part;
 		done += this_part;
 
@@ -547,7 +1573,7 @@ ssize_t usbtmc_write(struct file *filp, const char __user *buf, size_t count, lo
 	
 minor_null:
 
-	usbtmc_devs[0]->number_of_bytes = 0; /* In case of data left over in buffer for minor number zero */
+	usbtmc_control->number_of_bytes = 0; /* In case of data left over in buffer for minor number zero */
 
 	/* Make sure message has the right size */
 	if (count != sizeof(struct usbtmc_io_control))
@@ -562,25 +1588,217 @@ minor_null:
 	}
 
 	/* Make sure minor number given is in range */
-	if (control_message.minor_number > USBTMC_MAX_DEVICES)
+	if (control_message.minor_number >= USBTMC_MAX_DEVICES)
 	{
 		return -OPENTMLIB_ERROR_USBTMC_MINOR_OUT_OF_RANGE;
 	}
 
-	/* Make sure minor number given is in use */
-	if (usbtmc_devs[control_message.minor_number] == NULL)
+	/* Make sure minor number given is in use, and keep its private data while the message is handled */
+	if ((p_device_data = usbtmc_get(control_message.minor_number)) == NULL)
 	{
 		return -OPENTMLIB_ERROR_USBTMC_MINOR_NUMBER_UNUSED;
 	}
 
 	/* Dispatch message */
-	if ((ret = usbtmc_dispatch_control_message(&control_message)) != USBTMC_NO_ERROR)
+	ret = usbtmc_dispatch_control_message(&control_message);
+	usbtmc_put(p_device_data);
+	if (ret != USBTMC_NO_ERROR)
 		return ret;
 
 	return count;
 
 }
 
+/* Write entry point */
+ssize_t usbtmc_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+
+	struct usbtmc_device_data *p_device_data;
+	ssize_t ret;
+
+	/* Get pointer to private data structure */
+	p_device_data = filp->private_data;
+
+	if ((ret = usbtmc_lock(p_device_data)) != USBTMC_NO_ERROR)
+		return ret;
+	ret = usbtmc_write_locked(filp, buf, count, f_pos);
+	mutex_unlock(&p_device_data->io_mutex);
+
+	return ret;
+
+}
+
+/* Runs an asynchronous read or write (on the device's async_queue) and completes its IOCB */
+static void usbtmc_async_work(struct work_struct *work)
+{
+
+	struct usbtmc_async_request *request = container_of(work, struct usbtmc_async_request, work);
+	struct file *filp = request->iocb->ki_filp;
+	struct usbtmc_device_data *p_device_data = filp->private_data;
+	loff_t pos = request->iocb->ki_pos;
+	int cancelled;
+	ssize_t ret;
+
+	spin_lock_irq(&p_device_data->async_lock);
+	cancelled = request->cancelled;
+	spin_unlock_irq(&p_device_data->async_lock);
+
+	if (cancelled)
+	{
+		ret = -OPENTMLIB_ERROR_TRANSACTION_ABORTED;
+	}
+	else
+	{
+		/* The buffer is in the submitting process's address space */
+		kthread_use_mm(request->mm);
+		if (request->write)
+			ret = usbtmc_write(filp, request->buf, request->count, &pos);
+		else
+			ret = usbtmc_read_request(filp, request->buf, request->count, &pos, request);
+		kthread_unuse_mm(request->mm);
+	}
+
+	mmput(request->mm);
+	request->iocb->ki_pos = pos;
+	request->iocb->ki_complete(request->iocb, ret);
+	kfree(request);
+
+}
+
+/* Aborts the read of a cancelled asynchronous request (see usbtmc_cancel_iocb). Nothing happens if that
+ * read has ended meanwhile, the one in progress may belong to another request. */
+static void usbtmc_abort_work(struct work_struct *work)
+{
+
+	struct usbtmc_device_data *p_device_data = container_of(work, struct usbtmc_device_data, abort_work);
+	unsigned int generation;
+
+	spin_lock_irq(&p_device_data->async_lock);
+	generation = p_device_data->abort_generation;
+	spin_unlock_irq(&p_device_data->async_lock);
+
+	if (generation != 0)
+		usbtmc_abort_read(p_device_data, generation);
+
+}
+
+/* Cancels an asynchronous request (AIO, called with a spinlock held). A request whose transfer hasn't
+ * started completes without doing I/O, the transfer of a read in progress is aborted with the USBTMC
+ * abort sequence. A write in progress completes (it takes no longer than the timeout). */
+static int usbtmc_cancel_iocb(struct kiocb *iocb)
+{
+
+	struct usbtmc_async_request *request = iocb->private;
+	struct usbtmc_device_data *p_device_data = iocb->ki_filp->private_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&p_device_data->async_lock, flags);
+	if (request->generation == 0)
+	{
+		request->cancelled = 1;
+	}
+	else
+	{
+		p_device_data->abort_generation = request->generation;
+		schedule_work(&p_device_data->abort_work);
+	}
+	spin_unlock_irqrestore(&p_device_data->async_lock, flags);
+
+	return 0;
+
+}
+
+/* Returns the user buffer an iov_iter refers to, NULL if it isn't a single user space segment. Each
+ * read or write is one USBTMC message, so vectors don't map onto the protocol. */
+static char __user *usbtmc_iter_buffer(struct iov_iter *iter)
+{
+
+	if (iter_is_ubuf(iter))
+		return iter->ubuf + iter->iov_offset;
+
+	if (iter_is_iovec(iter) && (iter->nr_segs == 1))
+		return iter_iov(iter)->iov_base + iter->iov_offset;
+
+	return NULL;
+
+}
+
+/* Common part of usbtmc_read_iter and usbtmc_write_iter. Synchronous calls (readv, writev) are done right
+ * away. Asynchronous ones (AIO, io_uring) are queued on the device's async_queue and return
+ * -EIOCBQUEUED, so one thread can keep transfers to several instruments in flight. AIO requests can be
+ * cancelled (io_cancel). io_uring has no way to cancel a request a driver holds, such a read ends by its
+ * timeout or by OPENTMLIB_OPERATION_ABORT. */
+static ssize_t usbtmc_rw_iter(struct kiocb *iocb, struct iov_iter *iter, int write)
+{
+
+	struct usbtmc_device_data *p_device_data;
+	struct usbtmc_async_request *request;
+	char __user *buf;
+	size_t count;
+	ssize_t ret;
+
+	/* Get pointer to private data structure */
+	p_device_data = iocb->ki_filp->private_data;
+
+	/* Verify pointer and driver state */
+	if ((ret = usbtmc_verify_state(p_device_data, USBTMC_DRV_STATE_OPEN)) != USBTMC_NO_ERROR)
+		return ret;
+
+	if ((buf = usbtmc_iter_buffer(iter)) == NULL)
+		return -EINVAL;
+	count = iov_iter_count(iter);
+
+	/* Minor number zero handles control messages in no time */
+	if (is_sync_kiocb(iocb) || (MINOR(p_device_data->devno) == 0))
+	{
+		if (write)
+			ret = usbtmc_write(iocb->ki_filp, buf, count, &iocb->ki_pos);
+		else
+			ret = usbtmc_read(iocb->ki_filp, buf, count, &iocb->ki_pos);
+		if (ret > 0)
+			iov_iter_advance(iter, ret);
+		return ret;
+	}
+
+	if (!(request = kmalloc(sizeof(struct usbtmc_async_request), GFP_KERNEL)))
+		return -ENOMEM;
+
+	INIT_WORK(&request->work, usbtmc_async_work);
+	request->iocb = iocb;
+	request->mm = current->mm;
+	mmget(request->mm);
+	request->buf = buf;
+	request->count = count;
+	request->write = write;
+	request->cancelled = 0;
+	request->generation = 0;
+
+	/* Only AIO kiocbs are embedded in an aio_kiocb, which kiocb_set_cancel_fn relies on */
+	iocb->private = request;
+	if (iocb->ki_flags & IOCB_AIO_RW)
+		kiocb_set_cancel_fn(iocb, usbtmc_cancel_iocb);
+	queue_work(p_device_data->async_queue, &request->work);
+
+	return -EIOCBQUEUED;
+
+}
+
+/* read_iter entry point */
+ssize_t usbtmc_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+
+	return usbtmc_rw_iter(iocb, to, 0);
+
+}
+
+/* write_iter entry point */
+ssize_t usbtmc_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+
+	return usbtmc_rw_iter(iocb, from, 1);
+
+}
+
 /* Dispatches control message (sent to minor number zero) on behalf of usbtmc_write(). */
 int usbtmc_dispatch_control_message(struct usbtmc_io_control *control_message)
 {
@@ -591,7 +1809,7 @@ int usbtmc_dispatch_control_message(struct usbtmc_io_control *control_message)
 	PDEBUG("usbtmc_dispatch_control_message() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 
 	/* Verify pointer and driver state */
 	if ((ret = usbtmc_verify_state(p_device_data, USBTMC_DRV_STATE_OPEN)) != USBTMC_NO_ERROR)
@@ -600,23 +1818,38 @@ int usbtmc_dispatch_control_message(struct usbtmc_io_control *control_message)
 	if (MINOR(p_device_data->devno) == 0)
 		goto minor_null;
 
+	/* Abort has to get through while a read holds the instrument's mutex (see usbtmc_abort) */
+	if ((control_message->command == USBTMC_CONTROL_IO_OPERATION) &&
+		(control_message->argument == OPENTMLIB_OPERATION_ABORT))
+		return usbtmc_abort(control_message);
+
+	if ((ret = usbtmc_lock(p_device_data)) != USBTMC_NO_ERROR)
+		return ret;
+
 	switch (control_message->command)
 	{
 
 	case USBTMC_CONTROL_SET_ATTRIBUTE:
-		return usbtmc_control_set_attribute(control_message);
+		ret = usbtmc_control_set_attribute(control_message);
+		break;
 
 	case USBTMC_CONTROL_GET_ATTRIBUTE:
-		return usbtmc_control_get_attribute(control_message);
+		ret = usbtmc_control_get_attribute(control_message);
+		break;
 
 	case USBTMC_CONTROL_IO_OPERATION:
-		return usbtmc_control_io_operation(control_message);
+		ret = usbtmc_control_io_operation(control_message);
+		break;
 
 	default:
-		return -OPENTMLIB_ERROR_USBTMC_INVALID_REQUEST;
+		ret = -OPENTMLIB_ERROR_USBTMC_INVALID_REQUEST;
 
 	}
 
+	mutex_unlock(&p_device_data->io_mutex);
+
+	return ret;
+
 minor_null:
 
 	switch (control_message->command)
@@ -642,6 +1875,138 @@ loff_t usbtmc_llseek(struct file *filp, loff_t position, int x)
 
 }
 
+/* ioctl entry point. Does what control messages to minor number zero do, but on the instrument's own
+ * file and in a single call. Results are returned through arg instead of the buffer of minor number
+ * zero, so calls for different instruments don't get in each other's way. */
+long usbtmc_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+
+	struct usbtmc_device_data *p_device_data;
+	struct usbtmc_io_control control_message;
+	struct usbtmc_ioctl_attribute attribute;
+	struct usbtmc_ioctl_operation operation;
+	struct usbtmc_dev_capabilities caps;
+	unsigned int value;
+	int ret;
+
+	PDEBUG("usbtmc_ioctl() called\n");
+
+	/* Get pointer to private data structure */
+	p_device_data = filp->private_data;
+
+	/* Verify pointer and driver state */
+	if ((ret = usbtmc_verify_state(p_device_data, USBTMC_DRV_STATE_OPEN)) != USBTMC_NO_ERROR)
+		return ret;
+
+	/* Minor number zero only takes control messages */
+	if (MINOR(p_device_data->devno) == 0)
+		return -ENOTTY;
+
+	/* The functions doing the work find the instrument through a control message */
+	control_message.minor_number = MINOR(p_device_data->devno);
+	control_message.argument = 0;
+	control_message.value = 0;
+
+	/* Get arguments */
+	switch (cmd)
+	{
+
+	case USBTMC_IOCTL_SET_ATTRIBUTE:
+	case USBTMC_IOCTL_GET_ATTRIBUTE:
+		if (copy_from_user(&attribute, (void __user *) arg, sizeof(struct usbtmc_ioctl_attribute)))
+			return -OPENTMLIB_ERROR_USBTMC_MEMORY_ACCESS_ERROR;
+		control_message.argument = attribute.attribute;
+		control_message.value = attribute.value;
+		break;
+
+	case USBTMC_IOCTL_IO_OPERATION:
+		if (copy_from_user(&operation, (void __user *) arg, sizeof(struct usbtmc_ioctl_operation)))
+			return -OPENTMLIB_ERROR_USBTMC_MEMORY_ACCESS_ERROR;
+		control_message.argument = operation.operation;
+		control_message.value = operation.value;
+		/* Abort has to get through while a read holds the instrument's mutex (see usbtmc_abort) */
+		if (operation.operation == OPENTMLIB_OPERATION_ABORT)
+			return usbtmc_abort(&control_message);
+		break;
+
+	case USBTMC_IOCTL_READ_STB:
+	case USBTMC_IOCTL_GET_CAPABILITIES:
+		break;
+
+	case USBTMC_IOCTL_WAIT_SRQ:
+		/* Waiting doesn't use the instrument, so don't keep others from doing so */
+		if ((ret = usbtmc_wait_srq(p_device_data, &value)) != USBTMC_NO_ERROR)
+			return ret;
+		if (put_user(value, (unsigned int __user *) arg))
+			return -OPENTMLIB_ERROR_USBTMC_MEMORY_ACCESS_ERROR;
+		return USBTMC_NO_ERROR;
+
+	default:
+		return -ENOTTY;
+
+	}
+
+	if ((ret = usbtmc_lock(p_device_data)) != USBTMC_NO_ERROR)
+		return ret;
+
+	switch (cmd)
+	{
+
+	case USBTMC_IOCTL_SET_ATTRIBUTE:
+		control_message.command = USBTMC_CONTROL_SET_ATTRIBUTE;
+		ret = usbtmc_control_set_attribute(&control_message);
+		break;
+
+	case USBTMC_IOCTL_GET_ATTRIBUTE:
+		control_message.command = USBTMC_CONTROL_GET_ATTRIBUTE;
+		ret = usbtmc_get_attribute(&control_message, &attribute.value);
+		break;
+
+	case USBTMC_IOCTL_IO_OPERATION:
+		control_message.command = USBTMC_CONTROL_IO_OPERATION;
+		ret = usbtmc_control_io_operation(&control_message);
+		break;
+
+	case USBTMC_IOCTL_READ_STB:
+		ret = usbtmc_get_stb(&control_message, &value);
+		break;
+
+	case USBTMC_IOCTL_GET_CAPABILITIES:
+		ret = usbtmc_get_capabilities(&control_message, &caps);
+		break;
+
+	}
+
+	mutex_unlock(&p_device_data->io_mutex);
+
+	if (ret != USBTMC_NO_ERROR)
+		return ret;
+
+	/* Return results */
+	switch (cmd)
+	{
+
+	case USBTMC_IOCTL_GET_ATTRIBUTE:
+		if (copy_to_user((void __user *) arg, &attribute, sizeof(struct usbtmc_ioctl_attribute)))
+			return -OPENTMLIB_ERROR_USBTMC_MEMORY_ACCESS_ERROR;
+		break;
+
+	case USBTMC_IOCTL_READ_STB:
+		if (put_user(value, (unsigned int __user *) arg))
+			return -OPENTMLIB_ERROR_USBTMC_MEMORY_ACCESS_ERROR;
+		break;
+
+	case USBTMC_IOCTL_GET_CAPABILITIES:
+		if (copy_to_user((void __user *) arg, &caps, sizeof(struct usbtmc_dev_capabilities)))
+			return -OPENTMLIB_ERROR_USBTMC_MEMORY_ACCESS_ERROR;
+		break;
+
+	}
+
+	return USBTMC_NO_ERROR;
+
+}
+
 /* Returns details about an instrument. */
 int usbtmc_control_report_instrument(struct usbtmc_io_control *control_message)
 {
@@ -653,15 +2018,20 @@ int usbtmc_control_report_instrument(struct usbtmc_io_control *control_message)
 	PDEBUG("usbtmc_control_report_instrument() called\n");
 
 	/* Check argument (minor number) */
-	if ((control_message->argument == 0) || (control_message->argument > USBTMC_MAX_DEVICES))
+	if ((control_message->argument == 0) || (control_message->argument >= USBTMC_MAX_DEVICES))
 		return -OPENTMLIB_ERROR_USBTMC_MINOR_OUT_OF_RANGE;
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->argument];
-	
+	p_device_data = usbtmc_get(control_message->argument);
+
 	/* Make sure this device exists */
 	if (p_device_data == NULL)
 		return -OPENTMLIB_ERROR_USBTMC_MINOR_NUMBER_UNUSED;
+	if (READ_ONCE(p_device_data->disconnected))
+	{
+		usbtmc_put(p_device_data);
+		return -OPENTMLIB_ERROR_USBTMC_MINOR_NUMBER_UNUSED;
+	}
 
 	/* Fill structure */
 	p_device = interface_to_usbdev(p_device_data->intf);
@@ -676,8 +2046,9 @@ int usbtmc_control_report_instrument(struct usbtmc_io_control *control_message)
 	instrument.product_code = p_device->descriptor.idProduct;
 
 	/* Write data to I/O buffer to be sent during upcoming read */
-	memcpy(usbtmc_buffer, &instrument, sizeof(struct usbtmc_instrument));
-	usbtmc_devs[0]->number_of_bytes = sizeof(struct usbtmc_instrument);
+	memcpy(usbtmc_control->buffer, &instrument, sizeof(struct usbtmc_instrument));
+	usbtmc_control->number_of_bytes = sizeof(struct usbtmc_instrument);
+	usbtmc_put(p_device_data);
 
 	return USBTMC_NO_ERROR;
 
@@ -725,6 +2096,9 @@ int usbtmc_control_io_operation(struct usbtmc_io_control *control_message)
 	case OPENTMLIB_OPERATION_USBTMC_LOCAL_LOCKOUT:
 		return usbtmc_local_lockout(control_message);
 
+	case OPENTMLIB_OPERATION_ABORT:
+		return usbtmc_abort(control_message);
+
 	default:
 		return -OPENTMLIB_ERROR_USBTMC_INVALID_OP_CODE;
 
@@ -744,25 +2118,26 @@ int usbtmc_trigger(struct usbtmc_io_control *control_message)
 	PDEBUG("usbtmc_trigger() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 
 	/* Setup IO buffer for TRIGGER message */
-	usbtmc_buffer[0x00] = USBTMC_MSGID_TRIGGER;
-	usbtmc_buffer[0x01] = p_device_data->bTag; /* Transfer ID (bTag) */
-	usbtmc_buffer[0x02] = ~(p_device_data->bTag); /* Inverse of bTag */
-	usbtmc_buffer[0x03] = 0; /* Reserved */
-	usbtmc_buffer[0x04] = 0; /* Reserved */
-	usbtmc_buffer[0x05] = 0; /* Reserved */
-	usbtmc_buffer[0x06] = 0; /* Reserved */
-	usbtmc_buffer[0x07] = 0; /* Reserved */
-	usbtmc_buffer[0x08] = 0; /* Reserved */
-	usbtmc_buffer[0x09] = 0; /* Reserved */
-	usbtmc_buffer[0x0a] = 0; /* Reserved */
-	usbtmc_buffer[0x0b] = 0; /* Reserved */
+	p_device_data->buffer[0x00] = USBTMC_MSGID_TRIGGER;
+	p_device_data->buffer[0x01] = p_device_data->bTag; /* Transfer ID (bTag) */
+	p_device_data->buffer[0x02] = ~(p_device_data->bTag); /* Inverse of bTag */
+	p_device_data->buffer[0x03] = 0; /* Reserved */
+	p_device_data->buffer[0x04] = 0; /* Reserved */
+	p_device_data->buffer[0x05] = 0; /* Reserved */
+	p_device_data->buffer[0x06] = 0; /* Reserved */
+	p_device_data->buffer[0x07] = 0; /* Reserved */
+	p_device_data->buffer[0x08] = 0; /* Reserved */
+	p_device_data->buffer[0x09] = 0; /* Reserved */
+	p_device_data->buffer[0x0a] = 0; /* Reserved */
+	p_device_data->buffer[0x0b] = 0; /* Reserved */
 	
 	/* Create pipe and send USB request */
 	pipe = usb_sndbulkpipe(p_device_data->usb_dev, p_device_data->bulk_out_endpoint);
-	ret = usb_bulk_msg(p_device_data->usb_dev, pipe, usbtmc_buffer, 12, &actual, p_device_data->timeout);
+	ret = usbtmc_bulk_msg(p_device_data, pipe, p_device_data->buffer, 12, &actual, p_device_data->timeout,
+		p_device_data->bTag);
 
 	/* Store bTag (in case we need to abort) */
 	p_device_data->usbtmc_last_write_bTag = p_device_data->bTag;
@@ -788,23 +2163,38 @@ int usbtmc_get_stb(struct usbtmc_io_control *control_message, unsigned int *valu
 
 	struct usbtmc_device_data *p_device_data;
 	unsigned int pipe;
-	int ret;
+	long ret;
+	u8 tag;
+	int interrupt;
 
 	PDEBUG("usbtmc_get_stb() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 	
 	if (p_device_data->bTag < 2)
 		p_device_data->bTag = 2;
 
 	if (p_device_data->bTag > 127)
 		p_device_data->bTag = 2;
+	tag = p_device_data->bTag;
+
+	/* Devices with an interrupt in endpoint send the STB value through it (USB488 section 4.3.1.1). This
+	 * needs the interrupt in transfer, which only runs while the device is open. */
+	interrupt = (p_device_data->interrupt_in_endpoint != 0);
+	if (interrupt)
+	{
+		if (p_device_data->interrupt_urb == NULL)
+			return -OPENTMLIB_ERROR_USBTMC_FEATURE_NOT_SUPPORTED;
+		spin_lock_irq(&p_device_data->notify_lock);
+		p_device_data->stb_received = 0;
+		spin_unlock_irq(&p_device_data->notify_lock);
+	}
 
 	/* Create pipe and send USB request */
 	pipe = usb_rcvctrlpipe(p_device_data->usb_dev, 0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USBTMC_BREQUEST_READ_STATUS_BYTE,
-		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, p_device_data->bTag,	0, usbtmc_buffer,
+		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, p_device_data->bTag,	0, p_device_data->buffer,
 		3, p_device_data->timeout);
 	
 	/* Increment bTag -- and increment again if zero */
@@ -814,26 +2204,60 @@ int usbtmc_get_stb(struct usbtmc_io_control *control_message, unsigned int *valu
 			
 	if (ret < 0)
 	{
-		PDEBUG("usb_control_msg() returned %d\n", ret);
+		PDEBUG("usb_control_msg() returned %ld\n", ret);
 		return ret;
 	}
 			
-	if (usbtmc_buffer[0] != USBTMC_STATUS_SUCCESS)
+	if (p_device_data->buffer[0] != USBTMC_STATUS_SUCCESS)
 	{
-		PDEBUG("READ_STATUS_BYTE returned %x\n", usbtmc_buffer[0]);
+		PDEBUG("READ_STATUS_BYTE returned %x\n", p_device_data->buffer[0]);
 		return -OPENTMLIB_ERROR_USBTMC_STATUS_UNSUCCESSFUL;
 	}
 	
-	*value = usbtmc_buffer[3];
-	
-	if (p_device_data->interrupt_in_endpoint != 0)
+	if (!interrupt)
 	{
-		/* Device has an interrupt in endpoint, so the STB value is delivered through it */
-		return -OPENTMLIB_ERROR_USBTMC_FEATURE_NOT_SUPPORTED;
-		/* TODO: Add support for int in endpoint */
+		*value = p_device_data->buffer[3];
+		return USBTMC_NO_ERROR;
 	}
 
-	return USBTMC_NO_ERROR;
+	/* Wait for the response on the interrupt in endpoint */
+	if (p_device_data->timeout == 0)
+		ret = wait_event_interruptible(p_device_data->notify_wait, usbtmc_stb_received(p_device_data, tag));
+	else if ((ret = wait_event_interruptible_timeout(p_device_data->notify_wait,
+		usbtmc_stb_received(p_device_data, tag), msecs_to_jiffies(p_device_data->timeout))) == 0)
+		ret = -OPENTMLIB_ERROR_TIMEOUT;
+	if (ret < 0)
+		return ret;
+	if (READ_ONCE(p_device_data->disconnected))
+		return -OPENTMLIB_ERROR_USBTMC_MINOR_NUMBER_UNUSED;
+
+	*value = p_device_data->stb_value;
+
+	return USBTMC_NO_ERROR;
+
+}
+
+/* Returns wMaxPacketSize of the bulk in endpoint (0 = not found). */
+static int usbtmc_bulk_in_max_packet_size(struct usbtmc_device_data *p_device_data)
+{
+
+	struct usb_host_interface *current_setting;
+	int n;
+
+	current_setting = p_device_data->intf->cur_altsetting;
+	for (n = 0; n < current_setting->desc.bNumEndpoints; n++)
+		if (current_setting->endpoint[n].desc.bEndpointAddress == p_device_data->bulk_in_endpoint)
+			return le16_to_cpu(current_setting->endpoint[n].desc.wMaxPacketSize);
+
+	return 0;
+
+}
+
+/* True if a bulk in read ended without a short packet, so the device may have more data queued */
+static int usbtmc_more_data(int actual, int max_size)
+{
+
+	return (actual > 0) && ((actual % max_size) == 0);
 
 }
 
@@ -844,19 +2268,19 @@ int usbtmc_abort_bulk_in(struct usbtmc_io_control *control_message)
 
 	struct usbtmc_device_data *p_device_data;
 	int ret, n, actual, max_size;
-	struct usb_host_interface *current_setting;
 	unsigned int pipe;
 
 	PDEBUG("usbtmc_abort_bulk_in() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 
 	/* Create pipe and send USB request */
+	atomic64_inc(&p_device_data->stats.aborts);
 	pipe = usb_rcvctrlpipe(p_device_data->usb_dev,0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USBTMC_BREQUEST_INITIATE_ABORT_BULK_IN,
 		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_ENDPOINT, p_device_data->usbtmc_last_read_bTag,
-		p_device_data->bulk_in_endpoint, usbtmc_buffer, 2, p_device_data->timeout);
+		p_device_data->bulk_in_endpoint, p_device_data->buffer, 2, p_device_data->timeout);
 			
 	if (ret < 0)
 	{
@@ -864,23 +2288,18 @@ int usbtmc_abort_bulk_in(struct usbtmc_io_control *control_message)
 		return ret;
 	}
 	
-	if (usbtmc_buffer[0] == USBTMC_STATUS_FAILED)
+	if (p_device_data->buffer[0] == USBTMC_STATUS_FAILED)
 	{
 		return -OPENTMLIB_ERROR_USBTMC_NO_TRANSFER;
 	}
 		
-	if (usbtmc_buffer[0] != USBTMC_STATUS_SUCCESS)
+	if (p_device_data->buffer[0] != USBTMC_STATUS_SUCCESS)
 	{
 		return -OPENTMLIB_ERROR_USBTMC_NO_TRANSFER_IN_PROGRESS;
 	}
 			
 	/* Get wMaxPacketSize */
-	max_size = 0;
-	current_setting = p_device_data->intf->cur_altsetting;
-	for (n = 0; n < current_setting->desc.bNumEndpoints; n++)
-		if (current_setting->endpoint[n].desc.bEndpointAddress == p_device_data->bulk_in_endpoint)
-			max_size = current_setting->endpoint[n].desc.wMaxPacketSize;
-	if (max_size == 0)
+	if ((max_size = usbtmc_bulk_in_max_packet_size(p_device_data)) == 0)
 	{
 		return -OPENTMLIB_ERROR_USBTMC_UNABLE_TO_GET_WMAXPACKETSIZE;
 	}
@@ -893,8 +2312,8 @@ int usbtmc_abort_bulk_in(struct usbtmc_io_control *control_message)
 
 		/* Read a chunk of data from bulk in endpoint */
 		pipe = usb_rcvbulkpipe(p_device_data->usb_dev, p_device_data->bulk_in_endpoint);
-		ret = usb_bulk_msg(p_device_data->usb_dev, pipe, usbtmc_buffer, USBTMC_SIZE_IOBUFFER, &actual,
-			p_device_data->timeout);
+		ret = usbtmc_bulk_msg(p_device_data, pipe, p_device_data->buffer, USBTMC_SIZE_IOBUFFER, &actual,
+			p_device_data->timeout, p_device_data->usbtmc_last_write_bTag);
 				
 		n++;
 				
@@ -905,14 +2324,35 @@ int usbtmc_abort_bulk_in(struct usbtmc_io_control *control_message)
 		}
 
 	}
-	while ((actual == max_size) && (n < USBTMC_MAX_READS_TO_CLEAR_BULK_IN));
+	while (usbtmc_more_data(actual, max_size) && (n < USBTMC_MAX_READS_TO_CLEAR_BULK_IN));
 			
-	if (actual == max_size)
+	if (usbtmc_more_data(actual, max_size))
 	{
 		return -OPENTMLIB_ERROR_USBTMC_UNABLE_TO_CLEAR_BULK_IN;
 	}
-			
+
+	return usbtmc_abort_bulk_in_status(p_device_data);
+
+}
+
+/* Completes an abort of the bulk in endpoint once the short packet ending the aborted transfer has been
+ * read: polls CHECK_ABORT_BULK_IN_STATUS and reads off any data still queued in the device. */
+int usbtmc_abort_bulk_in_status(struct usbtmc_device_data *p_device_data)
+{
+
+	int ret, n, actual, max_size;
+	unsigned int pipe;
+
+	PDEBUG("usbtmc_abort_bulk_in_status() called\n");
+
+	/* Get wMaxPacketSize */
+	if ((max_size = usbtmc_bulk_in_max_packet_size(p_device_data)) == 0)
+	{
+		return -OPENTMLIB_ERROR_USBTMC_UNABLE_TO_GET_WMAXPACKETSIZE;
+	}
+
 	n = 0;
+	actual = 0;
 			
 usbtmc_abort_bulk_in_status:
 
@@ -920,7 +2360,7 @@ usbtmc_abort_bulk_in_status:
 	pipe = usb_rcvctrlpipe(p_device_data->usb_dev, 0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USBTMC_BREQUEST_CHECK_ABORT_BULK_IN_STATUS,
 		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_ENDPOINT, 0, p_device_data->bulk_in_endpoint,
-		usbtmc_buffer, 0x08, p_device_data->timeout);
+		p_device_data->buffer, 0x08, p_device_data->timeout);
 			
 	if (ret < 0)
 	{
@@ -928,24 +2368,24 @@ usbtmc_abort_bulk_in_status:
 		return ret;
 	}
 			
-	if (usbtmc_buffer[0] == USBTMC_STATUS_SUCCESS)
+	if (p_device_data->buffer[0] == USBTMC_STATUS_SUCCESS)
 		return USBTMC_NO_ERROR;
 			
-	if (usbtmc_buffer[0] != USBTMC_STATUS_PENDING)
+	if (p_device_data->buffer[0] != USBTMC_STATUS_PENDING)
 	{
-		PDEBUG("INITIATE_ABORT_BULK_IN returned %x\n", usbtmc_buffer[0]);
+		PDEBUG("INITIATE_ABORT_BULK_IN returned %x\n", p_device_data->buffer[0]);
 		return -OPENTMLIB_ERROR_USBTMC_UNEXPECTED_STATUS;
 	}
 	
 	/* Is there data to read off the device? */
-	if (usbtmc_buffer[1] == 1)
+	if (p_device_data->buffer[1] == 1)
 		do
 		{
 
 			/* Read a chunk of data from bulk in endpoint */
 			pipe = usb_rcvbulkpipe(p_device_data->usb_dev, p_device_data->bulk_in_endpoint);
-			ret = usb_bulk_msg(p_device_data->usb_dev, pipe, usbtmc_buffer, USBTMC_SIZE_IOBUFFER,
-				&actual, p_device_data->timeout);
+			ret = usbtmc_bulk_msg(p_device_data, pipe, p_device_data->buffer, USBTMC_SIZE_IOBUFFER,
+				&actual, p_device_data->timeout, p_device_data->usbtmc_last_write_bTag);
 
 			n++;
 
@@ -956,9 +2396,9 @@ usbtmc_abort_bulk_in_status:
 			}
 
 		}
-		while ((actual == max_size) && (n < USBTMC_MAX_READS_TO_CLEAR_BULK_IN));
+		while (usbtmc_more_data(actual, max_size) && (n < USBTMC_MAX_READS_TO_CLEAR_BULK_IN));
 				
-	if (actual == max_size)
+	if (usbtmc_more_data(actual, max_size))
 	{
 		return -OPENTMLIB_ERROR_USBTMC_UNABLE_TO_CLEAR_BULK_IN;
 	}
@@ -968,6 +2408,73 @@ usbtmc_abort_bulk_in_status:
 
 }
 
+/* Aborts a read that is blocked on the bulk in endpoint, typically on behalf of another thread or process
+ * (the control channel is separate from the device file used for I/O). INITIATE_ABORT_BULK_IN makes the
+ * device end the pending transfer with a short packet. The reader then sees abort_requested, completes the
+ * abort sequence and returns -OPENTMLIB_ERROR_TRANSACTION_ABORTED. An abort only applies to the read in
+ * progress: without one, or if the device has no transfer in progress, nothing happens. */
+int usbtmc_abort(struct usbtmc_io_control *control_message)
+{
+
+	PDEBUG("usbtmc_abort() called\n");
+
+	return usbtmc_abort_read(usbtmc_find(control_message->minor_number), 0);
+
+}
+
+/* Aborts read generation of a device (0 = the read in progress, whichever it is), see usbtmc_abort */
+static int usbtmc_abort_read(struct usbtmc_device_data *p_device_data, unsigned int generation)
+{
+
+	unsigned char *buffer;
+	unsigned int pipe;
+	int ret;
+
+	/* Use a buffer of our own, the I/O buffer belongs to the transfer being aborted */
+	buffer = kmalloc(2, GFP_KERNEL);
+	if (buffer == NULL)
+		return -ENOMEM;
+
+	/* The read can't end (and the next one can't start) while the abort is sent */
+	mutex_lock(&p_device_data->abort_mutex);
+	if ((p_device_data->read_active == 0) || ((generation != 0) && (p_device_data->read_active != generation)))
+	{
+		PDEBUG("No read in progress\n");
+		ret = USBTMC_NO_ERROR;
+		goto exit;
+	}
+	atomic_set(&p_device_data->abort_requested, p_device_data->read_active);
+
+	/* The pending bulk in transfer carries the bTag of the last REQUEST_DEV_DEP_MSG_IN sent */
+	atomic64_inc(&p_device_data->stats.aborts);
+	pipe = usb_rcvctrlpipe(p_device_data->usb_dev, 0);
+	ret = usb_control_msg(p_device_data->usb_dev, pipe, USBTMC_BREQUEST_INITIATE_ABORT_BULK_IN,
+		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_ENDPOINT, p_device_data->usbtmc_last_write_bTag,
+		p_device_data->bulk_in_endpoint, buffer, 2, p_device_data->timeout);
+
+	if (ret < 0)
+	{
+		PDEBUG("usb_control_msg() returned %d\n", ret);
+		atomic_set(&p_device_data->abort_requested, 0);
+		goto exit;
+	}
+
+	if (buffer[0] != USBTMC_STATUS_SUCCESS)
+	{
+		/* No transfer in progress, the read isn't affected */
+		PDEBUG("INITIATE_ABORT_BULK_IN returned %x\n", buffer[0]);
+		atomic_set(&p_device_data->abort_requested, 0);
+	}
+	ret = USBTMC_NO_ERROR;
+
+exit:
+
+	mutex_unlock(&p_device_data->abort_mutex);
+	kfree(buffer);
+	return ret;
+
+}
+
 /* Abort the last bulk out transfer and restore synchronization.
  * See section 4.2.1.2 of the USBTMC specifcation for details. */
 int usbtmc_abort_bulk_out(struct usbtmc_io_control *control_message)
@@ -980,13 +2487,14 @@ int usbtmc_abort_bulk_out(struct usbtmc_io_control *control_message)
 	PDEBUG("usbtmc_abort_bulk_out() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 
 	/* Create pipe and send USB request */
+	atomic64_inc(&p_device_data->stats.aborts);
 	pipe = usb_rcvctrlpipe(p_device_data->usb_dev, 0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USBTMC_BREQUEST_INITIATE_ABORT_BULK_OUT,
 		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_ENDPOINT, p_device_data->usbtmc_last_write_bTag,
-		p_device_data->bulk_out_endpoint, usbtmc_buffer, 2, p_device_data->timeout);
+		p_device_data->bulk_out_endpoint, p_device_data->buffer, 2, p_device_data->timeout);
 			
 	if (ret < 0)
 	{
@@ -996,12 +2504,12 @@ int usbtmc_abort_bulk_out(struct usbtmc_io_control *control_message)
 
 
 
-	if (usbtmc_buffer[0] == USBTMC_STATUS_FAILED)
+	if (p_device_data->buffer[0] == USBTMC_STATUS_FAILED)
 	{
 		return -OPENTMLIB_ERROR_USBTMC_NO_TRANSFER;
 	}
 		
-	if (usbtmc_buffer[0] != USBTMC_STATUS_SUCCESS)
+	if (p_device_data->buffer[0] != USBTMC_STATUS_SUCCESS)
 	{
 		return -OPENTMLIB_ERROR_USBTMC_NO_TRANSFER_IN_PROGRESS;
 	}
@@ -1014,7 +2522,7 @@ usbtmc_abort_bulk_out_check_status:
 	pipe = usb_rcvctrlpipe(p_device_data->usb_dev,0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USBTMC_BREQUEST_CHECK_ABORT_BULK_OUT_STATUS,
 		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_ENDPOINT, 0, p_device_data->bulk_out_endpoint,
-		usbtmc_buffer, 0x08, p_device_data->timeout);
+		p_device_data->buffer, 0x08, p_device_data->timeout);
 			
 	n++;
 			
@@ -1024,13 +2532,13 @@ usbtmc_abort_bulk_out_check_status:
 		return ret;
 	}
 			
-	if (usbtmc_buffer[0] == USBTMC_STATUS_SUCCESS)
+	if (p_device_data->buffer[0] == USBTMC_STATUS_SUCCESS)
 		goto usbtmc_abort_bulk_out_clear_halt;
 		
-	if ((usbtmc_buffer[0] == USBTMC_STATUS_PENDING) && (n < USBTMC_MAX_READS_TO_CLEAR_BULK_IN))
+	if ((p_device_data->buffer[0] == USBTMC_STATUS_PENDING) && (n < USBTMC_MAX_READS_TO_CLEAR_BULK_IN))
 		goto usbtmc_abort_bulk_out_check_status;
 			
-	PDEBUG("CHECK_ABORT_BULK_OUT returned %x\n", usbtmc_buffer[0]);
+	PDEBUG("CHECK_ABORT_BULK_OUT returned %x\n", p_device_data->buffer[0]);
 	return -OPENTMLIB_ERROR_USBTMC_UNEXPECTED_STATUS;
 			
 usbtmc_abort_bulk_out_clear_halt:
@@ -1039,7 +2547,7 @@ usbtmc_abort_bulk_out_clear_halt:
 	pipe = usb_sndctrlpipe(p_device_data->usb_dev, 0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USB_REQ_CLEAR_FEATURE,
 		USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_ENDPOINT, USB_ENDPOINT_HALT,
-		p_device_data->bulk_out_endpoint, usbtmc_buffer, 0, p_device_data->timeout);
+		p_device_data->bulk_out_endpoint, p_device_data->buffer, 0, p_device_data->timeout);
 			
 	if (ret < 0)
 	{
@@ -1064,12 +2572,12 @@ int usbtmc_clear(struct usbtmc_io_control *control_message)
 	PDEBUG("usbtmc_clear() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 
 	/* Create pipe and send USB request */
 	pipe = usb_rcvctrlpipe(p_device_data->usb_dev, 0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USBTMC_BREQUEST_INITIATE_CLEAR,
-		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 0, 0, usbtmc_buffer, 1,
+		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 0, 0, p_device_data->buffer, 1,
 		p_device_data->timeout);
 			
 	if (ret < 0)
@@ -1078,9 +2586,9 @@ int usbtmc_clear(struct usbtmc_io_control *control_message)
 		return ret;
 	}
 			
-	if (usbtmc_buffer[0] != USBTMC_STATUS_SUCCESS)
+	if (p_device_data->buffer[0] != USBTMC_STATUS_SUCCESS)
 	{
-		PDEBUG("INITIATE_CLEAR returned %x\n", usbtmc_buffer[0]);
+		PDEBUG("INITIATE_CLEAR returned %x\n", p_device_data->buffer[0]);
 		return -OPENTMLIB_ERROR_USBTMC_STATUS_UNSUCCESSFUL;
 	}
 
@@ -1103,7 +2611,7 @@ usbtmc_clear_check_status:
 	/* Create pipe and send USB request */
 	pipe = usb_rcvctrlpipe(p_device_data->usb_dev,0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USBTMC_BREQUEST_CHECK_CLEAR_STATUS,
-		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 0, 0, usbtmc_buffer, 2,
+		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 0, 0, p_device_data->buffer, 2,
 		p_device_data->timeout);
 			
 	if (ret < 0)
@@ -1112,21 +2620,21 @@ usbtmc_clear_check_status:
 		return ret;
 	}
 			
-	if (usbtmc_buffer[0] == USBTMC_STATUS_SUCCESS)
+	if (p_device_data->buffer[0] == USBTMC_STATUS_SUCCESS)
 	{
 		/* Done. No data to read off the device. */
 		goto usbtmc_clear_bulk_out_halt;
 	}
 			
-	if (usbtmc_buffer[0] != USBTMC_STATUS_PENDING)
+	if (p_device_data->buffer[0] != USBTMC_STATUS_PENDING)
 	{
-		PDEBUG("CHECK_CLEAR_STATUS returned %x\n", usbtmc_buffer[0]);
+		PDEBUG("CHECK_CLEAR_STATUS returned %x\n", p_device_data->buffer[0]);
 		return -OPENTMLIB_ERROR_USBTMC_UNEXPECTED_STATUS;
 	}
 	
 	/* Check bmClear field to see if data needs to be read off the device */
 			
-	if (usbtmc_buffer[1] == 1)
+	if (p_device_data->buffer[1] == 1)
 		do
 		{
 
@@ -1136,8 +2644,8 @@ usbtmc_clear_check_status:
 
 			/* Create pipe and send USB request */
 			pipe = usb_rcvbulkpipe(p_device_data->usb_dev, p_device_data->bulk_in_endpoint);
-			ret = usb_bulk_msg(p_device_data->usb_dev, pipe, usbtmc_buffer, USBTMC_SIZE_IOBUFFER,
-				&actual, p_device_data->timeout);
+			ret = usbtmc_bulk_msg(p_device_data, pipe, p_device_data->buffer, USBTMC_SIZE_IOBUFFER,
+				&actual, p_device_data->timeout, p_device_data->usbtmc_last_write_bTag);
 
 			n++;
 
@@ -1148,9 +2656,9 @@ usbtmc_clear_check_status:
 			}
 
 		}
-		while ((actual == max_size) && (n < USBTMC_MAX_READS_TO_CLEAR_BULK_IN));
+		while (usbtmc_more_data(actual, max_size) && (n < USBTMC_MAX_READS_TO_CLEAR_BULK_IN));
 		
-	if (actual == max_size)
+	if (usbtmc_more_data(actual, max_size))
 	{
 		PDEBUG("Couldn't clear device buffer within %d cycles\n", USBTMC_MAX_READS_TO_CLEAR_BULK_IN);
 		return -OPENTMLIB_ERROR_USBTMC_UNABLE_TO_CLEAR_BULK_IN;
@@ -1167,7 +2675,7 @@ usbtmc_clear_bulk_out_halt:
 	pipe = usb_sndctrlpipe(p_device_data->usb_dev, 0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USB_REQ_CLEAR_FEATURE,
 		USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_ENDPOINT, USB_ENDPOINT_HALT,
-		p_device_data->bulk_out_endpoint, usbtmc_buffer, 0, p_device_data->timeout);
+		p_device_data->bulk_out_endpoint, p_device_data->buffer, 0, p_device_data->timeout);
 			
 	if (ret < 0)
 	{
@@ -1188,13 +2696,19 @@ int usbtmc_control_set_attribute(struct usbtmc_io_control *control_message)
 	PDEBUG("usbtmc_control_set_attribute() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 	
 	switch (control_message->argument)
 	{
 
 	case OPENTMLIB_ATTRIBUTE_TIMEOUT:
-		p_device_data->timeout = control_message->value * HZ; // Timeout value in jiffies
+		if (control_message->value > UINT_MAX / 1000)
+			return -OPENTMLIB_ERROR_USBTMC_INVALID_ATTRIBUTE_VALUE;
+		p_device_data->timeout = control_message->value * 1000; /* USB core takes ms */
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT_MS:
+		p_device_data->timeout = control_message->value;
 		break;
 
 	case OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE:
@@ -1214,6 +2728,12 @@ int usbtmc_control_set_attribute(struct usbtmc_io_control *control_message)
 			return -OPENTMLIB_ERROR_USBTMC_INVALID_ATTRIBUTE_VALUE;
 		p_device_data->set_end_indicator = control_message->value;
 		break;
+
+	case OPENTMLIB_ATTRIBUTE_USBTMC_MAX_TRANSFER_SIZE:
+		if ((control_message->value == 0) || (control_message->value > INT_MAX))
+			return -OPENTMLIB_ERROR_USBTMC_INVALID_ATTRIBUTE_VALUE;
+		p_device_data->max_transfer_size = control_message->value;
+		break;
 				
 	default:
 		/* Bad attribute or read-only */
@@ -1225,61 +2745,94 @@ int usbtmc_control_set_attribute(struct usbtmc_io_control *control_message)
 
 }
 
-/* Read driver or instrument attribute. */
+/* Read driver or instrument attribute (control message version, the value is sent during the upcoming
+ * read of minor number zero). */
 int usbtmc_control_get_attribute(struct usbtmc_io_control *control_message)
 {
 
-	struct usbtmc_device_data *p_device_data;
 	unsigned int value;
+	int ret;
+
+	PDEBUG("usbtmc_control_get_attribute() called\n");
+
+	if ((ret = usbtmc_get_attribute(control_message, &value)) != USBTMC_NO_ERROR)
+		return ret;
+
+	/* Write data to I/O buffer to be sent during upcoming read */
+	memcpy(usbtmc_control->buffer, &value, sizeof(unsigned int));
+	usbtmc_control->number_of_bytes = sizeof(unsigned int);
+
+	return USBTMC_NO_ERROR;
+
+}
+
+/* Read driver or instrument attribute. */
+int usbtmc_get_attribute(struct usbtmc_io_control *control_message, unsigned int *value)
+{
+
+	struct usbtmc_device_data *p_device_data;
 	struct usbtmc_dev_capabilities caps;
+	int ret;
 	
-	PDEBUG("usbtmc_control_get_attribute() called\n");
+	PDEBUG("usbtmc_get_attribute() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 	
 	switch (control_message->argument)
 	{
 
 	case OPENTMLIB_ATTRIBUTE_TIMEOUT:
-		value = p_device_data->timeout / HZ; // Back to s from jiffies
+		*value = DIV_ROUND_UP(p_device_data->timeout, 1000); /* Sub-second timeouts don't read back as 0 */
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT_MS:
+		*value = p_device_data->timeout;
 		break;
 
 	case OPENTMLIB_ATTRIBUTE_SET_END_INDICATOR:
-		value = p_device_data->set_end_indicator;
+		*value = p_device_data->set_end_indicator;
 		break;
 
 	case OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE:
-		value = p_device_data->term_char_enabled;
+		*value = p_device_data->term_char_enabled;
 		break;
 		
 	case OPENTMLIB_ATTRIBUTE_TERM_CHARACTER:
-		value = p_device_data->term_char;
+		*value = p_device_data->term_char;
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_USBTMC_MAX_TRANSFER_SIZE:
+		*value = p_device_data->max_transfer_size;
 		break;
 		
 	case OPENTMLIB_ATTRIBUTE_USBTMC_INTERFACE_CAPS:
-		usbtmc_get_capabilities(control_message, &caps);
-		value = caps.interface_capabilities;
+		if ((ret = usbtmc_get_capabilities(control_message, &caps)) != USBTMC_NO_ERROR)
+			return ret;
+		*value = caps.interface_capabilities;
 		break;
 
 	case OPENTMLIB_ATTRIBUTE_USBTMC_DEVICE_CAPS:
-		usbtmc_get_capabilities(control_message, &caps);
-		value = caps.device_capabilities;
+		if ((ret = usbtmc_get_capabilities(control_message, &caps)) != USBTMC_NO_ERROR)
+			return ret;
+		*value = caps.device_capabilities;
 		break;
 
 	case OPENTMLIB_ATTRIBUTE_USBTMC_488_INTERFACE_CAPS:
-		usbtmc_get_capabilities(control_message, &caps);
-		value = caps.usb488_interface_capabilities;
+		if ((ret = usbtmc_get_capabilities(control_message, &caps)) != USBTMC_NO_ERROR)
+			return ret;
+		*value = caps.usb488_interface_capabilities;
 		break;
 
 	case OPENTMLIB_ATTRIBUTE_USBTMC_488_DEVICE_CAPS:
-		usbtmc_get_capabilities(control_message, &caps);
-		value = caps.usb488_device_capabilities;
+		if ((ret = usbtmc_get_capabilities(control_message, &caps)) != USBTMC_NO_ERROR)
+			return ret;
+		*value = caps.usb488_device_capabilities;
 		break;
 
 	case OPENTMLIB_ATTRIBUTE_STATUS_BYTE:
-		usbtmc_get_stb(control_message, &value);
-		value = 0;
+		if ((ret = usbtmc_get_stb(control_message, value)) != USBTMC_NO_ERROR)
+			return ret;
 		break;
 		
 	default:
@@ -1287,10 +2840,6 @@ int usbtmc_control_get_attribute(struct usbtmc_io_control *control_message)
 		
 	}
 	
-	/* Write data to I/O buffer to be sent during upcoming read */
-	memcpy(&usbtmc_buffer[0], &value, sizeof(unsigned int));
-	p_device_data->number_of_bytes = sizeof(unsigned int);
-	
 	return USBTMC_NO_ERROR;
 
 }
@@ -1306,13 +2855,13 @@ int usbtmc_clear_out_halt(struct usbtmc_io_control *control_message)
 	PDEBUG("usbtmc_clear_out_halt() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 
 	/* Create pipe and send USB request */
 	pipe = usb_sndctrlpipe(p_device_data->usb_dev, 0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USB_REQ_CLEAR_FEATURE,
 		USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_ENDPOINT, USB_ENDPOINT_HALT,
-		p_device_data->bulk_out_endpoint, usbtmc_buffer, 0, p_device_data->timeout);
+		p_device_data->bulk_out_endpoint, p_device_data->buffer, 0, p_device_data->timeout);
 			
 	if (ret < 0)
 	{
@@ -1335,13 +2884,13 @@ int usbtmc_clear_in_halt(struct usbtmc_io_control *control_message)
 	PDEBUG("usbtmc_clear_in_halt() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 
 	/* Create pipe and send USB request */
 	pipe = usb_sndctrlpipe(p_device_data->usb_dev, 0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USB_REQ_CLEAR_FEATURE,
 		USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_ENDPOINT, USB_ENDPOINT_HALT,
-		p_device_data->bulk_in_endpoint, usbtmc_buffer, 0, p_device_data->timeout);
+		p_device_data->bulk_in_endpoint, p_device_data->buffer, 0, p_device_data->timeout);
 			
 	if (ret < 0)
 	{
@@ -1365,12 +2914,12 @@ int usbtmc_get_capabilities(struct usbtmc_io_control *control_message, struct us
 	PDEBUG("usbtmc_get_capabilities() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 
 	/* Create pipe and send USB request */
 	pipe = usb_rcvctrlpipe(p_device_data->usb_dev, 0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USBTMC_BREQUEST_GET_CAPABILITIES,
-		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 0, 0, usbtmc_buffer, 0x18,
+		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 0, 0, p_device_data->buffer, 0x18,
 		p_device_data->timeout);
 			
 	if (ret < 0)
@@ -1379,22 +2928,22 @@ int usbtmc_get_capabilities(struct usbtmc_io_control *control_message, struct us
 		return ret;
 	}
 			
-	PDEBUG("GET_CAPABILITIES returned %x\n", usbtmc_buffer[0]);
-	PDEBUG("Interface capabilities are %x\n", usbtmc_buffer[4]);
-	PDEBUG("Device capabilities are %x\n", usbtmc_buffer[5]);
-	PDEBUG("USB488 interface capabilities are %x\n", usbtmc_buffer[14]);
-	PDEBUG("USB488 device capabilities are %x\n", usbtmc_buffer[15]);
+	PDEBUG("GET_CAPABILITIES returned %x\n", p_device_data->buffer[0]);
+	PDEBUG("Interface capabilities are %x\n", p_device_data->buffer[4]);
+	PDEBUG("Device capabilities are %x\n", p_device_data->buffer[5]);
+	PDEBUG("USB488 interface capabilities are %x\n", p_device_data->buffer[14]);
+	PDEBUG("USB488 device capabilities are %x\n", p_device_data->buffer[15]);
 		
-	if (usbtmc_buffer[0] != USBTMC_STATUS_SUCCESS)
+	if (p_device_data->buffer[0] != USBTMC_STATUS_SUCCESS)
 	{
-		PDEBUG("GET_CAPABILITIES returned %x\n", usbtmc_buffer[0]);
+		PDEBUG("GET_CAPABILITIES returned %x\n", p_device_data->buffer[0]);
 		return -OPENTMLIB_ERROR_USBTMC_STATUS_UNSUCCESSFUL;
 	}
 
-	caps->interface_capabilities = usbtmc_buffer[4];
-	caps->device_capabilities = usbtmc_buffer[5];
-	caps->usb488_interface_capabilities = usbtmc_buffer[14];
-	caps->usb488_device_capabilities = usbtmc_buffer[15];
+	caps->interface_capabilities = p_device_data->buffer[4];
+	caps->device_capabilities = p_device_data->buffer[5];
+	caps->usb488_interface_capabilities = p_device_data->buffer[14];
+	caps->usb488_device_capabilities = p_device_data->buffer[15];
 
 	return USBTMC_NO_ERROR;
 
@@ -1411,12 +2960,12 @@ int usbtmc_indicator_pulse(struct usbtmc_io_control *control_message)
 	PDEBUG("usbtmc_indicator_pulse() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 
 	/* Create pipe and send USB request */
 	pipe = usb_rcvctrlpipe(p_device_data->usb_dev, 0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USBTMC_BREQUEST_INDICATOR_PULSE,
-		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 0, 0, usbtmc_buffer, 0x01,
+		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 0, 0, p_device_data->buffer, 0x01,
 		p_device_data->timeout);
 		
 	if (ret < 0)
@@ -1425,9 +2974,9 @@ int usbtmc_indicator_pulse(struct usbtmc_io_control *control_message)
 		return ret;
 	}
 
-	if (usbtmc_buffer[0] != USBTMC_STATUS_SUCCESS)
+	if (p_device_data->buffer[0] != USBTMC_STATUS_SUCCESS)
 	{
-		PDEBUG("INDICATOR_PULSE returned %x\n", usbtmc_buffer[0]);
+		PDEBUG("INDICATOR_PULSE returned %x\n", p_device_data->buffer[0]);
 		return -OPENTMLIB_ERROR_USBTMC_STATUS_UNSUCCESSFUL;
 	}
 			
@@ -1446,7 +2995,7 @@ int usbtmc_ren_control(struct usbtmc_io_control *control_message)
 	PDEBUG("usbtmc_ren_control() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 
 	/* Make sure value is in range */
 	if (control_message->value > 1)
@@ -1457,8 +3006,8 @@ int usbtmc_ren_control(struct usbtmc_io_control *control_message)
 	/* Create pipe and send USB request */
 	pipe = usb_rcvctrlpipe(p_device_data->usb_dev, 0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USBTMC_BREQUEST_REN_CONTROL,
-		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, control_message->value, 0, usbtmc_buffer, 0x01,
-		p_device_data->timeout);
+		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, control_message->value, 0, p_device_data->buffer,
+		0x01, p_device_data->timeout);
 
 	if (ret < 0)
 	{
@@ -1466,9 +3015,9 @@ int usbtmc_ren_control(struct usbtmc_io_control *control_message)
 		return ret;
 	}
 
-	if (usbtmc_buffer[0] != USBTMC_STATUS_SUCCESS)
+	if (p_device_data->buffer[0] != USBTMC_STATUS_SUCCESS)
 	{
-		PDEBUG("REN_CONTROL returned %x\n", usbtmc_buffer[0]);
+		PDEBUG("REN_CONTROL returned %x\n", p_device_data->buffer[0]);
 		return -OPENTMLIB_ERROR_USBTMC_STATUS_UNSUCCESSFUL;
 	}
 
@@ -1487,12 +3036,12 @@ int usbtmc_go_to_local(struct usbtmc_io_control *control_message)
 	PDEBUG("usbtmc_go_to_local() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 
 	/* Create pipe and send USB request */
 	pipe = usb_rcvctrlpipe(p_device_data->usb_dev, 0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USBTMC_BREQUEST_GO_TO_LOCAL,
-		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 0, 0, usbtmc_buffer, 0x01,
+		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 0, 0, p_device_data->buffer, 0x01,
 		p_device_data->timeout);
 
 	if (ret < 0)
@@ -1501,9 +3050,9 @@ int usbtmc_go_to_local(struct usbtmc_io_control *control_message)
 		return ret;
 	}
 
-	if (usbtmc_buffer[0] != USBTMC_STATUS_SUCCESS)
+	if (p_device_data->buffer[0] != USBTMC_STATUS_SUCCESS)
 	{
-		PDEBUG("GO_TO_LOCAL returned %x\n", usbtmc_buffer[0]);
+		PDEBUG("GO_TO_LOCAL returned %x\n", p_device_data->buffer[0]);
 		return -OPENTMLIB_ERROR_USBTMC_STATUS_UNSUCCESSFUL;
 	}
 
@@ -1522,12 +3071,12 @@ int usbtmc_local_lockout(struct usbtmc_io_control *control_message)
 	PDEBUG("usbtmc_local_lockout() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 
 	/* Create pipe and send USB request */
 	pipe = usb_rcvctrlpipe(p_device_data->usb_dev, 0);
 	ret = usb_control_msg(p_device_data->usb_dev, pipe, USBTMC_BREQUEST_LOCAL_LOCKOUT,
-		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 0, 0, usbtmc_buffer, 0x01,
+		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 0, 0, p_device_data->buffer, 0x01,
 		p_device_data->timeout);
 
 	if (ret < 0)
@@ -1536,9 +3085,9 @@ int usbtmc_local_lockout(struct usbtmc_io_control *control_message)
 		return ret;
 	}
 
-	if (usbtmc_buffer[0] != USBTMC_STATUS_SUCCESS)
+	if (p_device_data->buffer[0] != USBTMC_STATUS_SUCCESS)
 	{
-		PDEBUG("LOCAL_LOCKOUT returned %x\n", usbtmc_buffer[0]);
+		PDEBUG("LOCAL_LOCKOUT returned %x\n", p_device_data->buffer[0]);
 		return -OPENTMLIB_ERROR_USBTMC_STATUS_UNSUCCESSFUL;
 	}
 
@@ -1556,7 +3105,7 @@ int usbtmc_reset_conf(struct usbtmc_io_control *control_message)
 	PDEBUG("usbtmc_reset_conf() called\n");
 
 	/* Get pointer to private data structure */
-	p_device_data = usbtmc_devs[control_message->minor_number];
+	p_device_data = usbtmc_find(control_message->minor_number);
 
 	/* Reset configuration */
 	ret = usb_reset_configuration(p_device_data->usb_dev);
@@ -1571,6 +3120,95 @@ int usbtmc_reset_conf(struct usbtmc_io_control *control_message)
 
 }
 
+/* sysfs attributes of instrument devices (strings the device doesn't provide read as empty) */
+static ssize_t manufacturer_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+
+	struct usbtmc_device_data *p_device_data = dev_get_drvdata(device);
+
+	return sprintf(buf, "%s\n", p_device_data->usb_dev->manufacturer ? p_device_data->usb_dev->manufacturer : "");
+
+}
+static DEVICE_ATTR_RO(manufacturer);
+
+static ssize_t product_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+
+	struct usbtmc_device_data *p_device_data = dev_get_drvdata(device);
+
+	return sprintf(buf, "%s\n", p_device_data->usb_dev->product ? p_device_data->usb_dev->product : "");
+
+}
+static DEVICE_ATTR_RO(product);
+
+static ssize_t serial_number_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+
+	struct usbtmc_device_data *p_device_data = dev_get_drvdata(device);
+
+	return sprintf(buf, "%s\n", p_device_data->usb_dev->serial ? p_device_data->usb_dev->serial : "");
+
+}
+static DEVICE_ATTR_RO(serial_number);
+
+static ssize_t vendor_id_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+
+	struct usbtmc_device_data *p_device_data = dev_get_drvdata(device);
+
+	return sprintf(buf, "%04x\n", le16_to_cpu(p_device_data->usb_dev->descriptor.idVendor));
+
+}
+static DEVICE_ATTR_RO(vendor_id);
+
+static ssize_t product_id_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+
+	struct usbtmc_device_data *p_device_data = dev_get_drvdata(device);
+
+	return sprintf(buf, "%04x\n", le16_to_cpu(p_device_data->usb_dev->descriptor.idProduct));
+
+}
+static DEVICE_ATTR_RO(product_id);
+
+static struct attribute *usbtmc_attrs[] =
+{
+	&dev_attr_manufacturer.attr,
+	&dev_attr_product.attr,
+	&dev_attr_serial_number.attr,
+	&dev_attr_vendor_id.attr,
+	&dev_attr_product_id.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(usbtmc);
+
+/* Shows the bulk transfer statistics of a device (debugfs) */
+static int usbtmc_stats_show(struct seq_file *s, void *unused)
+{
+
+	struct usbtmc_device_data *p_device_data = s->private;
+	struct usbtmc_stats *stats = &p_device_data->stats;
+	int n;
+
+	seq_printf(s, "transfers: %lld\n", (long long) atomic64_read(&stats->transfers));
+	seq_printf(s, "bytes_in: %lld\n", (long long) atomic64_read(&stats->bytes_in));
+	seq_printf(s, "bytes_out: %lld\n", (long long) atomic64_read(&stats->bytes_out));
+	seq_printf(s, "short_packets: %lld\n", (long long) atomic64_read(&stats->short_packets));
+	seq_printf(s, "timeouts: %lld\n", (long long) atomic64_read(&stats->timeouts));
+	seq_printf(s, "aborts: %lld\n", (long long) atomic64_read(&stats->aborts));
+
+	seq_puts(s, "latency (us):\n");
+	seq_printf(s, "%10s %-10u: %lld\n", "<", 1, (long long) atomic64_read(&stats->latency[0]));
+	for (n = 1; n < USBTMC_LATENCY_BUCKETS - 1; n++)
+		seq_printf(s, "%10u-%-10u: %lld\n", 1U << (n - 1), (1U << n) - 1,
+			(long long) atomic64_read(&stats->latency[n]));
+	seq_printf(s, "%10s %-10u: %lld\n", ">=", 1U << (n - 1), (long long) atomic64_read(&stats->latency[n]));
+
+	return 0;
+
+}
+DEFINE_SHOW_ATTRIBUTE(usbtmc_stats);
+
 /* The probe function is called whenever a device is connected which is serviced by this driver. */
 static int usbtmc_probe(struct usb_interface *intf, const struct usb_device_id *id)
 {
@@ -1588,27 +3226,60 @@ static int usbtmc_probe(struct usb_interface *intf, const struct usb_device_id *
 		goto exit_kmalloc;
 	}
 	
-	/* Find the first free minor number */
-	n = 1;
-	while ((n < USBTMC_MAX_DEVICES) && (usbtmc_devs[n] != NULL))
-		n++;
-	if (n == USBTMC_MAX_DEVICES)
+	/* Allocate I/O buffer of this device */
+	if (!(p_device_data->buffer = kmalloc(USBTMC_SIZE_IOBUFFER, GFP_KERNEL)))
 	{
-		PDEBUG("No free minor number found\n");
-		ret = -ENOMEM;
-		goto exit_cdev_add;
+		PDEBUG("Unable to allocate kernel memory\n");
+		kfree(p_device_data);
+		goto exit_kmalloc;
+	}
+	mutex_init(&p_device_data->io_mutex);
+	mutex_init(&p_device_data->abort_mutex);
+	p_device_data->read_generation = 0;
+	p_device_data->read_active = 0;
+	init_usb_anchor(&p_device_data->anchor);
+	memset(p_device_data->transfers, 0, sizeof(p_device_data->transfers));
+	p_device_data->interrupt_urb = NULL;
+	p_device_data->interrupt_buffer = NULL;
+	p_device_data->interrupt_in_endpoint = 0;
+	spin_lock_init(&p_device_data->notify_lock);
+	init_waitqueue_head(&p_device_data->notify_wait);
+	p_device_data->fasync = NULL;
+	INIT_WORK(&p_device_data->abort_work, usbtmc_abort_work);
+	spin_lock_init(&p_device_data->async_lock);
+	p_device_data->abort_generation = 0;
+
+	/* Asynchronous reads and writes of this device run one after the other, in the order submitted */
+	if (!(p_device_data->async_queue = alloc_ordered_workqueue("usbtmc", 0)))
+	{
+		PDEBUG("Unable to allocate workqueue\n");
+		kfree(p_device_data->buffer);
+		kfree(p_device_data);
+		goto exit_kmalloc;
 	}
 	
-	/* Minor number is now in use */
-	usbtmc_devs[n] = p_device_data;
+	/* Reserve the lowest free minor number (it maps to the private data once that is initialized) */
+	mutex_lock(&usbtmc_minors_lock);
+	n = idr_alloc(&usbtmc_minors, NULL, 1, USBTMC_MAX_DEVICES, GFP_KERNEL);
+	mutex_unlock(&usbtmc_minors_lock);
+	if (n < 0)
+	{
+		PDEBUG("No free minor number found\n");
+		ret = n;
+		goto exit_idr_alloc;
+	}
 	PDEBUG("Using minor number %d\n",n);
-	
-	/* Initialize cdev structure for this character device */
-	memset(&p_device_data->cdev, 0, sizeof(struct cdev));
-	cdev_init(&p_device_data->cdev, &fops);
-	p_device_data->cdev.owner = THIS_MODULE;
-	p_device_data->cdev.ops = &fops;
-	
+
+	/* Allocate cdev structure for this character device */
+	if (!(p_device_data->cdev = cdev_alloc()))
+	{
+		PDEBUG("Unable to allocate kernel memory\n");
+		ret = -ENOMEM;
+		goto exit_cdev_alloc;
+	}
+	p_device_data->cdev->owner = THIS_MODULE;
+	p_device_data->cdev->ops = &fops;
+
 	/* Identify instrument */
 	p_device = interface_to_usbdev(intf);
 	PDEBUG("New device:\n");
@@ -1617,16 +3288,9 @@ static int usbtmc_probe(struct usb_interface *intf, const struct usb_device_id *
 	PDEBUG("Serial number: %s\n", p_device->serial);
 	PDEBUG("Manufacturer code: %hx\n", p_device->descriptor.idVendor);
 	PDEBUG("Product code: %hx\n", p_device->descriptor.idProduct);
-	
+
 	/* Combine major and minor numbers */
 	p_device_data->devno = MKDEV(MAJOR(dev), n);
-		
-	/* Add character device to kernel list */
-	if ((ret = cdev_add(&p_device_data->cdev, p_device_data->devno, 1)))
-	{
-		PDEBUG("Unable to add character device\n");
-		goto exit_cdev_add;
-	}
 
 	/* Store info about USB interface in private data structure */
 	p_device_data->intf = intf;
@@ -1643,21 +3307,76 @@ static int usbtmc_probe(struct usb_interface *intf, const struct usb_device_id *
 	p_device_data->timeout = USBTMC_DEFAULT_TIMEOUT;
 	p_device_data->term_char_enabled = 0;
 	p_device_data->term_char = '\n';
+	p_device_data->set_end_indicator = 1;
+	p_device_data->max_transfer_size = max_transfer_size;
+	if ((p_device_data->max_transfer_size == 0) || (p_device_data->max_transfer_size > INT_MAX))
+		p_device_data->max_transfer_size = USBTMC_DEFAULT_MAX_TRANSFER_SIZE;
 	p_device_data->driver_state = USBTMC_DRV_STATE_CLOSED;
+	atomic_set(&p_device_data->abort_requested, 0);
+	p_device_data->disconnected = 0;
+	memset(&p_device_data->stats, 0, sizeof(struct usbtmc_stats));
+
+	/* Minor number is now in use. From here on, the private data is freed with its last reference. */
+	kref_init(&p_device_data->kref);
+	mutex_lock(&usbtmc_minors_lock);
+	idr_replace(&usbtmc_minors, p_device_data, n);
+	mutex_unlock(&usbtmc_minors_lock);
+
+	/* Add character device to kernel list */
+	if ((ret = cdev_add(p_device_data->cdev, p_device_data->devno, 1)))
+	{
+		PDEBUG("Unable to add character device\n");
+		kobject_put(&p_device_data->cdev->kobj);
+		goto exit_put;
+	}
+
+	/* Publish device node and attributes (udev creates /dev/usbtmc<minor> and the links in /dev/usbtmc) */
+	p_device_data->device = device_create_with_groups(usbtmc_class, &intf->dev, p_device_data->devno,
+		p_device_data, usbtmc_groups, "usbtmc%d", n);
+	if (IS_ERR(p_device_data->device))
+	{
+		PDEBUG("Unable to create class device\n");
+		ret = PTR_ERR(p_device_data->device);
+		cdev_del(p_device_data->cdev);
+		goto exit_put;
+	}
+
+	/* Statistics in debugfs (optional, debugfs may not be available) */
+	p_device_data->debugfs = debugfs_create_dir(dev_name(p_device_data->device), usbtmc_debugfs);
+	debugfs_create_file("stats", 0444, p_device_data->debugfs, p_device_data, &usbtmc_stats_fops);
+
 	return 0;
 
-exit_cdev_add:
+exit_put:
+
+	/* Drop the connection's reference (a control message may still hold one for a moment) */
+	p_device_data->disconnected = 1;
+	usb_set_intfdata(intf, NULL);
+	usbtmc_put(p_device_data);
+	return ret;
+
+exit_cdev_alloc:
+
+	/* Release minor number */
+	mutex_lock(&usbtmc_minors_lock);
+	idr_remove(&usbtmc_minors, n);
+	mutex_unlock(&usbtmc_minors_lock);
+
+exit_idr_alloc:
 
 	/* Free memory for device specific data */
+	destroy_workqueue(p_device_data->async_queue);
+	kfree(p_device_data->buffer);
 	kfree(p_device_data);
 	return ret;
-	
+
 exit_kmalloc:
 	return -ENOMEM;
 
 }
 
-/* The disconnect function is called whenever a device serviced by the driver is disconnected. */
+/* The disconnect function is called whenever a device serviced by the driver is disconnected. Files still
+ * open keep the private data (and the minor number) until they are closed, all they can do is fail. */
 static void usbtmc_disconnect(struct usb_interface *intf)
 {
 
@@ -1668,17 +3387,28 @@ static void usbtmc_disconnect(struct usb_interface *intf)
 	/* Get pointer to private data */
 	p_device_data = usb_get_intfdata(intf);
 
-	/* Remove character device from kernel list */
-	cdev_del(&p_device_data->cdev);
-	
-	/* Decrease use count */
-	usb_get_dev(p_device_data->usb_dev);
-	
-	/* Update array for minor number usage */
-	usbtmc_devs[MINOR(p_device_data->devno)] = NULL;
+	/* Operations fail from now on. End transfers in progress and waits for notifications. */
+	WRITE_ONCE(p_device_data->disconnected, 1);
+	usb_poison_anchored_urbs(&p_device_data->anchor);
+	wake_up_interruptible_all(&p_device_data->notify_wait);
 
-	/* Free memory allocated for private data */
-	kfree(p_device_data);
+	/* Remove statistics, device node and attributes, and character device from kernel list */
+	debugfs_remove_recursive(p_device_data->debugfs);
+	device_destroy(usbtmc_class, p_device_data->devno);
+	cdev_del(p_device_data->cdev);
+
+	/* Complete asynchronous requests still queued (they fail now) */
+	flush_workqueue(p_device_data->async_queue);
+	cancel_work_sync(&p_device_data->abort_work);
+
+	/* Stop listening for notifications (after I/O in progress has ended) */
+	mutex_lock(&p_device_data->io_mutex);
+	usbtmc_free_interrupt(p_device_data);
+	mutex_unlock(&p_device_data->io_mutex);
+
+	/* Drop the connection's reference (frees private data unless files are still open) */
+	usb_set_intfdata(intf, NULL);
+	usbtmc_put(p_device_data);
 
 	return;
 
@@ -1688,14 +3418,10 @@ static void usbtmc_disconnect(struct usb_interface *intf)
 static int usbtmc_init(void)
 {
 
-	int ret, n, devno;
-		
+	int ret, devno;
+
 	PDEBUG("usbtmc_init() called\n");
-	
-	/* Initialize usbtmc_devs array */
-	for (n = 0; n < USBTMC_MAX_DEVICES; n++)
-		usbtmc_devs[n] = NULL;
-	
+
 	/* Dynamically allocate char driver major/minor numbers */
 	if ((ret = alloc_chrdev_region(&dev, 0, USBTMC_MAX_DEVICES, "USBTMCCHR")))
 	{
@@ -1704,40 +3430,82 @@ static int usbtmc_init(void)
 	}
 
 	PDEBUG("Using major number %d\n", MAJOR(dev));
-	
-	/* Allocate I/O buffer */
-	if (!(usbtmc_buffer = kmalloc(USBTMC_SIZE_IOBUFFER, GFP_KERNEL)))
+
+	/* Register device class (sysfs and udev) */
+	usbtmc_class = class_create("usbtmc");
+	if (IS_ERR(usbtmc_class))
+	{
+		PDEBUG("Unable to create device class\n");
+		ret = PTR_ERR(usbtmc_class);
+		goto exit_class_create;
+	}
+
+	/* Allocate private data structure for minor number 0 */
+	if (!(usbtmc_control = kmalloc(sizeof(struct usbtmc_device_data), GFP_KERNEL)))
 	{
 		PDEBUG("Unable to allocate kernel memory\n");
 		ret = -ENOMEM;
 		goto exit_kmalloc;
 	}
-	
-	/* Allocate private data structure for minor number 0 */
-	if (!(usbtmc_devs[0] = kmalloc(sizeof(struct usbtmc_device_data), GFP_KERNEL)))
+
+	/* Allocate I/O buffer (holds control message responses) */
+	if (!(usbtmc_control->buffer = kmalloc(USBTMC_SIZE_IOBUFFER, GFP_KERNEL)))
 	{
 		PDEBUG("Unable to allocate kernel memory\n");
 		ret = -ENOMEM;
 		goto exit_kmalloc_2;
 	}
-	
-	/* Initialize relevant fields in private data structure */
-	usbtmc_devs[0]->driver_state = USBTMC_DRV_STATE_CLOSED;
-	
-	/* Initialize cdev structure for minor number 0. */
-	memset(&usbtmc_devs[0]->cdev, 0, sizeof(struct cdev));
-	cdev_init(&usbtmc_devs[0]->cdev, &fops);
-	usbtmc_devs[0]->cdev.owner = THIS_MODULE;
-	usbtmc_devs[0]->cdev.ops = &fops;
-		
-	/* Add character device to kernel list */
+
+	/* Initialize relevant fields in private data structure (the initial reference is never dropped, the
+	 * private data of minor number 0 is freed by usbtmc_exit) */
 	devno = MKDEV(MAJOR(dev), 0);
-	if ((ret = cdev_add(&usbtmc_devs[0]->cdev, devno, 1)))
+	usbtmc_control->devno = devno;
+	usbtmc_control->driver_state = USBTMC_DRV_STATE_CLOSED;
+	usbtmc_control->number_of_bytes = 0;
+	usbtmc_control->disconnected = 0;
+	mutex_init(&usbtmc_control->io_mutex);
+	mutex_init(&usbtmc_control->abort_mutex);
+	usbtmc_control->read_generation = 0;
+	usbtmc_control->read_active = 0;
+	atomic_set(&usbtmc_control->abort_requested, 0);
+	kref_init(&usbtmc_control->kref);
+
+	/* Minor number 0 is in use */
+	if ((ret = idr_alloc(&usbtmc_minors, usbtmc_control, 0, 1, GFP_KERNEL)) < 0)
+	{
+		PDEBUG("Unable to allocate minor number 0\n");
+		goto exit_idr_alloc;
+	}
+
+	/* Allocate cdev structure for minor number 0 */
+	if (!(usbtmc_control->cdev = cdev_alloc()))
+	{
+		PDEBUG("Unable to allocate kernel memory\n");
+		ret = -ENOMEM;
+		goto exit_cdev_alloc;
+	}
+	usbtmc_control->cdev->owner = THIS_MODULE;
+	usbtmc_control->cdev->ops = &fops;
+
+	/* Add character device to kernel list */
+	if ((ret = cdev_add(usbtmc_control->cdev, devno, 1)))
 	{
 		PDEBUG("Unable to add character device\n");
-		goto exit_cdev_add;
+		kobject_put(&usbtmc_control->cdev->kobj);
+		goto exit_cdev_alloc;
+	}
+
+	/* Device node of minor number 0 */
+	if (IS_ERR(device_create(usbtmc_class, NULL, devno, NULL, "usbtmc0")))
+	{
+		PDEBUG("Unable to create class device\n");
+		ret = -ENOMEM;
+		goto exit_device_create;
 	}
 
+	/* debugfs directory for the instruments' statistics */
+	usbtmc_debugfs = debugfs_create_dir("usbtmc", NULL);
+
 	PDEBUG("Registering USB driver\n");
 
 	/* Register USB driver with USB core */
@@ -1747,27 +3515,38 @@ static int usbtmc_init(void)
 		PDEBUG("Unable to register driver\n");
 		goto exit_usb_register;
 	}
-	
-	usbtmc_devs[0]->devno = devno;
 
 	return 0; /* So far so good */
-	
+
 exit_usb_register:
+	/* Remove debugfs directory and device node of minor number 0 */
+	debugfs_remove_recursive(usbtmc_debugfs);
+	device_destroy(usbtmc_class, devno);
+
+exit_device_create:
 	/* Remove character device driver from kernel list */
-	cdev_del(&usbtmc_devs[0]->cdev);
-	
-exit_cdev_add:
-	/* Free private data area for minor number 0 */
-	kfree(usbtmc_devs[0]);
-	
+	cdev_del(usbtmc_control->cdev);
+
+exit_cdev_alloc:
+	/* Release minor number 0 */
+	idr_remove(&usbtmc_minors, 0);
+
+exit_idr_alloc:
+	/* Free I/O buffer of minor number 0 */
+	kfree(usbtmc_control->buffer);
+
 exit_kmalloc_2:
-	/* Free driver buffer */
-	kfree(usbtmc_buffer);
-	
+	/* Free private data area for minor number 0 */
+	kfree(usbtmc_control);
+
 exit_kmalloc:
+	/* Unregister device class */
+	class_destroy(usbtmc_class);
+
+exit_class_create:
 	/* Unregister char driver major/minor numbers */
 	unregister_chrdev_region(dev, USBTMC_MAX_DEVICES);
-	
+
 exit_alloc_chrdev_region:
 	return ret;
 
@@ -1778,20 +3557,24 @@ static void usbtmc_exit(void)
 {
 
 	PDEBUG("usbtmc_exit() called\n");
-	
+
+	/* Unregister USB driver with USB core (disconnects the instruments, their private data is gone with
+	 * them as no file can be open while the module is unloaded) */
+	usb_deregister(&usbtmc_driver);
+	debugfs_remove_recursive(usbtmc_debugfs);
+
+	/* Remove device node and character device of minor number 0, and device class */
+	device_destroy(usbtmc_class, MKDEV(MAJOR(dev), 0));
+	cdev_del(usbtmc_control->cdev);
+	class_destroy(usbtmc_class);
+
+	/* Free memory for device-specific data (and I/O buffer) allocated in usbtmc_init */
+	kfree(usbtmc_control->buffer);
+	kfree(usbtmc_control);
+	idr_destroy(&usbtmc_minors);
+
 	/* Unregister char driver major/minor numbers */
 	unregister_chrdev_region(dev, USBTMC_MAX_DEVICES);
-	
-	/* Release IO buffer allocated in usbtmc_init */
-	if (usbtmc_buffer != NULL)
-		kfree(usbtmc_buffer);
-	
-	/* Free memory for device-specific data */
-	if (usbtmc_devs[0] != NULL)
-		kfree(usbtmc_devs[0]);
-	
-	/* Unregister USB driver with USB core */
-	usb_deregister(&usbtmc_driver);
 
 }
 
@@ -19,8 +19,9 @@
  * http://www.gnu.org/copyleft/gpl.html.
  */
 
-/* Maximum number of devices serviced by this driver */
-#define USBTMC_MAX_DEVICES			 						32
+/* Number of minor numbers reserved by this driver (minor number 0 is the control device). Minor numbers
+ * are allocated when an instrument is connected, so this only limits how many can be connected at once. */
+#define USBTMC_MAX_DEVICES			 						1024
 
 #define USBTMC_SHORT_STR_LEN								20
 #define USBTMC_LONG_STR_LEN									200
@@ -69,4 +70,27 @@ struct usbtmc_io_control
 #define USBTMC_CONTROL_REPORT_INSTRUMENT					3
 #define USBTMC_CONTROL_IO_OPERATION							4
 
+/* This structure is used with USBTMC_IOCTL_SET_ATTRIBUTE and USBTMC_IOCTL_GET_ATTRIBUTE. */
+struct usbtmc_ioctl_attribute
+{
+	unsigned int attribute;
+	unsigned int value; /* Set by the driver for USBTMC_IOCTL_GET_ATTRIBUTE */
+};
+
+/* This structure is used with USBTMC_IOCTL_IO_OPERATION. */
+struct usbtmc_ioctl_operation
+{
+	unsigned int operation;
+	unsigned int value;
+};
+
+/* ioctl commands (sent to the instrument's own minor number, one call per operation) */
+#define USBTMC_IOCTL_MAGIC									'O'
+#define USBTMC_IOCTL_SET_ATTRIBUTE							_IOW(USBTMC_IOCTL_MAGIC, 1, struct usbtmc_ioctl_attribute)
+#define USBTMC_IOCTL_GET_ATTRIBUTE							_IOWR(USBTMC_IOCTL_MAGIC, 2, struct usbtmc_ioctl_attribute)
+#define USBTMC_IOCTL_IO_OPERATION							_IOW(USBTMC_IOCTL_MAGIC, 3, struct usbtmc_ioctl_operation)
+#define USBTMC_IOCTL_READ_STB								_IOR(USBTMC_IOCTL_MAGIC, 4, unsigned int)
+#define USBTMC_IOCTL_GET_CAPABILITIES						_IOR(USBTMC_IOCTL_MAGIC, 5, struct usbtmc_dev_capabilities)
+#define USBTMC_IOCTL_WAIT_SRQ								_IOR(USBTMC_IOCTL_MAGIC, 6, unsigned int) /* Returns STB */
+
 #define USBTMC_NO_ERROR										0
@@ -0,0 +1,97 @@
+/*
+ * usbtmc_trace.h (tracepoints of the kernel driver for USBTMC devices)
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM usbtmc
+
+#if !defined(USBTMC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define USBTMC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* A bulk transfer was handed to the host controller. bTag is the one of the USBTMC message the transfer
+ * belongs to (for bulk in transfers, the one of the REQUEST_DEV_DEP_MSG_IN answered). */
+TRACE_EVENT(usbtmc_bulk_submit,
+
+	TP_PROTO(unsigned int minor, int in, u8 tag, unsigned int length),
+
+	TP_ARGS(minor, in, tag, length),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(int, in)
+		__field(u8, tag)
+		__field(unsigned int, length)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->in = in;
+		__entry->tag = tag;
+		__entry->length = length;
+	),
+
+	TP_printk("usbtmc%u %s bTag=%u length=%u", __entry->minor, __entry->in ? "in" : "out", __entry->tag,
+		__entry->length)
+);
+
+/* A bulk transfer ended (status 0 = success). Duration is the time from submission to the end of the
+ * wait for it, so it includes the time the instrument took to respond. */
+TRACE_EVENT(usbtmc_bulk_complete,
+
+	TP_PROTO(unsigned int minor, int in, u8 tag, unsigned int length, unsigned int actual, int status,
+		u64 duration_us),
+
+	TP_ARGS(minor, in, tag, length, actual, status, duration_us),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(int, in)
+		__field(u8, tag)
+		__field(unsigned int, length)
+		__field(unsigned int, actual)
+		__field(int, status)
+		__field(u64, duration_us)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->in = in;
+		__entry->tag = tag;
+		__entry->length = length;
+		__entry->actual = actual;
+		__entry->status = status;
+		__entry->duration_us = duration_us;
+	),
+
+	TP_printk("usbtmc%u %s bTag=%u length=%u actual=%u status=%d duration=%llu us", __entry->minor,
+		__entry->in ? "in" : "out", __entry->tag, __entry->length, __entry->actual, __entry->status,
+		__entry->duration_us)
+);
+
+#endif /* USBTMC_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE usbtmc_trace
+#include <trace/define_trace.h>
@@ -19,17 +19,21 @@
  * http://www.gnu.org/copyleft/gpl.html.
  */
 
+
 #include <string>
 #include <iostream>
 #include <string.h>
 #include <stdexcept>
 #include <stdio.h>
 #include <fcntl.h>
-#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include "usbtmc_session.hpp"
-#include "usbtmc/usbtmc.h"
 
 using namespace std;
 
@@ -37,238 +41,252 @@ usbtmc_session::usbtmc_session(unsigned short int mfg_id, unsigned short int mod
 	bool lock, unsigned int lock_timeout, io_monitor *monitor)
 {
 
-	int ret;
-
 	if (lock == true)
 	{
 		throw_opentmlib_error(-OPENTMLIB_ERROR_LOCKING_NOT_SUPPORTED);
 	}
 
-	if ((usbtmc_ko_fd = open("/dev/usbtmc0", O_RDWR)) == -1)
-	{
-		throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_OPEN);
-	}
+	open_device(find_instrument("", "", serial_number, mfg_id, model), monitor);
 
-	struct usbtmc_io_control control_msg;
-	struct usbtmc_instrument instrument_data;
-	int minor = 1;
+	return;
 
-	do
+}
+
+usbtmc_session::usbtmc_session(string manufacturer, string product, string serial_number, bool lock,
+	unsigned int lock_timeout, io_monitor *monitor)
+{
+
+	if (lock == true)
 	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_LOCKING_NOT_SUPPORTED);
+	}
 
-		// Fill control_msg structure
-		control_msg.minor_number = 0;
-		control_msg.command = USBTMC_CONTROL_REPORT_INSTRUMENT;
-		control_msg.argument = minor;
+	open_device(find_instrument(manufacturer, product, serial_number, -1, -1), monitor);
 
-		// Send control message to USBTMC driver
-		if ((ret = write(usbtmc_ko_fd, &control_msg, sizeof(struct usbtmc_io_control))) != sizeof(struct usbtmc_io_control))
-		{
-			if (ret == -OPENTMLIB_ERROR_USBTMC_MINOR_NUMBER_UNUSED)
-				goto try_next;
-			close(usbtmc_ko_fd);
-			throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_WRITE);
-		}
+	return;
 
-		// Read response from USBTMC driver
-		if (read(usbtmc_ko_fd, &instrument_data, sizeof(struct usbtmc_instrument)) != sizeof(struct usbtmc_instrument))
-		{
-			close(usbtmc_ko_fd);
-			throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_READ);
-		}
+}
 
-		{
+usbtmc_session::usbtmc_session(int minor, bool lock, unsigned int lock_timeout, io_monitor *monitor)
+{
+
+	if (lock == true)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_LOCKING_NOT_SUPPORTED);
+	}
 
-			int serial_length = (serial_number.length() <  strlen(instrument_data.serial_number) ?
-				serial_number.length() : strlen(instrument_data.serial_number));
-			string serial_number_found(instrument_data.serial_number, serial_length);
-			if (serial_number != serial_number_found)
-				goto try_next;
-			if (mfg_id != instrument_data.manufacturer_code)
-				goto try_next;
-			if (model != instrument_data.product_code)
-				goto try_next;
+	// Make sure minor number is in range
+	if ((minor <= 0) || (minor >= USBTMC_MAX_DEVICES))
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_MINOR_OUT_OF_RANGE);
+	}
 
-		}
+	open_device(minor, monitor);
 
-		// Found it! Open this device's minor number
-		minor_number = minor;
-		char device_file[20];
-		sprintf(device_file, "/dev/usbtmc%d", minor);
-		if ((device_fd = open(device_file, O_RDWR)) == -1)
-		{
-			close(usbtmc_ko_fd);
-			throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_OPEN);
-		}
+	return;
 
-		// Initialize member variables
-		timeout = 5; // 5 s
-		term_char_enable = 1; // Termination character enabled
-		term_character = '\n';
-		eol_char = '\n';
-		string_size = 200;
-		throw_on_scpi_error = 1;
-		tracing = 0;
-		this->monitor = monitor;
-
-		close(usbtmc_ko_fd);
-		return;
+}
 
-try_next:
+usbtmc_session::~usbtmc_session()
+{
 
-		minor_number++;
+	// Send writes still held back by coalescing (errors can't be reported any more)
+	try
+	{
+		flush();
+	}
 
+	catch (opentmlib_exception & e)
+	{
 	}
-	while (minor_number <= USBTMC_MAX_DEVICES);
 
-	// Didn't find the device...
-	close(usbtmc_ko_fd);
-	throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_DEVICE_NOT_FOUND);
+	// Close special file
+	close(device_fd);
+	return;
 
 }
 
-usbtmc_session::usbtmc_session(string manufacturer, string product, string serial_number, bool lock,
-	unsigned int lock_timeout, io_monitor *monitor)
+// Reads one of the identity attributes the driver publishes for an instrument (without the newline)
+bool usbtmc_session::read_identity(int minor, const char *attribute, string & value)
 {
 
-	int ret;
+	char path[100], buffer[USBTMC_LONG_STR_LEN];
+	int fd, count;
 
-	if (lock == true)
+	snprintf(path, sizeof(path), USBTMC_SESSION_SYSFS_CLASS "/usbtmc%d/%s", minor, attribute);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
 	{
-		throw_opentmlib_error(-OPENTMLIB_ERROR_LOCKING_NOT_SUPPORTED);
+		return false;
 	}
-
-	if ((usbtmc_ko_fd = open("/dev/usbtmc0", O_RDWR)) == -1)
+	count = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (count < 0)
 	{
-		throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_OPEN);
+		return false;
 	}
 
-	struct usbtmc_io_control control_msg;
-	struct usbtmc_instrument instrument_data;
-	int minor = 1;
-
-	do
-	{
+	if ((count > 0) && (buffer[count - 1] == '\n'))
+		count--;
+	value.assign(buffer, count);
 
-		// Fill control_msg structure
-		control_msg.minor_number = 0;
-		control_msg.command = USBTMC_CONTROL_REPORT_INSTRUMENT;
-		control_msg.argument = minor;
+	return true;
 
-		// Send control message to USBTMC driver
-		if ((ret = write(usbtmc_ko_fd, &control_msg, sizeof(struct usbtmc_io_control))) != sizeof(struct usbtmc_io_control))
-		{
-			if (ret == -OPENTMLIB_ERROR_USBTMC_MINOR_NUMBER_UNUSED)
-				goto try_next;
-			close(usbtmc_ko_fd);
-			throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_WRITE);
-		}
+}
 
-		// Read response from USBTMC driver
-		if (read(usbtmc_ko_fd, &instrument_data, sizeof(struct usbtmc_instrument)) != sizeof(struct usbtmc_instrument))
-		{
-			close(usbtmc_ko_fd);
-			throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_READ);
-		}
+// Compares an instrument against the one wanted (see find_instrument)
+bool usbtmc_session::instrument_matches(int minor, string manufacturer, string product, string serial_number,
+	int mfg_id, int model)
+{
 
-		{
+	string manufacturer_found, product_found, serial_number_found, id;
 
-			// Convert strings and compare against wanted instrument
-			int manufacturer_length = (manufacturer.length() <  strlen(instrument_data.manufacturer) ?
-				manufacturer.length() : strlen(instrument_data.manufacturer));
-			int product_length = (product.length() <  strlen(instrument_data.product) ?
-					product.length() : strlen(instrument_data.product));
-			int serial_length = (serial_number.length() <  strlen(instrument_data.serial_number) ?
-					serial_number.length() : strlen(instrument_data.serial_number));
-			string manufacturer_found(instrument_data.manufacturer, manufacturer_length);
-			string product_found(instrument_data.product, product_length);
-			string serial_number_found(instrument_data.serial_number, serial_length);
-			if (manufacturer != manufacturer_found)
-				goto try_next;
-			if (product != product_found)
-				goto try_next;
-			if (serial_number != serial_number_found)
-				goto try_next;
+	if (!read_identity(minor, "manufacturer", manufacturer_found) ||
+		!read_identity(minor, "product", product_found) ||
+		!read_identity(minor, "serial_number", serial_number_found))
+		return false;
 
-		}
+	if (manufacturer_found.compare(0, manufacturer.length(), manufacturer) != 0)
+		return false;
+	if (product_found.compare(0, product.length(), product) != 0)
+		return false;
+	if (serial_number_found.compare(0, serial_number.length(), serial_number) != 0)
+		return false;
+	if ((mfg_id != -1) && (!read_identity(minor, "vendor_id", id) || (strtol(id.c_str(), NULL, 16) != mfg_id)))
+		return false;
+	if ((model != -1) && (!read_identity(minor, "product_id", id) || (strtol(id.c_str(), NULL, 16) != model)))
+		return false;
 
-		// Found it! Open this device's minor number
-		minor_number = minor;
-		char device_file[20];
-		sprintf(device_file, "/dev/usbtmc%d", minor);
-		if ((device_fd = open(device_file, O_RDWR)) == -1)
-		{
-			close(usbtmc_ko_fd);
-			throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_OPEN);
-		}
+	return true;
 
-		// Initialize member variables
-		timeout = 5; // 5 s
-		term_char_enable = 1; // Termination character enabled
-		term_character = '\n';
-		eol_char = '\n';
-		string_size = 200;
-		throw_on_scpi_error = 1;
-		tracing = 0;
-		this->monitor = monitor;
-
-		close(usbtmc_ko_fd);
-		return;
+}
 
-try_next:
+// Looks for an instrument (strings are compared up to the length given, "" matches anything, IDs of -1
+// too) among the ones the driver publishes in sysfs. A complete serial number leads straight to the
+// instrument through the link udev creates for it (see usbtmc/99-usbtmc.rules). Returns its minor number.
+int usbtmc_session::find_instrument(string manufacturer, string product, string serial_number, int mfg_id,
+	int model)
+{
 
-		minor_number++;
+	struct stat status;
+	DIR *directory;
+	struct dirent *entry;
+	int minor, found;
 
+	// udev replaces other characters in link names
+	if ((serial_number != "") &&
+		(serial_number.find_first_not_of(USBTMC_SESSION_LINK_CHARACTERS) == string::npos) &&
+		(stat((USBTMC_SESSION_SERIAL_LINKS + serial_number).c_str(), &status) == 0) && S_ISCHR(status.st_mode))
+	{
+		minor = minor(status.st_rdev);
+		if (instrument_matches(minor, manufacturer, product, serial_number, mfg_id, model))
+			return minor;
 	}
-	while (minor_number <= USBTMC_MAX_DEVICES);
-
-	// Didn't find the device...
-	close(usbtmc_ko_fd);
-	throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_DEVICE_NOT_FOUND);
 
-}
-
-usbtmc_session::usbtmc_session(int minor, bool lock, unsigned int lock_timeout, io_monitor *monitor)
-{
+	if ((directory = opendir(USBTMC_SESSION_SYSFS_CLASS)) == NULL)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_DEVICE_NOT_FOUND);
+	}
 
-	if (lock == true)
+	// Lowest minor number wins if several instruments match
+	found = -1;
+	while ((entry = readdir(directory)) != NULL)
 	{
-		throw_opentmlib_error(-OPENTMLIB_ERROR_LOCKING_NOT_SUPPORTED);
+		if ((sscanf(entry->d_name, "usbtmc%d", &minor) != 1) || (minor <= 0))
+			continue;
+		if (((found == -1) || (minor < found)) &&
+			instrument_matches(minor, manufacturer, product, serial_number, mfg_id, model))
+			found = minor;
 	}
+	closedir(directory);
 
-	// Make sure minor number is in range
-	if ((minor == 0) || (minor > USBTMC_MAX_DEVICES))
+	if (found == -1)
 	{
-		throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_MINOR_OUT_OF_RANGE);
+		throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_DEVICE_NOT_FOUND);
 	}
 
-	// Open device driver
+	return found;
+
+}
+
+void usbtmc_session::open_device(int minor, io_monitor *monitor)
+{
+
+	// Open this device's minor number
 	char device_file[20];
 	sprintf(device_file, "/dev/usbtmc%d", minor);
-	if ((device_fd = open(device_file, O_RDWR)) == -1)
+	if ((device_fd = open(device_file, O_RDWR | O_CLOEXEC)) == -1)
 	{
 		throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_OPEN);
 	}
+	minor_number = minor;
 
 	// Initialize member variables
-	timeout = 5; // 5 s
-	term_char_enable = 1; // Termination character enabled
+	timeout_ms = 5000; // 5 s
+	term_char_enable = 0; // Termination character disabled (needs instrument support)
 	term_character = '\n';
+	set_end_indicator = 1;
 	eol_char = '\n';
 	string_size = 200;
 	throw_on_scpi_error = 1;
 	tracing = 0;
 	this->monitor = monitor;
+	capabilities_valid = false;
+
+	// The driver keeps its settings between sessions. Setting them here makes the copies kept by the
+	// session (used by get_attribute) match the driver.
+	try
+	{
+		set_driver_attribute(OPENTMLIB_ATTRIBUTE_TIMEOUT_MS, timeout_ms);
+		set_driver_attribute(OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE, term_char_enable);
+		set_driver_attribute(OPENTMLIB_ATTRIBUTE_TERM_CHARACTER, term_character);
+		set_driver_attribute(OPENTMLIB_ATTRIBUTE_SET_END_INDICATOR, set_end_indicator);
+	}
+
+	catch (opentmlib_exception & e)
+	{
+		close(device_fd);
+		throw e;
+	}
 
 	return;
 
 }
 
-usbtmc_session::~usbtmc_session()
+// Sends an ioctl command to the instrument's special file
+void usbtmc_session::device_ioctl(unsigned long request, void *argument)
 {
 
-	// Close special file
-	close(device_fd);
+	int ret;
+
+	ret = ioctl(device_fd, request, argument);
+
+	if (ret < 0)
+	{
+		if (ret == -1)
+		{
+			// Driver returned a standard error number in errno
+			throw_opentmlib_error(-errno);
+		}
+		else
+		{
+			// Driver returned a non-standard error number, errno is not set
+			throw_opentmlib_error(ret);
+		}
+	}
+
+	return;
+
+}
+
+void usbtmc_session::set_driver_attribute(unsigned int attribute, unsigned int value)
+{
+
+	struct usbtmc_ioctl_attribute driver_attribute;
+
+	driver_attribute.attribute = attribute;
+	driver_attribute.value = value;
+	device_ioctl(USBTMC_IOCTL_SET_ATTRIBUTE, &driver_attribute);
+
 	return;
 
 }
@@ -278,6 +296,8 @@ int usbtmc_session::write_buffer(char *buffer, int count)
 
 	int ret;
 
+	flush(); // Writes held back by coalescing go first
+
 	// Write buffer to special file
 	ret = write(device_fd, buffer, count);
 
@@ -306,13 +326,19 @@ int usbtmc_session::read_buffer(char *buffer, int max)
 
 	int ret;
 
+	flush(); // Held back writes (the command this read is for) go first
+
 	// Read from special file
 	ret = read(device_fd, buffer, max);
 
 	if (ret < 0)
 	{
 		int save_errno = errno;
-		io_operation(OPENTMLIB_OPERATION_USBTMC_ABORT_READ, 0);
+		if ((ret != -OPENTMLIB_ERROR_TRANSACTION_ABORTED) && (save_errno != OPENTMLIB_ERROR_TRANSACTION_ABORTED))
+		{
+			// Bulk in is still out of sync (an abort request leaves the endpoint clean)
+			io_operation(OPENTMLIB_OPERATION_USBTMC_ABORT_READ, 0);
+		}
 		if (ret == -1)
 		{
 			// Driver returned a standard error number in errno
@@ -332,8 +358,7 @@ int usbtmc_session::read_buffer(char *buffer, int max)
 void usbtmc_session::set_attribute(unsigned int attribute, unsigned int value)
 {
 
-	struct usbtmc_io_control control_msg;
-	int ret;
+	unsigned int old_timeout;
 
 	// Check if attribute is known to parent class
 	try
@@ -370,36 +395,45 @@ void usbtmc_session::set_attribute(unsigned int attribute, unsigned int value)
 		eol_char = value;
 		return;
 
-	}
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT:
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT_MS:
+		// Driver takes ms either way
+		old_timeout = timeout_ms;
+		set_timeout(attribute, value);
+		try
+		{
+			set_driver_attribute(OPENTMLIB_ATTRIBUTE_TIMEOUT_MS, timeout_ms);
+		}
 
-	control_msg.minor_number = minor_number;
-	control_msg.command = USBTMC_CONTROL_SET_ATTRIBUTE;
-	control_msg.argument = attribute;
-	control_msg.value = value;
+		catch (opentmlib_exception & e)
+		{
+			timeout_ms = old_timeout;
+			throw e;
+		}
+		return;
 
-	if ((usbtmc_ko_fd = open("/dev/usbtmc0", O_RDWR)) == -1)
-	{
-		throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_OPEN);
 	}
 
-	// Send control message to USBTMC driver
-	ret = write(usbtmc_ko_fd, &control_msg, sizeof(struct usbtmc_io_control));
-	if (ret < 0)
+	// Session keeps a copy of what the driver accepted
+	set_driver_attribute(attribute, value);
+
+	switch (attribute)
 	{
-		close(usbtmc_ko_fd);
-		if (ret == -1)
-		{
-			// Driver returned a standard error number in errno
-			throw_opentmlib_error(-errno);
-		}
-		else
-		{
-			// Driver returned a non-standard error number, errno is not set
-			throw_opentmlib_error(ret);
-		}
+
+	case OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE:
+		term_char_enable = value;
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_TERM_CHARACTER:
+		term_character = value;
+		break;
+
+	case OPENTMLIB_ATTRIBUTE_SET_END_INDICATOR:
+		set_end_indicator = value;
+		break;
+
 	}
 
-	close(usbtmc_ko_fd);
 	return;
 
 }
@@ -407,13 +441,12 @@ void usbtmc_session::set_attribute(unsigned int attribute, unsigned int value)
 unsigned int usbtmc_session::get_attribute(unsigned int attribute)
 {
 
-	struct usbtmc_io_control control_msg;
-	int ret;
+	struct usbtmc_ioctl_attribute driver_attribute;
+	unsigned int value;
 
 	// Check if attribute is known to parent class
 	try
 	{
-		unsigned int value;
 		value = base_get_attribute(attribute);
 		return value;
 	}
@@ -436,96 +469,162 @@ unsigned int usbtmc_session::get_attribute(unsigned int attribute)
 	case OPENTMLIB_ATTRIBUTE_TRACING:
 		return tracing;
 
-	}
+	// Driver settings are answered from the copies kept by the session
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT:
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT_MS:
+		return get_timeout(attribute);
 
-	control_msg.minor_number = minor_number;
-	control_msg.command = USBTMC_CONTROL_GET_ATTRIBUTE;
-	control_msg.argument = attribute;
+	case OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE:
+		return term_char_enable;
 
-	if ((usbtmc_ko_fd = open("/dev/usbtmc0", O_RDWR)) == -1)
-	{
-		throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_OPEN);
-	}
+	case OPENTMLIB_ATTRIBUTE_TERM_CHARACTER:
+		return term_character;
 
-	// Send control message to USBTMC driver
-	ret = write(usbtmc_ko_fd, &control_msg, sizeof(struct usbtmc_io_control));
-	if (ret < 0)
-	{
-		close(usbtmc_ko_fd);
-		if (ret == -1)
-		{
-			// Driver returned a standard error number in errno
-			throw_opentmlib_error(-errno);
-		}
-		else
-		{
-			// Driver returned a non-standard error number, errno is not set
-			throw_opentmlib_error(ret);
-		}
-	}
+	case OPENTMLIB_ATTRIBUTE_SET_END_INDICATOR:
+		return set_end_indicator;
 
-	// Read response from USBTMC driver
-	unsigned int value;
-	ret = read(usbtmc_ko_fd, &value, sizeof(unsigned int));
-	if (ret < 0)
-	{
-		close(usbtmc_ko_fd);
-		if (ret == -1)
+	// Capabilities don't change, they are asked for once
+	case OPENTMLIB_ATTRIBUTE_USBTMC_INTERFACE_CAPS:
+	case OPENTMLIB_ATTRIBUTE_USBTMC_DEVICE_CAPS:
+	case OPENTMLIB_ATTRIBUTE_USBTMC_488_INTERFACE_CAPS:
+	case OPENTMLIB_ATTRIBUTE_USBTMC_488_DEVICE_CAPS:
+		if (capabilities_valid == false)
 		{
-			// Driver returned a standard error number in errno
-			throw_opentmlib_error(-errno);
+			device_ioctl(USBTMC_IOCTL_GET_CAPABILITIES, &capabilities);
+			capabilities_valid = true;
 		}
-		else
+		switch (attribute)
 		{
-			// Driver returned a non-standard error number, errno is not set
-			throw_opentmlib_error(ret);
+		case OPENTMLIB_ATTRIBUTE_USBTMC_INTERFACE_CAPS:
+			return (unsigned char) capabilities.interface_capabilities;
+		case OPENTMLIB_ATTRIBUTE_USBTMC_DEVICE_CAPS:
+			return (unsigned char) capabilities.device_capabilities;
+		case OPENTMLIB_ATTRIBUTE_USBTMC_488_INTERFACE_CAPS:
+			return (unsigned char) capabilities.usb488_interface_capabilities;
+		default:
+			return (unsigned char) capabilities.usb488_device_capabilities;
 		}
-	}
-	if (ret != sizeof(unsigned int))
-	{
-		close(usbtmc_ko_fd);
-		throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_READ_LESS_THAN_EXPECTED);
+
+	case OPENTMLIB_ATTRIBUTE_STATUS_BYTE:
+		device_ioctl(USBTMC_IOCTL_READ_STB, &value);
+		return value;
+
 	}
 
-	close(usbtmc_ko_fd);
-	return value; // No error
+	// Anything else goes to the driver
+	driver_attribute.attribute = attribute;
+	device_ioctl(USBTMC_IOCTL_GET_ATTRIBUTE, &driver_attribute);
+
+	return driver_attribute.value; // No error
 
 }
 
 void usbtmc_session::io_operation(unsigned int operation, unsigned int value)
 {
 
-	struct usbtmc_io_control control_msg;
+	struct usbtmc_ioctl_operation driver_operation;
+
+	flush_for_operation(operation);
+
+	driver_operation.operation = operation;
+	driver_operation.value = value;
+	device_ioctl(USBTMC_IOCTL_IO_OPERATION, &driver_operation);
+
+	return; // No error
+
+}
+
+// Service requests arrive on the instrument's interrupt IN endpoint, where the driver latches them (a
+// service request received before the call is returned right away)
+unsigned int usbtmc_session::wait_srq()
+{
+
+	unsigned int value;
+
+	device_ioctl(USBTMC_IOCTL_WAIT_SRQ, &value);
+
+	return value;
+
+}
+
+int usbtmc_session::get_fd()
+{
+
+	return device_fd;
+
+}
+
+// Reads the binblock payload into the file's pages without copying: the file is extended to its final
+// size and mapped a window at a time, and the driver has the USB host controller write to the mapped
+// pages (large reads, see usbtmc_direct_transfer in the driver). Descriptors that can't be mapped for
+// writing (pipes, files not open for reading) get the buffered copy.
+void usbtmc_session::read_to_file(int fd, off_t length)
+{
+
+	struct stat status;
+	char *window;
+	off_t start, position, end, window_start;
+	size_t window_length, chunk, done;
+	long page_size;
 	int ret;
 
-	control_msg.minor_number = minor_number;
-	control_msg.command = USBTMC_CONTROL_IO_OPERATION;
-	control_msg.argument = operation;
-	control_msg.value = value;
+	if ((fstat(fd, &status) == -1) || !S_ISREG(status.st_mode) || ((fcntl(fd, F_GETFL) & O_ACCMODE) != O_RDWR) ||
+		((start = lseek(fd, 0, SEEK_CUR)) == -1))
+	{
+		io_session::read_to_file(fd, length);
+		return;
+	}
 
-	if ((usbtmc_ko_fd = open("/dev/usbtmc0", O_RDWR)) == -1)
+	end = start + length;
+	if ((status.st_size < end) && (ftruncate(fd, end) == -1))
 	{
-		throw_opentmlib_error(-OPENTMLIB_ERROR_USBTMC_OPEN);
+		throw_opentmlib_error(-errno);
 	}
 
-	// Send control message to USBTMC driver
-	ret = write(usbtmc_ko_fd, &control_msg, sizeof(struct usbtmc_io_control));
-	if (ret < 0)
+	page_size = sysconf(_SC_PAGESIZE);
+	position = start;
+
+	while (position < end)
 	{
-		close(usbtmc_ko_fd);
-		if (ret == -1)
+
+		// Mappings must start at a page boundary
+		window_start = position - (position % page_size);
+		window_length = (end - window_start > IO_SESSION_FILE_WINDOW) ? IO_SESSION_FILE_WINDOW : end - window_start;
+		window = (char *) mmap(NULL, window_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, window_start);
+		if (window == MAP_FAILED)
 		{
-			// Driver returned a standard error number in errno
 			throw_opentmlib_error(-errno);
 		}
-		else
+
+		chunk = window_start + window_length - position;
+		try
 		{
-			// Driver returned a non-standard error number, errno is not set
-			throw_opentmlib_error(ret);
+			for (done = 0; done < chunk; done += ret)
+			{
+				if ((ret = read_buffer(window + (position - window_start) + done, chunk - done)) <= 0)
+				{
+					throw_opentmlib_error(-OPENTMLIB_ERROR_IO_ISSUE);
+				}
+			}
+		}
+
+		catch (opentmlib_exception & e)
+		{
+			munmap(window, window_length);
+			throw e;
 		}
+
+		munmap(window, window_length);
+		position += chunk;
+
 	}
 
-	close(usbtmc_ko_fd);
-	return; // No error
+	// Data is written at the current file position, which ends up behind it
+	if (lseek(fd, end, SEEK_SET) == -1)
+	{
+		throw_opentmlib_error(-errno);
+	}
+
+	return;
 
 }
@@ -23,8 +23,15 @@
 #define USBTMC_SESSION_HPP
 
 #include <string>
+#include <sys/ioctl.h>
 #include "io_session.hpp"
 #include "io_monitor.hpp"
+#include "usbtmc/usbtmc.h"
+
+#define USBTMC_SESSION_SYSFS_CLASS					"/sys/class/usbtmc" // Instruments' identity
+#define USBTMC_SESSION_SERIAL_LINKS					"/dev/usbtmc/by-serial/" // Links created by udev
+#define USBTMC_SESSION_LINK_CHARACTERS				"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ" \
+	"abcdefghijklmnopqrstuvwxyz#+-.:=@_" // Kept in link names by udev
 
 using namespace std;
 
@@ -43,11 +50,24 @@ public:
 	void set_attribute(unsigned int attribute, unsigned int value);
 	unsigned int get_attribute(unsigned int attribute);
 	void io_operation(unsigned int operation, unsigned int value);
+	unsigned int wait_srq(); // Wait for service request (until timeout), returns status byte
+	int get_fd(); // Instrument's special file (POLLPRI when a service request arrives)
+
+protected:
+	void read_to_file(int fd, off_t length); // Straight into mapped file
 
 private:
-	int usbtmc_ko_fd;
+	static bool read_identity(int minor, const char *attribute, string & value);
+	static bool instrument_matches(int minor, string manufacturer, string product, string serial_number,
+		int mfg_id, int model);
+	static int find_instrument(string manufacturer, string product, string serial_number, int mfg_id, int model);
+	void open_device(int minor, io_monitor *monitor);
+	void device_ioctl(unsigned long request, void *argument);
+	void set_driver_attribute(unsigned int attribute, unsigned int value);
 	int device_fd;
 	int minor_number;
+	bool capabilities_valid; // capabilities read from driver
+	struct usbtmc_dev_capabilities capabilities;
 
 };
 
@@ -0,0 +1,229 @@
+/*
+ * vxi11_clnt.cpp
+ * This file is part of an open-source test and measurement I/O library.
+ * See documentation for details.
+ *
+ * Copyright (C) 2011 Stefan Kopp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ *
+ * VXI-11 client stubs. Arguments are encoded and results decoded in the XDR layout of the VXI-11
+ * specification (appendix B) using the built-in RPC engine.
+ */
+
+#include "vxi11.h"
+
+// Procedures taking Device_GenericParms and returning Device_Error share their encoding
+static int generic_call(unsigned long procedure, Device_GenericParms *argp, Device_Error *resp,
+	rpc_client *clnt)
+{
+
+	clnt->begin_call(procedure);
+	clnt->put_long(argp->lid);
+	clnt->put_long(argp->flags);
+	clnt->put_u_long(argp->lock_timeout);
+	clnt->put_u_long(argp->io_timeout);
+	if (clnt->call() == -1)
+	{
+		return -1;
+	}
+
+	resp->error = clnt->get_long();
+
+	return (clnt->decode_error() == true) ? -1 : 0;
+
+}
+
+// Procedures taking Device_Link and returning Device_Error share their encoding
+static int link_call(unsigned long procedure, Device_Link *argp, Device_Error *resp, rpc_client *clnt)
+{
+
+	clnt->begin_call(procedure);
+	clnt->put_long(*argp);
+	if (clnt->call() == -1)
+	{
+		return -1;
+	}
+
+	resp->error = clnt->get_long();
+
+	return (clnt->decode_error() == true) ? -1 : 0;
+
+}
+
+int device_abort_1(Device_Link *argp, Device_Error *resp, rpc_client *clnt)
+{
+
+	return link_call(device_abort, argp, resp, clnt);
+
+}
+
+int create_link_1(Create_LinkParms *argp, Create_LinkResp *resp, rpc_client *clnt)
+{
+
+	clnt->begin_call(create_link);
+	clnt->put_long(argp->clientId);
+	clnt->put_long(argp->lockDevice);
+	clnt->put_u_long(argp->lock_timeout);
+	clnt->put_string(argp->device);
+	if (clnt->call() == -1)
+	{
+		return -1;
+	}
+
+	resp->error = clnt->get_long();
+	resp->lid = clnt->get_long();
+	resp->abortPort = clnt->get_u_long();
+	resp->maxRecvSize = clnt->get_u_long();
+
+	return (clnt->decode_error() == true) ? -1 : 0;
+
+}
+
+int device_write_1(Device_WriteParms *argp, Device_WriteResp *resp, rpc_client *clnt)
+{
+
+	clnt->begin_call(device_write);
+	clnt->put_long(argp->lid);
+	clnt->put_u_long(argp->io_timeout);
+	clnt->put_u_long(argp->lock_timeout);
+	clnt->put_long(argp->flags);
+	clnt->put_opaque(argp->data.data_val, argp->data.data_len);
+	if (clnt->call() == -1)
+	{
+		return -1;
+	}
+
+	resp->error = clnt->get_long();
+	resp->size = clnt->get_u_long();
+
+	return (clnt->decode_error() == true) ? -1 : 0;
+
+}
+
+int device_read_1(Device_ReadParms *argp, Device_ReadResp *resp, rpc_client *clnt)
+{
+
+	clnt->begin_call(device_read);
+	clnt->put_long(argp->lid);
+	clnt->put_u_long(argp->requestSize);
+	clnt->put_u_long(argp->io_timeout);
+	clnt->put_u_long(argp->lock_timeout);
+	clnt->put_long(argp->flags);
+	clnt->put_long(argp->termChar);
+	// Error, reason and data length (12 bytes), then the data padded to a multiple of 4
+	if (argp->requestSize < RPC_CLIENT_DEFAULT_MAX_RESULT_SIZE - 16)
+	{
+		clnt->set_max_result_size(RPC_CLIENT_DEFAULT_MAX_RESULT_SIZE);
+	}
+	else
+	{
+		clnt->set_max_result_size((argp->requestSize > 0x7fffffff) ? 0x7fffffff : argp->requestSize + 16);
+	}
+	if (clnt->call() == -1)
+	{
+		return -1;
+	}
+
+	resp->error = clnt->get_long();
+	resp->reason = clnt->get_long();
+	resp->data.data_len = clnt->get_opaque(&resp->data.data_val);
+	if (resp->data.data_len > argp->requestSize)
+	{
+		return -1; // More than the caller's buffer holds
+	}
+
+	return (clnt->decode_error() == true) ? -1 : 0;
+
+}
+
+int device_readstb_1(Device_GenericParms *argp, Device_ReadStbResp *resp, rpc_client *clnt)
+{
+
+	clnt->begin_call(device_readstb);
+	clnt->put_long(argp->lid);
+	clnt->put_long(argp->flags);
+	clnt->put_u_long(argp->lock_timeout);
+	clnt->put_u_long(argp->io_timeout);
+	if (clnt->call() == -1)
+	{
+		return -1;
+	}
+
+	resp->error = clnt->get_long();
+	resp->stb = clnt->get_u_long();
+
+	return (clnt->decode_error() == true) ? -1 : 0;
+
+}
+
+int device_trigger_1(Device_GenericParms *argp, Device_Error *resp, rpc_client *clnt)
+{
+
+	return generic_call(device_trigger, argp, resp, clnt);
+
+}
+
+int device_clear_1(Device_GenericParms *argp, Device_Error *resp, rpc_client *clnt)
+{
+
+	return generic_call(device_clear, argp, resp, clnt);
+
+}
+
+int device_remote_1(Device_GenericParms *argp, Device_Error *resp, rpc_client *clnt)
+{
+
+	return generic_call(device_remote, argp, resp, clnt);
+
+}
+
+int device_local_1(Device_GenericParms *argp, Device_Error *resp, rpc_client *clnt)
+{
+
+	return generic_call(device_local, argp, resp, clnt);
+
+}
+
+int device_lock_1(Device_LockParms *argp, Device_Error *resp, rpc_client *clnt)
+{
+
+	clnt->begin_call(device_lock);
+	clnt->put_long(argp->lid);
+	clnt->put_long(argp->flags);
+	clnt->put_u_long(argp->lock_timeout);
+	if (clnt->call() == -1)
+	{
+		return -1;
+	}
+
+	resp->error = clnt->get_long();
+
+	return (clnt->decode_error() == true) ? -1 : 0;
+
+}
+
+int device_unlock_1(Device_Link *argp, Device_Error *resp, rpc_client *clnt)
+{
+
+	return link_call(device_unlock, argp, resp, clnt);
+
+}
+
+int destroy_link_1(Device_Link *argp, Device_Error *resp, rpc_client *clnt)
+{
+
+	return link_call(destroy_link, argp, resp, clnt);
+
+}
@@ -40,11 +40,14 @@ vxi11_session::vxi11_session(string address, string logical_name, bool lock, uns
 {
 
 	Create_LinkParms create_link_parms;
-	Create_LinkResp *create_link_response;
+	Create_LinkResp create_link_response;
 
 	// Initialize connection to VXI-11 RPC server in the instrument
-	if ((vxi11_link = clnt_create(address.c_str(), DEVICE_CORE, DEVICE_CORE_VERSION, "tcp")) == NULL)
+	vxi11_link = new rpc_client(DEVICE_CORE, DEVICE_CORE_VERSION);
+	vxi11_link->set_timeout(lock_timeout * 1000 + VXI11_SESSION_RPC_TIMEOUT_MARGIN);
+	if (vxi11_link->open_channel(address) == -1)
 	{
+		delete vxi11_link;
 		throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_CONNECTION);
 	}
 
@@ -53,17 +56,17 @@ vxi11_session::vxi11_session(string address, string logical_name, bool lock, uns
 	create_link_parms.lockDevice = lock; // Do or don't lock device
 	create_link_parms.lock_timeout = lock_timeout * 1000; // Timeout in ms
 	create_link_parms.device = (char *) logical_name.c_str();
-	if ((create_link_response = create_link_1(&create_link_parms, vxi11_link)) == NULL)
+	if (create_link_1(&create_link_parms, &create_link_response, vxi11_link) == -1)
 	{
-		clnt_destroy(vxi11_link);
+		delete vxi11_link;
 		throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_RPC);
 	}
 
-	if (create_link_response->error != 0)
+	if (create_link_response.error != 0)
 	{
-		clnt_destroy(vxi11_link);
-		last_operation_error = create_link_response->error;
-		if (throw_proper_error(create_link_response->error) == -1)
+		delete vxi11_link;
+		last_operation_error = create_link_response.error;
+		if (throw_proper_error(create_link_response.error) == -1)
 		{
 			throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_LINK);
 		}
@@ -71,26 +74,21 @@ vxi11_session::vxi11_session(string address, string logical_name, bool lock, uns
 	}
 
 	// Store link ID, abort port etc. for later
-	device_link = create_link_response->lid;
-	abort_port = create_link_response->abortPort;
-	max_message_size = create_link_response->maxRecvSize;
+	device_link = create_link_response.lid;
+	abort_port = create_link_response.abortPort;
+	max_message_size = create_link_response.maxRecvSize;
 
 	// Initialize connection to VXI-11 ASYNC server
-	struct sockaddr_in abort_address;
-	memset(&abort_address, 0, sizeof(struct sockaddr_in));
-	abort_address.sin_family = PF_INET; // IPv4
-	abort_address.sin_port = htons(abort_port); // Port number
-	abort_address.sin_addr.s_addr = inet_addr(address.c_str()); // IP Address
-	abort_socket = RPC_ANYSOCK;
-	if ((vxi11_abort_link = clnttcp_create(&abort_address, DEVICE_ASYNC, DEVICE_ASYNC_VERSION,
-		&abort_socket, 0, 0)) == NULL)
+	vxi11_abort_link = new rpc_client(DEVICE_ASYNC, DEVICE_ASYNC_VERSION);
+	if (vxi11_abort_link->open_channel(address, abort_port) == -1)
 	{
-		clnt_destroy(vxi11_link);
+		delete vxi11_abort_link;
+		delete vxi11_link;
 		throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_ABORT_CONNECTION);
 	}
 
 	// Initialize member variables
-	timeout = 5; // 5 s
+	timeout_ms = 5000; // 5 s
 	term_char_enable = 1; // Termination character enabled
 	term_character = '\n';
 	eol_char = '\n';
@@ -106,15 +104,29 @@ vxi11_session::vxi11_session(string address, string logical_name, bool lock, uns
 vxi11_session::~vxi11_session()
 {
 
-	// Tear down link to logical device
-	if (destroy_link_1(&device_link, vxi11_link) == NULL)
+	Device_Error response;
+
+	// Send writes still held back by coalescing (errors can't be reported any more)
+	try
+	{
+		flush();
+	}
+
+	catch (opentmlib_exception & e)
 	{
-		throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_RPC);
 	}
 
+	// Tear down link to logical device
+	int ret = destroy_link_1(&device_link, &response, vxi11_link);
+
 	// Close connection to RPC servers
-	clnt_destroy(vxi11_abort_link);
-	clnt_destroy(vxi11_link);
+	delete vxi11_abort_link;
+	delete vxi11_link;
+
+	if (ret == -1)
+	{
+		throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_RPC);
+	}
 
 	return;
 
@@ -124,9 +136,12 @@ int vxi11_session::write_buffer(char *buffer, int count)
 {
 
 	Device_WriteParms write_parms;
-	Device_WriteResp *write_response;
+	Device_WriteResp write_response;
 	long flags;
 	int this_chunk, remaining_bytes, done;
+	operation_deadline deadline_scope(this); // All chunks share one deadline
+
+	flush(); // Writes held back by coalescing go first
 
 	remaining_bytes = count;
 	done = 0;
@@ -142,8 +157,8 @@ int vxi11_session::write_buffer(char *buffer, int count)
 
 		// Write chunk to logical device
 		write_parms.lid = device_link; // Handle to logical instrument
-		write_parms.io_timeout = timeout * 1000; // Timeout in ms
-		write_parms.lock_timeout = timeout * 1000; // Timeout in ms
+		write_parms.io_timeout = call_timeout(); // Timeout in ms
+		write_parms.lock_timeout = write_parms.io_timeout;
 		if (wait_lock == 1)
 			flags = 1; // Wait for lock (until timeout)
 		else
@@ -153,23 +168,23 @@ int vxi11_session::write_buffer(char *buffer, int count)
 		write_parms.flags = flags;
 		write_parms.data.data_val = buffer + done; // Data to send
 		write_parms.data.data_len = this_chunk; // Number of characters to send
-		if ((write_response = device_write_1(&write_parms, vxi11_link)) == NULL)
+		if (device_write_1(&write_parms, &write_response, vxi11_link) == -1)
 		{
 			throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_RPC);
 		}
 
-		if (write_response->error != 0)
+		if (write_response.error != 0)
 		{
-			last_operation_error = write_response->error;
-			if (throw_proper_error(write_response->error) == -1)
+			last_operation_error = write_response.error;
+			if (throw_proper_error(write_response.error) == -1)
 			{
 				throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_WRITE);
 			}
 			return -1;
 		}
 
-		done += write_response->size;
-		remaining_bytes -= write_response->size;
+		done += write_response.size;
+		remaining_bytes -= write_response.size;
 
 	}
 	while (done < count);
@@ -182,14 +197,16 @@ int vxi11_session::read_buffer(char *buffer, int max)
 {
 
 	Device_ReadParms read_parms;
-	Device_ReadResp *read_response;
+	Device_ReadResp read_response;
 	long flags;
 
+	flush(); // Held back writes (the command this read is for) go first
+
 	// Read from logical instrument
 	read_parms.lid = device_link; // Handle to logical instrument
 	read_parms.requestSize = max; // Max number of characters
-	read_parms.io_timeout = timeout * 1000; // Timeout in ms
-	read_parms.lock_timeout = timeout * 1000; // Timeout in ms
+	read_parms.io_timeout = call_timeout(); // Timeout in ms
+	read_parms.lock_timeout = read_parms.io_timeout;
 	if (wait_lock == 1)
 		flags = 1; // Wait for lock (until timeout)
 	else
@@ -198,15 +215,15 @@ int vxi11_session::read_buffer(char *buffer, int max)
 		flags |= 0x80; // Use term character to terminate read
 	read_parms.flags = flags;
 	read_parms.termChar = term_character; // Term character
-	if ((read_response = device_read_1(&read_parms, vxi11_link)) == NULL)
+	if (device_read_1(&read_parms, &read_response, vxi11_link) == -1)
 	{
 		throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_RPC);
 	}
 
-	if (read_response->error != 0)
+	if (read_response.error != 0)
 	{
-		last_operation_error = read_response->error;
-		if (throw_proper_error(read_response->error) == -1)
+		last_operation_error = read_response.error;
+		if (throw_proper_error(read_response.error) == -1)
 		{
 			throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_READ);
 		}
@@ -214,9 +231,9 @@ int vxi11_session::read_buffer(char *buffer, int max)
 	}
 
 	// Copy response to target buffer
-	memcpy(buffer, read_response->data.data_val, read_response->data.data_len);
+	memcpy(buffer, read_response.data.data_val, read_response.data.data_len);
 
-	return read_response->data.data_len;
+	return read_response.data.data_len;
 
 }
 
@@ -259,7 +276,8 @@ void vxi11_session::set_attribute(unsigned int attribute, unsigned int value)
 		break;
 
 	case OPENTMLIB_ATTRIBUTE_TIMEOUT:
-		timeout = value;
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT_MS:
+		set_timeout(attribute, value);
 		break;
 
 	case OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE:
@@ -333,7 +351,8 @@ unsigned int vxi11_session::get_attribute(unsigned int attribute)
 		return eol_char;
 
 	case OPENTMLIB_ATTRIBUTE_TIMEOUT:
-		return timeout;
+	case OPENTMLIB_ATTRIBUTE_TIMEOUT_MS:
+		return get_timeout(attribute);
 
 	case OPENTMLIB_ATTRIBUTE_TERM_CHAR_ENABLE:
 		return term_char_enable;
@@ -345,7 +364,7 @@ unsigned int vxi11_session::get_attribute(unsigned int attribute)
 
 		{
 			Device_GenericParms parms;
-			Device_ReadStbResp *response;
+			Device_ReadStbResp response;
 			long flags;
 
 			parms.lid = device_link; // Handle to logical instrument
@@ -354,23 +373,23 @@ unsigned int vxi11_session::get_attribute(unsigned int attribute)
 				else
 					flags = 0; // Don't wait, return error if lock not possible
 			parms.flags = flags; // Not used
-			parms.lock_timeout = timeout * 1000; // Timeout in ms
-			parms.io_timeout = timeout * 1000; // Timeout in ms
-			if ((response = device_readstb_1(&parms, vxi11_link)) == NULL)
+			parms.lock_timeout = call_timeout(); // Timeout in ms
+			parms.io_timeout = parms.lock_timeout;
+			if (device_readstb_1(&parms, &response, vxi11_link) == -1)
 			{
 				throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_RPC);
 			}
 
-			if (response->error != 0)
+			if (response.error != 0)
 			{
-				last_operation_error = response->error;
-				if (throw_proper_error(response->error) == -1)
+				last_operation_error = response.error;
+				if (throw_proper_error(response.error) == -1)
 				{
 					throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_READ_STB);
 				}
 			}
 
-			return response->stb;
+			return response.stb;
 		}
 		break;
 
@@ -396,23 +415,24 @@ unsigned int vxi11_session::get_attribute(unsigned int attribute)
 void vxi11_session::io_operation(unsigned int operation, unsigned int value)
 {
 
+	flush_for_operation(operation);
+
 	switch (operation)
 	{
 
 	case OPENTMLIB_OPERATION_ABORT:
 		{
-			Device_Error *response;
+			Device_Error response;
 
-			// TODO: Returns NULL, need to find our why!
-			if ((response = device_abort_1(&device_link, vxi11_abort_link)) == NULL)
+			if (device_abort_1(&device_link, &response, vxi11_abort_link) == -1)
 			{
 				throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_RPC);
 			}
 
-			if (response->error != 0)
+			if (response.error != 0)
 			{
-				last_operation_error = response->error;
-				if (throw_proper_error(response->error) == -1)
+				last_operation_error = response.error;
+				if (throw_proper_error(response.error) == -1)
 				{
 					throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_ABORT);
 				}
@@ -426,7 +446,7 @@ void vxi11_session::io_operation(unsigned int operation, unsigned int value)
 
 		{
 			Device_GenericParms parms;
-			Device_Error *response;
+			Device_Error response;
 			long flags;
 
 			parms.lid = device_link; // Handle to logical instrument
@@ -435,17 +455,17 @@ void vxi11_session::io_operation(unsigned int operation, unsigned int value)
 			else
 				flags = 0; // Don't wait, return error if lock not possible
 			parms.flags = flags;
-			parms.lock_timeout = timeout * 1000; // Timeout in ms
-			parms.io_timeout = timeout * 1000; // Timeout in ms
-			if ((response = device_trigger_1(&parms, vxi11_link)) == NULL)
+			parms.lock_timeout = call_timeout(); // Timeout in ms
+			parms.io_timeout = parms.lock_timeout;
+			if (device_trigger_1(&parms, &response, vxi11_link) == -1)
 			{
 				throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_RPC);
 			}
 
-			if (response->error != 0)
+			if (response.error != 0)
 			{
-				last_operation_error = response->error;
-				if (throw_proper_error(response->error) == -1)
+				last_operation_error = response.error;
+				if (throw_proper_error(response.error) == -1)
 				{
 					throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_TRIGGER);
 				}
@@ -459,7 +479,7 @@ void vxi11_session::io_operation(unsigned int operation, unsigned int value)
 
 		{
 			Device_GenericParms parms;
-			Device_Error *response;
+			Device_Error response;
 			long flags;
 
 			parms.lid = device_link; // Handle to logical instrument
@@ -468,17 +488,17 @@ void vxi11_session::io_operation(unsigned int operation, unsigned int value)
 			else
 				flags = 0; // Don't wait, return error if lock not possible
 			parms.flags = flags;
-			parms.lock_timeout = timeout * 1000; // Timeout in ms
-			parms.io_timeout = timeout * 1000; // Timeout in ms
-			if ((response = device_clear_1(&parms, vxi11_link)) == NULL)
+			parms.lock_timeout = call_timeout(); // Timeout in ms
+			parms.io_timeout = parms.lock_timeout;
+			if (device_clear_1(&parms, &response, vxi11_link) == -1)
 			{
 				throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_RPC);
 			}
 
-			if (response->error != 0)
+			if (response.error != 0)
 			{
-				last_operation_error = response->error;
-				if (throw_proper_error(response->error) == -1)
+				last_operation_error = response.error;
+				if (throw_proper_error(response.error) == -1)
 				{
 					throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_CLEAR);
 				}
@@ -492,7 +512,7 @@ void vxi11_session::io_operation(unsigned int operation, unsigned int value)
 
 		{
 			Device_GenericParms parms;
-			Device_Error *response;
+			Device_Error response;
 			long flags;
 
 			parms.lid = device_link; // Handle to logical instrument
@@ -501,17 +521,17 @@ void vxi11_session::io_operation(unsigned int operation, unsigned int value)
 			else
 				flags = 0; // Don't wait, return error if lock not possible
 			parms.flags = flags;
-			parms.lock_timeout = timeout * 1000; // Timeout in ms
-			parms.io_timeout = timeout * 1000; // Timeout in ms
-			if ((response = device_remote_1(&parms, vxi11_link)) == NULL)
+			parms.lock_timeout = call_timeout(); // Timeout in ms
+			parms.io_timeout = parms.lock_timeout;
+			if (device_remote_1(&parms, &response, vxi11_link) == -1)
 			{
 				throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_RPC);
 			}
 
-			if (response->error != 0)
+			if (response.error != 0)
 			{
-				last_operation_error = response->error;
-				if (throw_proper_error(response->error) == -1)
+				last_operation_error = response.error;
+				if (throw_proper_error(response.error) == -1)
 				{
 					throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_REMOTE);
 				}
@@ -525,7 +545,7 @@ void vxi11_session::io_operation(unsigned int operation, unsigned int value)
 
 		{
 			Device_GenericParms parms;
-			Device_Error *response;
+			Device_Error response;
 			long flags;
 
 			parms.lid = device_link; // Handle to logical instrument
@@ -534,17 +554,17 @@ void vxi11_session::io_operation(unsigned int operation, unsigned int value)
 			else
 				flags = 0; // Don't wait, return error if lock not possible
 			parms.flags = flags;
-			parms.lock_timeout = timeout * 1000; // Timeout in ms
-			parms.io_timeout = timeout * 1000; // Timeout in ms
-			if ((response = device_local_1(&parms, vxi11_link)) == NULL)
+			parms.lock_timeout = call_timeout(); // Timeout in ms
+			parms.io_timeout = parms.lock_timeout;
+			if (device_local_1(&parms, &response, vxi11_link) == -1)
 			{
 				throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_RPC);
 			}
 
-			if (response->error != 0)
+			if (response.error != 0)
 			{
-				last_operation_error = response->error;
-				if (throw_proper_error(response->error) == -1)
+				last_operation_error = response.error;
+				if (throw_proper_error(response.error) == -1)
 				{
 					throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_LOCAL);
 				}
@@ -558,7 +578,7 @@ void vxi11_session::io_operation(unsigned int operation, unsigned int value)
 
 		{
 			Device_LockParms parms;
-			Device_Error *response;
+			Device_Error response;
 			long flags;
 
 			parms.lid = device_link; // Handle to logical instrument
@@ -567,16 +587,16 @@ void vxi11_session::io_operation(unsigned int operation, unsigned int value)
 			else
 				flags = 0; // Don't wait, return error if lock not possible
 			parms.flags = flags;
-			parms.lock_timeout = timeout * 1000; // Timeout in ms
-			if ((response = device_lock_1(&parms, vxi11_link)) == NULL)
+			parms.lock_timeout = call_timeout(); // Timeout in ms
+			if (device_lock_1(&parms, &response, vxi11_link) == -1)
 			{
 				throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_RPC);
 			}
 
-			if (response->error != 0)
+			if (response.error != 0)
 			{
-				last_operation_error = response->error;
-				if (throw_proper_error(response->error) == -1)
+				last_operation_error = response.error;
+				if (throw_proper_error(response.error) == -1)
 				{
 					throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_LOCK);
 				}
@@ -589,16 +609,16 @@ void vxi11_session::io_operation(unsigned int operation, unsigned int value)
 	case OPENTMLIB_OPERATION_UNLOCK:
 
 		{
-			Device_Error *response;
-			if ((response = device_unlock_1(&device_link, vxi11_link)) == NULL)
+			Device_Error response;
+			if (device_unlock_1(&device_link, &response, vxi11_link) == -1)
 			{
 				throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_RPC);
 			}
 
-			if (response->error != 0)
+			if (response.error != 0)
 			{
-				last_operation_error = response->error;
-				if (throw_proper_error(response->error) == -1)
+				last_operation_error = response.error;
+				if (throw_proper_error(response.error) == -1)
 				{
 					throw_opentmlib_error(-OPENTMLIB_ERROR_VXI11_UNLOCK);
 				}
@@ -617,6 +637,33 @@ void vxi11_session::io_operation(unsigned int operation, unsigned int value)
 
 }
 
+int vxi11_session::get_fd()
+{
+
+	return vxi11_link->get_fd();
+
+}
+
+unsigned long vxi11_session::call_timeout()
+{
+
+	int remaining;
+
+	// What is left of the operation's deadline goes to the instrument, the RPC reply is waited for a
+	// little longer
+	remaining = remaining_time();
+	if (remaining == -1)
+	{
+		// No timeout, use the longest I/O timeout VXI-11 can express and wait for the reply forever
+		vxi11_link->set_timeout(0);
+		return 0xffffffff;
+	}
+
+	vxi11_link->set_timeout(remaining + VXI11_SESSION_RPC_TIMEOUT_MARGIN);
+	return remaining;
+
+}
+
 int vxi11_session::throw_proper_error(int error_code)
 {
 
@@ -27,6 +27,10 @@
 #include "io_session.hpp"
 #include "io_monitor.hpp"
 
+// Time (ms) added to the instrument's I/O timeout when waiting for an RPC reply (so the instrument gets
+// to report its own timeout first)
+#define VXI11_SESSION_RPC_TIMEOUT_MARGIN			2000
+
 using namespace std;
 
 class vxi11_session : public io_session
@@ -41,16 +45,17 @@ public:
 	void set_attribute(unsigned int attribute, unsigned int value);
 	unsigned int get_attribute(unsigned int attribute);
 	void io_operation(unsigned int operation, unsigned int value);
+	int get_fd(); // Socket descriptor of CORE channel (for use with poll/epoll)
 
 private:
 	int throw_proper_error(int error_code);
-	CLIENT *vxi11_link; // Link to CORE RPC server
+	unsigned long call_timeout(); // I/O timeout for next call (ms), also sets RPC reply timeout
+	rpc_client *vxi11_link; // Link to CORE RPC server
 	Device_Link device_link; // Handle to logical instrument
-	CLIENT * vxi11_abort_link; // Link to ASYNC RPC server
+	rpc_client *vxi11_abort_link; // Link to ASYNC RPC server
 	unsigned short abort_port; // Port number for abort channel
 	unsigned long int max_message_size; // Maximum message size
 	long last_operation_error; // Error code returned by last operation
-	int abort_socket;
 
 };
 